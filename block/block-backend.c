@@ -71,6 +71,9 @@ struct BlockBackend {
     int quiesce_counter;
     VMChangeStateEntry *vmsh;
     bool force_allow_inactivate;
+
+    /* Requests run in the AioContext of the submitting thread */
+    bool multiqueue;
 };
 
 typedef struct BlockBackendAIOCB {
@@ -1182,6 +1185,15 @@ static void error_callback_bh(void *opaque)
     qemu_aio_unref(acb);
 }
 
+/* AioContext in which AIO requests submitted by the current thread run */
+static AioContext *blk_request_aio_context(BlockBackend *blk)
+{
+    if (blk->multiqueue) {
+        return qemu_get_current_aio_context();
+    }
+    return blk_get_aio_context(blk);
+}
+
 BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
                                   BlockCompletionFunc *cb,
                                   void *opaque, int ret)
@@ -1193,7 +1205,8 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->blk = blk;
     acb->ret = ret;
 
-    aio_bh_schedule_oneshot(blk_get_aio_context(blk), error_callback_bh, acb);
+    aio_bh_schedule_oneshot(blk_request_aio_context(blk), error_callback_bh,
+                            acb);
     return &acb->common;
 }
 
@@ -1229,6 +1242,7 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 BdrvRequestFlags flags,
                                 BlockCompletionFunc *cb, void *opaque)
 {
+    AioContext *ctx = blk_request_aio_context(blk);
     BlkAioEmAIOCB *acb;
     Coroutine *co;
 
@@ -1245,12 +1259,11 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     acb->has_returned = false;
 
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    aio_co_enter(ctx, co);
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        aio_bh_schedule_oneshot(blk_get_aio_context(blk),
-                                blk_aio_complete_bh, acb);
+        aio_bh_schedule_oneshot(ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
@@ -1741,6 +1754,23 @@ static AioContext *blk_aiocb_get_aio_context(BlockAIOCB *acb)
     return blk_get_aio_context(blk_acb->blk);
 }
 
+/*
+ * Let threads other than the one of blk_get_aio_context() submit AIO
+ * requests concurrently.  Each request then runs and completes in the
+ * AioContext of the thread that submitted it.  Before enabling this, the
+ * caller must check bdrv_supports_multiqueue() on the root node and make
+ * sure that I/O throttling is not in use.
+ */
+void blk_set_multiqueue(BlockBackend *blk, bool multiqueue)
+{
+    blk->multiqueue = multiqueue;
+}
+
+bool blk_get_multiqueue(BlockBackend *blk)
+{
+    return blk->multiqueue;
+}
+
 void blk_set_aio_context(BlockBackend *blk, AioContext *new_context)
 {
     BlockDriverState *bs = blk_bs(blk);
@@ -1827,6 +1857,51 @@ int coroutine_fn blk_co_pwrite_zeroes(BlockBackend *blk, int64_t offset,
                           flags | BDRV_REQ_ZERO_WRITE);
 }
 
+int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
+                                   BlockBackend *blk_out, int64_t off_out,
+                                   int bytes, BdrvRequestFlags flags)
+{
+    int ret;
+    BlockDriverState *bs_in = blk_bs(blk_in);
+    BlockDriverState *bs_out = blk_bs(blk_out);
+
+    trace_blk_co_copy_range(blk_in, bs_in, off_in, blk_out, bs_out, off_out,
+                            bytes, flags);
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs_in);
+    bdrv_inc_in_flight(bs_out);
+
+    /* throttling disk I/O, the copy counts as a read of the source and a
+     * write to the destination */
+    if (blk_in->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(
+                &blk_in->public.throttle_group_member, bytes, false);
+    }
+    if (blk_out->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(
+                &blk_out->public.throttle_group_member, bytes, true);
+    }
+
+    if (!blk_out->enable_write_cache) {
+        flags |= BDRV_REQ_FUA;
+    }
+
+    ret = bdrv_co_copy_range(blk_in->root, off_in, blk_out->root, off_out,
+                             bytes, flags);
+    bdrv_dec_in_flight(bs_out);
+    bdrv_dec_in_flight(bs_in);
+    return ret;
+}
+
 int blk_pwrite_compressed(BlockBackend *blk, int64_t offset, const void *buf,
                           int count)
 {
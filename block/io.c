@@ -450,19 +450,25 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
-static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
+static void coroutine_fn mark_request_serialising(BdrvTrackedRequest *req,
+                                                  uint64_t align)
 {
+    BlockDriverState *bs = req->bs;
     int64_t overlap_offset = req->offset & ~(align - 1);
     unsigned int overlap_bytes = ROUND_UP(req->offset + req->bytes, align)
                                - overlap_offset;
 
     if (!req->serialising) {
-        atomic_inc(&req->bs->serialising_in_flight);
+        atomic_inc(&bs->serialising_in_flight);
         req->serialising = true;
     }
 
+    /* wait_serialising_requests() may be reading the overlap range from
+     * another thread if the node is used by a multiqueue BlockBackend. */
+    qemu_co_mutex_lock(&bs->reqs_lock);
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
 /**
@@ -527,6 +533,15 @@ void bdrv_wakeup(BlockDriverState *bs)
     if (atomic_read(&bs->wakeup)) {
         aio_bh_schedule_oneshot(qemu_get_aio_context(), dummy_bh_cb, NULL);
     }
+    if (atomic_read(&bs->home_waiters)) {
+        AioContext *ctx = bdrv_get_aio_context(bs);
+
+        /* A request of a multiqueue BlockBackend completed in another
+         * IOThread than the one polling in BDRV_POLL_WHILE.  */
+        if (ctx != qemu_get_current_aio_context()) {
+            aio_bh_schedule_oneshot(ctx, dummy_bh_cb, NULL);
+        }
+    }
 }
 
 void bdrv_dec_in_flight(BlockDriverState *bs)
@@ -1736,6 +1751,205 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BdrvChild *src,
+                                                    uint64_t src_offset,
+                                                    BdrvChild *dst,
+                                                    uint64_t dst_offset,
+                                                    uint64_t bytes,
+                                                    BdrvRequestFlags flags,
+                                                    bool recurse_src)
+{
+    BdrvTrackedRequest req;
+    BlockDriverState *bs;
+    int ret;
+
+    if (!src || !src->bs || !src->bs->drv ||
+        !dst || !dst->bs || !dst->bs->drv) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_byte_request(src->bs, src_offset, bytes);
+    if (ret) {
+        return ret;
+    }
+    ret = bdrv_check_byte_request(dst->bs, dst_offset, bytes);
+    if (ret) {
+        return ret;
+    }
+
+    if (!src->bs->drv->bdrv_co_copy_range_from ||
+        !dst->bs->drv->bdrv_co_copy_range_to ||
+        src->bs->encrypted || dst->bs->encrypted) {
+        return -ENOTSUP;
+    }
+
+    /* Partial blocks would need a read-modify-write cycle, leave them to the
+     * bounce buffer path */
+    if (!QEMU_IS_ALIGNED(src_offset | bytes, src->bs->bl.request_alignment) ||
+        !QEMU_IS_ALIGNED(dst_offset | bytes, dst->bs->bl.request_alignment)) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        bs = src->bs;
+        bdrv_inc_in_flight(bs);
+        tracked_request_begin(&req, bs, src_offset, bytes, BDRV_TRACKED_READ);
+
+        if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+            wait_serialising_requests(&req);
+        }
+
+        ret = bs->drv->bdrv_co_copy_range_from(bs, src, src_offset,
+                                               dst, dst_offset, bytes, flags);
+    } else {
+        int64_t end_sector = DIV_ROUND_UP(dst_offset + bytes,
+                                          BDRV_SECTOR_SIZE);
+
+        bs = dst->bs;
+        if (bs->read_only || bdrv_has_readonly_bitmaps(bs)) {
+            return -EPERM;
+        }
+        assert(!(bs->open_flags & BDRV_O_INACTIVE));
+        assert(dst->perm & BLK_PERM_WRITE);
+        assert(end_sector <= bs->total_sectors ||
+               dst->perm & BLK_PERM_RESIZE);
+
+        bdrv_inc_in_flight(bs);
+        tracked_request_begin(&req, bs, dst_offset, bytes,
+                              BDRV_TRACKED_WRITE);
+        wait_serialising_requests(&req);
+
+        ret = notifier_with_return_list_notify(&bs->before_write_notifiers,
+                                               &req);
+        if (!ret) {
+            ret = bs->drv->bdrv_co_copy_range_to(bs, src, src_offset,
+                                                 dst, dst_offset, bytes,
+                                                 flags);
+        }
+
+        /* Nothing has been written if the driver could not offload the copy,
+         * so only account for the write if something may have changed. */
+        if (ret != -ENOTSUP) {
+            atomic_inc(&bs->write_gen);
+            bdrv_set_dirty(bs, dst_offset, bytes);
+            stat64_max(&bs->wr_highest_offset, dst_offset + bytes);
+            if (ret >= 0) {
+                bs->total_sectors = MAX(bs->total_sectors, end_sector);
+            }
+        }
+    }
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+/* Copy range from @src to @dst.
+ *
+ * See the comment of bdrv_co_copy_range for the parameter and return value
+ * semantics. */
+int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, uint64_t src_offset,
+                                         BdrvChild *dst, uint64_t dst_offset,
+                                         uint64_t bytes,
+                                         BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_from(src, src_offset, dst, dst_offset, bytes,
+                                  flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, true);
+}
+
+/* Copy range from @src to @dst.
+ *
+ * See the comment of bdrv_co_copy_range for the parameter and return value
+ * semantics. */
+int coroutine_fn bdrv_co_copy_range_to(BdrvChild *src, uint64_t src_offset,
+                                       BdrvChild *dst, uint64_t dst_offset,
+                                       uint64_t bytes,
+                                       BdrvRequestFlags flags)
+{
+    trace_bdrv_co_copy_range_to(src, src_offset, dst, dst_offset, bytes,
+                                flags);
+    return bdrv_co_copy_range_internal(src, src_offset, dst, dst_offset,
+                                       bytes, flags, false);
+}
+
+/* Copy @bytes from @src to @dst through a bounce buffer, in chunks no larger
+ * than either node's maximum transfer size and at most 1 MB. */
+static int coroutine_fn bdrv_co_copy_range_bounce(BdrvChild *src,
+                                                  uint64_t src_offset,
+                                                  BdrvChild *dst,
+                                                  uint64_t dst_offset,
+                                                  uint64_t bytes,
+                                                  BdrvRequestFlags flags)
+{
+    BdrvRequestFlags read_flags = flags & BDRV_REQ_NO_SERIALISING;
+    BdrvRequestFlags write_flags = flags & BDRV_REQ_FUA;
+    uint64_t chunk = MIN_NON_ZERO(MIN_NON_ZERO(src->bs->bl.max_transfer,
+                                               dst->bs->bl.max_transfer),
+                                  1 * M_BYTE);
+    uint8_t *buf;
+    int ret = 0;
+
+    trace_bdrv_co_copy_range_bounce(src, src_offset, dst, dst_offset, bytes);
+
+    buf = qemu_try_blockalign(dst->bs, MIN(chunk, bytes));
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    while (bytes) {
+        unsigned int n = MIN(chunk, bytes);
+        QEMUIOVector qiov;
+        struct iovec iov = {
+            .iov_base = buf,
+            .iov_len  = n,
+        };
+
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_preadv(src, src_offset, n, &qiov, read_flags);
+        if (ret < 0) {
+            break;
+        }
+        ret = bdrv_co_pwritev(dst, dst_offset, n, &qiov, write_flags);
+        if (ret < 0) {
+            break;
+        }
+
+        src_offset += n;
+        dst_offset += n;
+        bytes -= n;
+    }
+
+    qemu_vfree(buf);
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range(BdrvChild *src, uint64_t src_offset,
+                                    BdrvChild *dst, uint64_t dst_offset,
+                                    uint64_t bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    if (!bytes) {
+        return 0;
+    }
+
+    /* Drivers are not expected to implement FUA for offloaded copies, so
+     * emulate it with a flush once the whole range has been copied */
+    ret = bdrv_co_copy_range_from(src, src_offset, dst, dst_offset, bytes,
+                                  flags & ~(BDRV_REQ_NO_FALLBACK |
+                                            BDRV_REQ_FUA));
+    if (ret == 0 && (flags & BDRV_REQ_FUA)) {
+        ret = bdrv_co_flush(dst->bs);
+    }
+    if (ret != -ENOTSUP || (flags & BDRV_REQ_NO_FALLBACK)) {
+        return ret;
+    }
+
+    return bdrv_co_copy_range_bounce(src, src_offset, dst, dst_offset, bytes,
+                                     flags);
+}
+
 /*
  * Flush ALL BDSes regardless of if they are reachable via a BlkBackend or not.
  */
@@ -2689,14 +2903,20 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
 
 void bdrv_io_plug(BlockDriverState *bs)
 {
+    BlockDriver *drv = bs->drv;
     BdrvChild *child;
 
     QLIST_FOREACH(child, &bs->children, next) {
         bdrv_io_plug(child->bs);
     }
 
-    if (atomic_fetch_inc(&bs->io_plugged) == 0) {
-        BlockDriver *drv = bs->drv;
+    if (drv && drv->supports_multiqueue) {
+        /* bs->io_plugged would mix up plugs from different IOThreads; the
+         * driver counts them per AioContext instead. */
+        if (drv->bdrv_io_plug) {
+            drv->bdrv_io_plug(bs);
+        }
+    } else if (atomic_fetch_inc(&bs->io_plugged) == 0) {
         if (drv && drv->bdrv_io_plug) {
             drv->bdrv_io_plug(bs);
         }
@@ -2705,14 +2925,20 @@ void bdrv_io_plug(BlockDriverState *bs)
 
 void bdrv_io_unplug(BlockDriverState *bs)
 {
+    BlockDriver *drv = bs->drv;
     BdrvChild *child;
 
-    assert(bs->io_plugged);
-    if (atomic_fetch_dec(&bs->io_plugged) == 1) {
-        BlockDriver *drv = bs->drv;
-        if (drv && drv->bdrv_io_unplug) {
+    if (drv && drv->supports_multiqueue) {
+        if (drv->bdrv_io_unplug) {
             drv->bdrv_io_unplug(bs);
         }
+    } else {
+        assert(bs->io_plugged);
+        if (atomic_fetch_dec(&bs->io_plugged) == 1) {
+            if (drv && drv->bdrv_io_unplug) {
+                drv->bdrv_io_unplug(bs);
+            }
+        }
     }
 
     QLIST_FOREACH(child, &bs->children, next) {
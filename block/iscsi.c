@@ -91,7 +91,10 @@ typedef struct IscsiLun {
     bool lbprz;
     bool dpofua;
     bool has_write_same;
+    bool has_xcopy;
     bool request_timed_out;
+    /* LU designator used as target descriptor for EXTENDED COPY, or NULL */
+    struct scsi_inquiry_device_designator *dd;
 } IscsiLun;
 
 typedef struct IscsiTask {
@@ -1707,6 +1710,35 @@ static QemuOptsList runtime_opts = {
     },
 };
 
+/* Remember the LU designator that identifies the LUN in EXTENDED COPY
+ * target descriptors.  NAA designators are preferred over T10 vendor ID
+ * based ones.  An identification descriptor has room for 20 bytes of
+ * designator, longer ones cannot be used. */
+static void iscsi_save_designator(IscsiLun *lun,
+                                  struct scsi_inquiry_device_identification *inq_di)
+{
+    struct scsi_inquiry_device_designator *desig, *copy = NULL;
+
+    for (desig = inq_di->designators; desig; desig = desig->next) {
+        if (desig->association ||
+            desig->designator_type > SCSI_DESIGNATOR_TYPE_NAA ||
+            desig->designator_length > 20) {
+            continue;
+        }
+        if (!copy || copy->designator_type < desig->designator_type) {
+            copy = desig;
+        }
+    }
+    if (copy) {
+        lun->dd = g_new(struct scsi_inquiry_device_designator, 1);
+        *lun->dd = *copy;
+        lun->dd->next = NULL;
+        lun->dd->designator = g_malloc(copy->designator_length);
+        memcpy(lun->dd->designator, copy->designator,
+               copy->designator_length);
+    }
+}
+
 static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
                       Error **errp)
 {
@@ -1715,6 +1747,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     struct scsi_task *task = NULL;
     struct scsi_inquiry_standard *inq = NULL;
     struct scsi_inquiry_supported_pages *inq_vpd;
+    struct scsi_inquiry_device_identification *inq_di;
     char *initiator_name = NULL;
     QemuOpts *opts;
     Error *local_err = NULL;
@@ -1838,6 +1871,7 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
     iscsilun->aio_context = bdrv_get_aio_context(bs);
     iscsilun->lun = lun;
     iscsilun->has_write_same = true;
+    iscsilun->has_xcopy = true;
 
     task = iscsi_do_inquiry(iscsilun->iscsi, iscsilun->lun, 0, 0,
                             (void **) &inq, errp);
@@ -1915,6 +1949,17 @@ static int iscsi_open(BlockDriverState *bs, QDict *options, int flags,
                    sizeof(struct scsi_inquiry_block_limits));
             scsi_free_scsi_task(inq_task);
             break;
+        case SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION:
+            inq_task = iscsi_do_inquiry(iscsilun->iscsi, iscsilun->lun, 1,
+                                    SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION,
+                                    (void **) &inq_di, errp);
+            if (inq_task == NULL) {
+                ret = -EINVAL;
+                goto out;
+            }
+            iscsi_save_designator(iscsilun, inq_di);
+            scsi_free_scsi_task(inq_task);
+            break;
         default:
             break;
         }
@@ -1969,6 +2014,10 @@ static void iscsi_close(BlockDriverState *bs)
     iscsi_destroy_context(iscsi);
     g_free(iscsilun->zeroblock);
     iscsi_allocmap_free(iscsilun);
+    if (iscsilun->dd) {
+        g_free(iscsilun->dd->designator);
+        g_free(iscsilun->dd);
+    }
     qemu_mutex_destroy(&iscsilun->mutex);
     memset(iscsilun, 0, sizeof(IscsiLun));
 }
@@ -2148,6 +2197,233 @@ static void iscsi_invalidate_cache(BlockDriverState *bs,
     iscsi_allocmap_invalidate(iscsilun);
 }
 
+/* EXTENDED COPY (LID1) parameter list layout, see SPC-4 6.4 */
+#define XCOPY_DESC_OFFSET             16
+#define IDENT_DESCR_TGT_DESCR_SIZE    32
+#define XCOPY_BLK2BLK_SEG_DESC_SIZE   28
+#define XCOPY_MAX_BLOCKS              65535
+
+static void iscsi_xcopy_populate_header(uint8_t *buf, int list_id, int str,
+                                        int list_id_usage, int prio,
+                                        int tgt_desc_len, int seg_desc_len,
+                                        int inline_data_len)
+{
+    buf[0] = list_id;
+    buf[1] = ((str & 1) << 5) | ((list_id_usage & 3) << 3) | (prio & 7);
+    stw_be_p(&buf[2], tgt_desc_len);
+    stl_be_p(&buf[8], seg_desc_len);
+    stl_be_p(&buf[12], inline_data_len);
+}
+
+/* Identification descriptor CSCD descriptor for @lun */
+static void iscsi_xcopy_populate_tgt_desc(uint8_t *desc, IscsiLun *lun)
+{
+    struct scsi_inquiry_device_designator *dd = lun->dd;
+
+    desc[0] = 0xE4; /* IDENT_DESCR_TGT_DESCR */
+    desc[4] = dd->code_set;
+    desc[5] = (dd->designator_type & 0xF) | ((dd->association & 3) << 4);
+    /* longer designators are not saved by iscsi_save_designator() */
+    assert(dd->designator_length <= 20);
+    desc[7] = dd->designator_length;
+    memcpy(desc + 8, dd->designator, dd->designator_length);
+
+    /* Device type specific parameters: disk block length */
+    desc[29] = (lun->block_size >> 16) & 0xFF;
+    desc[30] = (lun->block_size >> 8) & 0xFF;
+    desc[31] = lun->block_size & 0xFF;
+}
+
+/* Block device to block device segment descriptor */
+static void iscsi_xcopy_populate_seg_desc(uint8_t *desc, int src_index,
+                                          int dst_index, int num_blocks,
+                                          uint64_t src_lba, uint64_t dst_lba)
+{
+    assert(num_blocks <= XCOPY_MAX_BLOCKS);
+
+    desc[0] = 0x02; /* BLK_TO_BLK_SEG_DESCR */
+    /* The descriptor length doesn't include the first four bytes */
+    stw_be_p(&desc[2], XCOPY_BLK2BLK_SEG_DESC_SIZE - 4);
+    stw_be_p(&desc[4], src_index);
+    stw_be_p(&desc[6], dst_index);
+    stw_be_p(&desc[10], num_blocks);
+    stq_be_p(&desc[12], src_lba);
+    stq_be_p(&desc[20], dst_lba);
+}
+
+static void iscsi_xcopy_data(struct iscsi_data *data,
+                             IscsiLun *src, uint64_t src_lba,
+                             IscsiLun *dst, uint64_t dst_lba,
+                             int num_blocks)
+{
+    const int src_offset = XCOPY_DESC_OFFSET;
+    const int dst_offset = src_offset + IDENT_DESCR_TGT_DESCR_SIZE;
+    const int seg_offset = dst_offset + IDENT_DESCR_TGT_DESCR_SIZE;
+    uint8_t *buf;
+
+    data->size = seg_offset + XCOPY_BLK2BLK_SEG_DESC_SIZE;
+    data->data = g_malloc0(data->size);
+    buf = data->data;
+
+    /* One source and one destination CSCD descriptor, one segment; the list
+     * ID is not used to query the copy status, so let the copy manager
+     * discard it (LIST ID USAGE 11b) */
+    iscsi_xcopy_populate_header(buf, 0, 0, 3, 0,
+                                2 * IDENT_DESCR_TGT_DESCR_SIZE,
+                                XCOPY_BLK2BLK_SEG_DESC_SIZE, 0);
+    iscsi_xcopy_populate_tgt_desc(&buf[src_offset], src);
+    iscsi_xcopy_populate_tgt_desc(&buf[dst_offset], dst);
+    iscsi_xcopy_populate_seg_desc(&buf[seg_offset], 0, 1, num_blocks,
+                                  src_lba, dst_lba);
+}
+
+static struct scsi_task *iscsi_xcopy_task(int param_len)
+{
+    struct scsi_task *task;
+
+    task = malloc(sizeof(struct scsi_task));
+    if (task == NULL) {
+        return NULL;
+    }
+    memset(task, 0, sizeof(struct scsi_task));
+
+    task->cdb[0]     = EXTENDED_COPY;
+    stl_be_p(&task->cdb[10], param_len);
+    task->cdb_size   = 16;
+    task->xfer_dir   = SCSI_XFER_WRITE;
+    task->expxferlen = param_len;
+
+    return task;
+}
+
+static int coroutine_fn iscsi_co_xcopy(IscsiLun *src_lun, uint64_t src_lba,
+                                       IscsiLun *dst_lun, uint64_t dst_lba,
+                                       int num_blocks)
+{
+    struct IscsiTask iTask;
+    struct iscsi_data data;
+    int r = 0;
+
+    iscsi_xcopy_data(&data, src_lun, src_lba, dst_lun, dst_lba, num_blocks);
+    iscsi_co_init_iscsitask(dst_lun, &iTask);
+
+    qemu_mutex_lock(&dst_lun->mutex);
+retry:
+    iTask.task = iscsi_xcopy_task(data.size);
+    if (iTask.task == NULL) {
+        r = -ENOMEM;
+        goto out_unlock;
+    }
+    if (iscsi_scsi_command_async(dst_lun->iscsi, dst_lun->lun, iTask.task,
+                                 iscsi_co_generic_cb, &data, &iTask) != 0) {
+        scsi_free_scsi_task(iTask.task);
+        r = -EIO;
+        goto out_unlock;
+    }
+
+    while (!iTask.complete) {
+        iscsi_set_events(dst_lun);
+        qemu_mutex_unlock(&dst_lun->mutex);
+        qemu_coroutine_yield();
+        qemu_mutex_lock(&dst_lun->mutex);
+    }
+
+    if (iTask.status == SCSI_STATUS_CHECK_CONDITION &&
+        iTask.task->sense.key == SCSI_SENSE_ILLEGAL_REQUEST &&
+        (iTask.task->sense.ascq == SCSI_SENSE_ASCQ_INVALID_OPERATION_CODE ||
+         iTask.task->sense.ascq == SCSI_SENSE_ASCQ_INVALID_FIELD_IN_CDB ||
+         iTask.task->sense.ascq ==
+         SCSI_SENSE_ASCQ_INVALID_FIELD_IN_PARAMETER_LIST)) {
+        /* The target has no copy manager, or one that does not take our
+         * descriptors: make the caller fall back to reading and writing
+         * the data itself, and do not try again on this LUN */
+        dst_lun->has_xcopy = false;
+        scsi_free_scsi_task(iTask.task);
+        r = -ENOTSUP;
+        goto out_unlock;
+    }
+
+    if (iTask.task != NULL) {
+        scsi_free_scsi_task(iTask.task);
+        iTask.task = NULL;
+    }
+
+    if (iTask.do_retry) {
+        iTask.complete = 0;
+        goto retry;
+    }
+
+    if (iTask.status != SCSI_STATUS_GOOD) {
+        r = iTask.err_code;
+        goto out_unlock;
+    }
+
+    iscsi_allocmap_set_allocated(dst_lun,
+                                 dst_lba * dst_lun->block_size
+                                 >> BDRV_SECTOR_BITS,
+                                 num_blocks * dst_lun->block_size
+                                 >> BDRV_SECTOR_BITS);
+
+out_unlock:
+    qemu_mutex_unlock(&dst_lun->mutex);
+    g_free(data.data);
+    return r;
+}
+
+static int coroutine_fn iscsi_co_copy_range_from(BlockDriverState *bs,
+                                                 BdrvChild *src,
+                                                 uint64_t src_offset,
+                                                 BdrvChild *dst,
+                                                 uint64_t dst_offset,
+                                                 uint64_t bytes,
+                                                 BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_to(src, src_offset, dst, dst_offset, bytes,
+                                 flags);
+}
+
+static int coroutine_fn iscsi_co_copy_range_to(BlockDriverState *bs,
+                                               BdrvChild *src,
+                                               uint64_t src_offset,
+                                               BdrvChild *dst,
+                                               uint64_t dst_offset,
+                                               uint64_t bytes,
+                                               BdrvRequestFlags flags)
+{
+    IscsiLun *dst_lun = dst->bs->opaque;
+    IscsiLun *src_lun;
+    int block_size;
+    int ret = 0;
+
+    if (src->bs->drv->bdrv_co_copy_range_to != iscsi_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+    src_lun = src->bs->opaque;
+
+    if (!src_lun->dd || !dst_lun->dd || !dst_lun->has_xcopy) {
+        return -ENOTSUP;
+    }
+    block_size = dst_lun->block_size;
+    if (src_lun->block_size != block_size ||
+        src_offset % block_size || dst_offset % block_size ||
+        bytes % block_size) {
+        return -ENOTSUP;
+    }
+
+    /* A block to block segment descriptor covers at most 65535 blocks */
+    while (bytes && ret == 0) {
+        int num_blocks = MIN(bytes / block_size, XCOPY_MAX_BLOCKS);
+
+        ret = iscsi_co_xcopy(src_lun, src_offset / block_size,
+                             dst_lun, dst_offset / block_size, num_blocks);
+        src_offset += (uint64_t)num_blocks * block_size;
+        dst_offset += (uint64_t)num_blocks * block_size;
+        bytes -= (uint64_t)num_blocks * block_size;
+    }
+
+    return ret;
+}
+
 static QemuOptsList iscsi_create_opts = {
     .name = "iscsi-create-opts",
     .head = QTAILQ_HEAD_INITIALIZER(iscsi_create_opts.head),
@@ -2186,6 +2462,8 @@ static BlockDriver bdrv_iscsi = {
     .bdrv_co_readv         = iscsi_co_readv,
     .bdrv_co_writev_flags  = iscsi_co_writev_flags,
     .bdrv_co_flush_to_disk = iscsi_co_flush,
+    .bdrv_co_copy_range_from = iscsi_co_copy_range_from,
+    .bdrv_co_copy_range_to  = iscsi_co_copy_range_to,
 
 #ifdef __linux__
     .bdrv_aio_ioctl   = iscsi_aio_ioctl,
@@ -2221,6 +2499,8 @@ static BlockDriver bdrv_iser = {
     .bdrv_co_readv         = iscsi_co_readv,
     .bdrv_co_writev_flags  = iscsi_co_writev_flags,
     .bdrv_co_flush_to_disk = iscsi_co_flush,
+    .bdrv_co_copy_range_from = iscsi_co_copy_range_from,
+    .bdrv_co_copy_range_to  = iscsi_co_copy_range_to,
 
 #ifdef __linux__
     .bdrv_aio_ioctl   = iscsi_aio_ioctl,
@@ -19,7 +19,9 @@
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
+ * Queue size (per-AioContext).  There is one LinuxAioState per AioContext,
+ * and file-posix submits to the one of the thread that issues the request,
+ * so a multiqueue BlockBackend gets an io_context_t for each IOThread.
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
  *      tunable by the guest.  If we get more outstanding requests at a time
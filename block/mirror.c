@@ -73,6 +73,7 @@ typedef struct MirrorBlockJob {
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
+    bool use_copy_range;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -174,6 +175,29 @@ static void mirror_read_complete(void *opaque, int ret)
     aio_context_release(blk_get_aio_context(s->common.blk));
 }
 
+static void coroutine_fn mirror_co_copy_range(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    ret = blk_co_copy_range(s->common.blk, op->offset, s->target, op->offset,
+                            op->bytes, BDRV_REQ_NO_FALLBACK);
+    if (ret >= 0) {
+        mirror_write_complete(op, ret);
+        return;
+    }
+
+    trace_mirror_copy_range_fail(s, op->offset, op->bytes, ret);
+    if (ret == -ENOTSUP) {
+        s->use_copy_range = false;
+    }
+    /* Retry through the bounce buffer, which can tell read errors from write
+     * errors for the error actions */
+    blk_aio_preadv(s->common.blk, op->offset, &op->qiov, 0,
+                   mirror_read_complete, op);
+}
+
 /* Clip bytes relative to offset to not exceed end-of-file */
 static inline int64_t mirror_clip_bytes(MirrorBlockJob *s,
                                         int64_t offset,
@@ -291,7 +315,12 @@ static uint64_t mirror_do_read(MirrorBlockJob *s, int64_t offset,
     s->bytes_in_flight += bytes;
     trace_mirror_one_iteration(s, offset, bytes);
 
-    blk_aio_preadv(source, offset, &op->qiov, 0, mirror_read_complete, op);
+    if (s->use_copy_range) {
+        Coroutine *co = qemu_coroutine_create(mirror_co_copy_range, op);
+        qemu_coroutine_enter(co);
+    } else {
+        blk_aio_preadv(source, offset, &op->qiov, 0, mirror_read_complete, op);
+    }
     return ret;
 }
 
@@ -1033,6 +1062,24 @@ static int coroutine_fn bdrv_mirror_top_pwritev(BlockDriverState *bs,
     return bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
 }
 
+static int coroutine_fn bdrv_mirror_top_copy_range_from(
+    BlockDriverState *bs, BdrvChild *src, uint64_t src_offset,
+    BdrvChild *dst, uint64_t dst_offset, uint64_t bytes,
+    BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(bs->backing, src_offset, dst, dst_offset,
+                                   bytes, flags);
+}
+
+static int coroutine_fn bdrv_mirror_top_copy_range_to(
+    BlockDriverState *bs, BdrvChild *src, uint64_t src_offset,
+    BdrvChild *dst, uint64_t dst_offset, uint64_t bytes,
+    BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_to(src, src_offset, bs->backing, dst_offset,
+                                 bytes, flags);
+}
+
 static int coroutine_fn bdrv_mirror_top_flush(BlockDriverState *bs)
 {
     if (bs->backing == NULL) {
@@ -1093,6 +1140,8 @@ static BlockDriver bdrv_mirror_top = {
     .bdrv_co_pwritev            = bdrv_mirror_top_pwritev,
     .bdrv_co_pwrite_zeroes      = bdrv_mirror_top_pwrite_zeroes,
     .bdrv_co_pdiscard           = bdrv_mirror_top_pdiscard,
+    .bdrv_co_copy_range_from    = bdrv_mirror_top_copy_range_from,
+    .bdrv_co_copy_range_to      = bdrv_mirror_top_copy_range_to,
     .bdrv_co_flush              = bdrv_mirror_top_flush,
     .bdrv_co_get_block_status   = bdrv_co_get_block_status_from_backing,
     .bdrv_refresh_filename      = bdrv_mirror_top_refresh_filename,
@@ -1219,6 +1268,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->use_copy_range = true;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -47,10 +47,9 @@ static void nbd_recv_coroutines_wake_all(NBDClientSession *s)
     }
 }
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(BlockDriverState *bs,
+                                    NBDClientSession *client)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-
     if (!client->ioc) { /* Already closed */
         return;
     }
@@ -61,7 +60,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
                          NULL);
     BDRV_POLL_WHILE(bs, client->read_reply_co);
 
-    nbd_client_detach_aio_context(bs);
+    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
     object_unref(OBJECT(client->sioc));
     client->sioc = NULL;
     object_unref(OBJECT(client->ioc));
@@ -118,11 +117,40 @@ static coroutine_fn void nbd_read_reply_entry(void *opaque)
     s->read_reply_co = NULL;
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/* Pick the connection with the fewest requests in flight.  The search
+ * starts at a rotating position, so that ties are spread over all
+ * connections instead of always landing on the first one. */
+static NBDClientSession *nbd_pick_session(BlockDriverState *bs)
+{
+    NBDClientConns *conns = nbd_get_client_conns(bs);
+    NBDClientSession *best = NULL;
+    int i;
+
+    if (conns->num_sessions <= 1) {
+        return &conns->sessions[0];
+    }
+
+    for (i = 0; i < conns->num_sessions; i++) {
+        NBDClientSession *s =
+            &conns->sessions[(conns->next_session + i) % conns->num_sessions];
+
+        if (s->quit) {
+            continue;
+        }
+        if (!best || s->in_flight < best->in_flight) {
+            best = s;
+        }
+    }
+    conns->next_session++;
+
+    /* If all connections are dead, let the request fail on the first one */
+    return best ?: &conns->sessions[0];
+}
+
+static int nbd_co_send_request(NBDClientSession *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    NBDClientSession *s = nbd_get_client_session(bs);
     int rc, i;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -228,6 +256,43 @@ static int nbd_parse_offset_hole_payload(NBDStructuredReplyChunk *chunk,
     return 0;
 }
 
+/* nbd_parse_blockstatus_payload
+ * support only one extent in reply and only for the negotiated context
+ */
+static int nbd_parse_blockstatus_payload(NBDClientSession *client,
+                                         NBDStructuredReplyChunk *chunk,
+                                         uint8_t *payload, uint64_t orig_length,
+                                         NBDExtent *extent, Error **errp)
+{
+    uint32_t context_id;
+
+    if (chunk->length != sizeof(context_id) + sizeof(*extent)) {
+        error_setg(errp, "Protocol error: invalid payload for "
+                         "NBD_REPLY_TYPE_BLOCK_STATUS");
+        return -EINVAL;
+    }
+
+    context_id = payload_advance32(&payload);
+    if (client->info.context_id != context_id) {
+        error_setg(errp, "Protocol error: unexpected context id %" PRIu32
+                         " for NBD_REPLY_TYPE_BLOCK_STATUS, when negotiated "
+                         "context id is %" PRIu32, context_id,
+                         client->info.context_id);
+        return -EINVAL;
+    }
+
+    extent->length = payload_advance32(&payload);
+    extent->flags = payload_advance32(&payload);
+
+    if (extent->length == 0 || extent->length > orig_length) {
+        error_setg(errp, "Protocol error: server sent status chunk with "
+                         "invalid length");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 /* nbd_parse_error_payload
  * on success @errp contains message describing nbd error reply
  */
@@ -633,12 +698,72 @@ static int nbd_co_receive_cmdread_reply(NBDClientSession *s, uint64_t handle,
     return iter.ret;
 }
 
+static int nbd_co_receive_blockstatus_reply(NBDClientSession *s,
+                                            uint64_t handle, uint64_t length,
+                                            NBDExtent *extent, Error **errp)
+{
+    NBDReplyChunkIter iter;
+    NBDReply reply;
+    void *payload = NULL;
+    Error *local_err = NULL;
+    bool received = false;
+
+    NBD_FOREACH_REPLY_CHUNK(s, iter, handle, true, NULL, &reply, &payload)
+    {
+        int ret;
+        NBDStructuredReplyChunk *chunk = &reply.structured;
+
+        assert(nbd_reply_is_structured(&reply));
+
+        switch (chunk->type) {
+        case NBD_REPLY_TYPE_BLOCK_STATUS:
+            if (received) {
+                s->quit = true;
+                error_setg(&local_err, "Several BLOCK_STATUS chunks in reply");
+                nbd_iter_error(&iter, true, -EINVAL, &local_err);
+                break;
+            }
+            received = true;
+
+            ret = nbd_parse_blockstatus_payload(s, &reply.structured,
+                                                payload, length, extent,
+                                                &local_err);
+            if (ret < 0) {
+                s->quit = true;
+                nbd_iter_error(&iter, true, ret, &local_err);
+            }
+            break;
+        default:
+            if (!nbd_reply_type_is_error(chunk->type)) {
+                /* not allowed reply type */
+                s->quit = true;
+                error_setg(&local_err,
+                           "Unexpected reply type: %d (%s) "
+                           "for CMD_BLOCK_STATUS",
+                           chunk->type, nbd_reply_type_lookup(chunk->type));
+                nbd_iter_error(&iter, true, -EINVAL, &local_err);
+            }
+        }
+
+        g_free(payload);
+        payload = NULL;
+    }
+
+    if (!received && iter.ret == 0) {
+        error_setg(errp, "Server did not reply with any status extents");
+        return -EIO;
+    }
+
+    error_propagate(errp, iter.err);
+    return iter.ret;
+}
+
 static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
                           QEMUIOVector *write_qiov)
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_session(bs);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -647,7 +772,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     } else {
         assert(request->type != NBD_CMD_WRITE);
     }
-    ret = nbd_co_send_request(bs, request, write_qiov);
+    ret = nbd_co_send_request(client, request, write_qiov);
     if (ret < 0) {
         return ret;
     }
@@ -664,7 +789,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 {
     int ret;
     Error *local_err = NULL;
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientSession *client = nbd_pick_session(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -674,7 +799,7 @@ int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     assert(bytes <= NBD_MAX_BUFFER_SIZE);
     assert(!flags);
 
-    ret = nbd_co_send_request(bs, &request, NULL);
+    ret = nbd_co_send_request(client, &request, NULL);
     if (ret < 0) {
         return ret;
     }
@@ -763,32 +888,104 @@ int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset, int bytes)
     return nbd_co_request(bs, &request, NULL);
 }
 
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file)
+{
+    int64_t ret;
+    NBDExtent extent = { 0 };
+    NBDClientSession *client = nbd_pick_session(bs);
+    Error *local_err = NULL;
+    uint64_t offset = sector_num << BDRV_SECTOR_BITS;
+    NBDRequest request = {
+        .type = NBD_CMD_BLOCK_STATUS,
+        .from = offset,
+        .len = MIN((uint64_t)nb_sectors << BDRV_SECTOR_BITS,
+                   QEMU_ALIGN_DOWN(UINT32_MAX, bs->bl.request_alignment)),
+        .flags = NBD_CMD_FLAG_REQ_ONE,
+    };
+
+    *file = bs;
+    if (!client->info.base_allocation) {
+        *pnum = nb_sectors;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
+    }
+
+    ret = nbd_co_send_request(client, &request, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = nbd_co_receive_blockstatus_reply(client, request.handle, request.len,
+                                           &extent, &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (extent.length < BDRV_SECTOR_SIZE) {
+        /* Sub-sector extent, can't be represented here: assume data */
+        *pnum = 1;
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID | offset;
+    }
+    *pnum = extent.length >> BDRV_SECTOR_BITS;
+
+    if (client->info.x_dirty_bitmap) {
+        /* Report dirty areas as data and clean ones as unallocated, so that
+         * the bitmap can be inspected with e.g. qemu-img map */
+        ret = extent.flags & NBD_STATE_DIRTY ? BDRV_BLOCK_DATA : 0;
+    } else {
+        ret = (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
+              (extent.flags & NBD_STATE_ZERO ? BDRV_BLOCK_ZERO : 0);
+    }
+
+    return ret | BDRV_BLOCK_OFFSET_VALID | offset;
+}
+
 void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
+    NBDClientConns *conns = nbd_get_client_conns(bs);
+    int i;
+
+    for (i = 0; i < conns->num_sessions; i++) {
+        NBDClientSession *client = &conns->sessions[i];
+        qio_channel_detach_aio_context(QIO_CHANNEL(client->ioc));
+    }
 }
 
 void nbd_client_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
-    qio_channel_attach_aio_context(QIO_CHANNEL(client->ioc), new_context);
-    aio_co_schedule(new_context, client->read_reply_co);
+    NBDClientConns *conns = nbd_get_client_conns(bs);
+    int i;
+
+    for (i = 0; i < conns->num_sessions; i++) {
+        NBDClientSession *client = &conns->sessions[i];
+        qio_channel_attach_aio_context(QIO_CHANNEL(client->ioc), new_context);
+        aio_co_schedule(new_context, client->read_reply_co);
+    }
 }
 
 void nbd_client_close(BlockDriverState *bs)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConns *conns = nbd_get_client_conns(bs);
     NBDRequest request = { .type = NBD_CMD_DISC };
+    int i;
 
-    if (client->ioc == NULL) {
-        return;
-    }
+    for (i = 0; i < conns->num_sessions; i++) {
+        NBDClientSession *client = &conns->sessions[i];
 
-    nbd_send_request(client->ioc, &request);
+        if (client->ioc == NULL) {
+            continue;
+        }
 
-    nbd_teardown_connection(bs);
+        nbd_send_request(client->ioc, &request);
+
+        nbd_teardown_connection(bs, client);
+    }
 }
 
 int nbd_client_init(BlockDriverState *bs,
@@ -796,17 +993,25 @@ int nbd_client_init(BlockDriverState *bs,
                     const char *export,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
+                    const char *x_dirty_bitmap,
                     Error **errp)
 {
-    NBDClientSession *client = nbd_get_client_session(bs);
+    NBDClientConns *conns = nbd_get_client_conns(bs);
+    NBDClientSession *client, *first;
     int ret;
 
+    assert(conns->num_sessions < NBD_MAX_CONNECTIONS);
+    client = &conns->sessions[conns->num_sessions];
+    first = &conns->sessions[0];
+
     /* NBD handshake */
     logout("session init %s\n", export);
     qio_channel_set_blocking(QIO_CHANNEL(sioc), true, NULL);
 
     client->info.request_sizes = true;
     client->info.structured_reply = true;
+    client->info.base_allocation = true;
+    client->info.x_dirty_bitmap = x_dirty_bitmap;
     ret = nbd_receive_negotiate(QIO_CHANNEL(sioc), export,
                                 tlscreds, hostname,
                                 &client->ioc, &client->info, errp);
@@ -814,6 +1019,19 @@ int nbd_client_init(BlockDriverState *bs,
         logout("Failed to negotiate with the NBD server\n");
         return ret;
     }
+    if (client != first &&
+        (client->info.size != first->info.size ||
+         client->info.flags != first->info.flags ||
+         client->info.structured_reply != first->info.structured_reply ||
+         client->info.base_allocation != first->info.base_allocation)) {
+        error_setg(errp, "Server sent different export information on an "
+                   "additional connection");
+        if (client->ioc) {
+            object_unref(OBJECT(client->ioc));
+            client->ioc = NULL;
+        }
+        return -EINVAL;
+    }
     if (client->info.flags & NBD_FLAG_SEND_FUA) {
         bs->supported_write_flags = BDRV_REQ_FUA;
         bs->supported_zero_flags |= BDRV_REQ_FUA;
@@ -839,7 +1057,9 @@ int nbd_client_init(BlockDriverState *bs,
      * kick the reply mechanism.  */
     qio_channel_set_blocking(QIO_CHANNEL(sioc), false, NULL);
     client->read_reply_co = qemu_coroutine_create(nbd_read_reply_entry, client);
-    nbd_client_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    qio_channel_attach_aio_context(client->ioc, bdrv_get_aio_context(bs));
+    aio_co_schedule(bdrv_get_aio_context(bs), client->read_reply_co);
+    conns->num_sessions++;
 
     logout("Established connection with NBD server\n");
     return 0;
@@ -16,6 +16,7 @@
 #endif
 
 #define MAX_NBD_REQUESTS    16
+#define NBD_MAX_CONNECTIONS 16
 
 typedef struct {
     Coroutine *coroutine;
@@ -38,6 +39,16 @@ typedef struct NBDClientSession {
     bool quit;
 } NBDClientSession;
 
+/* All connections of one nbd node.  Connections beyond the first are only
+ * opened if the server advertises NBD_FLAG_CAN_MULTI_CONN; the export
+ * information negotiated on the first one applies to all of them. */
+typedef struct NBDClientConns {
+    NBDClientSession sessions[NBD_MAX_CONNECTIONS];
+    int num_sessions;
+    unsigned int next_session; /* where the search for an idle one starts */
+} NBDClientConns;
+
+NBDClientConns *nbd_get_client_conns(BlockDriverState *bs);
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs);
 
 int nbd_client_init(BlockDriverState *bs,
@@ -45,6 +56,7 @@ int nbd_client_init(BlockDriverState *bs,
                     const char *export_name,
                     QCryptoTLSCreds *tlscreds,
                     const char *hostname,
+                    const char *x_dirty_bitmap,
                     Error **errp);
 void nbd_client_close(BlockDriverState *bs);
 
@@ -56,6 +68,10 @@ int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                 int bytes, BdrvRequestFlags flags);
 int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                          uint64_t bytes, QEMUIOVector *qiov, int flags);
+int64_t coroutine_fn nbd_client_co_get_block_status(BlockDriverState *bs,
+                                                    int64_t sector_num,
+                                                    int nb_sectors, int *pnum,
+                                                    BlockDriverState **file);
 
 void nbd_client_detach_aio_context(BlockDriverState *bs);
 void nbd_client_attach_aio_context(BlockDriverState *bs,
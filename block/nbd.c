@@ -43,11 +43,13 @@
 #define EN_OPTSTR ":exportname="
 
 typedef struct BDRVNBDState {
-    NBDClientSession client;
+    NBDClientConns conns;
 
     /* For nbd_refresh_filename() */
     SocketAddress *saddr;
     char *export, *tlscredsid;
+    char *x_dirty_bitmap;
+    uint64_t connections;
 } BDRVNBDState;
 
 static int nbd_parse_uri(const char *filename, QDict *options)
@@ -302,7 +304,13 @@ done:
 NBDClientSession *nbd_get_client_session(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
-    return &s->client;
+    return &s->conns.sessions[0];
+}
+
+NBDClientConns *nbd_get_client_conns(BlockDriverState *bs)
+{
+    BDRVNBDState *s = bs->opaque;
+    return &s->conns;
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -388,6 +396,18 @@ static QemuOptsList nbd_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of the TLS credentials to use",
         },
+        {
+            .name = "x-dirty-bitmap",
+            .type = QEMU_OPT_STRING,
+            .help = "experimental: expose named dirty bitmap in place of "
+                    "block status",
+        },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to open if the server supports "
+                    "multi-conn (default: 1)",
+        },
     },
 };
 
@@ -400,6 +420,9 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     QIOChannelSocket *sioc = NULL;
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
+    QIOChannelSocket *extra_sioc;
+    uint64_t connections;
+    int i;
     int ret = -EINVAL;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
@@ -437,6 +460,16 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         hostname = s->saddr->u.inet.host;
     }
 
+    s->x_dirty_bitmap = g_strdup(qemu_opt_get(opts, "x-dirty-bitmap"));
+
+    connections = qemu_opt_get_number(opts, "connections", 1);
+    if (connections < 1 || connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        goto error;
+    }
+    s->connections = connections;
+
     /* establish TCP connection, return error if it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
@@ -448,7 +481,35 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, s->export,
-                          tlscreds, hostname, errp);
+                          tlscreds, hostname, s->x_dirty_bitmap, errp);
+    if (ret < 0) {
+        goto error;
+    }
+
+    /* Requests may only be spread over several connections if the server
+     * guarantees that all of them see the same data, and that a flush on
+     * one of them covers writes completed on the others. */
+    if (!(nbd_get_client_session(bs)->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        connections = 1;
+    }
+    for (i = 1; i < connections; i++) {
+        extra_sioc = nbd_establish_connection(s->saddr, errp);
+        if (!extra_sioc) {
+            ret = -ECONNREFUSED;
+            nbd_client_close(bs);
+            goto error;
+        }
+
+        /* nbd_client_init() takes its own reference if it succeeds */
+        ret = nbd_client_init(bs, extra_sioc, s->export,
+                              tlscreds, hostname, s->x_dirty_bitmap, errp);
+        object_unref(OBJECT(extra_sioc));
+        if (ret < 0) {
+            nbd_client_close(bs);
+            goto error;
+        }
+    }
+
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -460,6 +521,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         qapi_free_SocketAddress(s->saddr);
         g_free(s->export);
         g_free(s->tlscredsid);
+        g_free(s->x_dirty_bitmap);
     }
     qemu_opts_del(opts);
     return ret;
@@ -494,13 +556,14 @@ static void nbd_close(BlockDriverState *bs)
     qapi_free_SocketAddress(s->saddr);
     g_free(s->export);
     g_free(s->tlscredsid);
+    g_free(s->x_dirty_bitmap);
 }
 
 static int64_t nbd_getlength(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
 
-    return s->client.info.size;
+    return nbd_get_client_session(bs)->info.size;
 }
 
 static void nbd_detach_aio_context(BlockDriverState *bs)
@@ -560,6 +623,12 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     if (s->tlscredsid) {
         qdict_put_str(opts, "tls-creds", s->tlscredsid);
     }
+    if (s->x_dirty_bitmap) {
+        qdict_put_str(opts, "x-dirty-bitmap", s->x_dirty_bitmap);
+    }
+    if (s->connections > 1) {
+        qdict_put_int(opts, "connections", s->connections);
+    }
 
     qdict_flatten(opts);
     bs->full_open_options = opts;
@@ -577,6 +646,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -596,6 +666,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -615,6 +686,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
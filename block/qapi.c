@@ -383,6 +383,36 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_stats(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **p;
+    int i;
+
+    if (hist->bins == NULL) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+
+    p = &info->boundaries;
+    for (i = 0; i < hist->nbins - 1; i++) {
+        *p = g_new0(uint64List, 1);
+        (*p)->value = hist->boundaries[i];
+        p = &(*p)->next;
+    }
+
+    p = &info->bins;
+    for (i = 0; i < hist->nbins; i++) {
+        *p = g_new0(uint64List, 1);
+        (*p)->value = stat64_get(&hist->bins[i]);
+        p = &(*p)->next;
+    }
+
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -417,6 +447,16 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    ds->rd_latency_histogram = bdrv_latency_histogram_stats(
+        &stats->latency_histogram[BLOCK_ACCT_READ]);
+    ds->has_rd_latency_histogram = ds->rd_latency_histogram != NULL;
+    ds->wr_latency_histogram = bdrv_latency_histogram_stats(
+        &stats->latency_histogram[BLOCK_ACCT_WRITE]);
+    ds->has_wr_latency_histogram = ds->wr_latency_histogram != NULL;
+    ds->flush_latency_histogram = bdrv_latency_histogram_stats(
+        &stats->latency_histogram[BLOCK_ACCT_FLUSH]);
+    ds->has_flush_latency_histogram = ds->flush_latency_histogram != NULL;
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
@@ -477,6 +517,9 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_bds_stats(bs->file->bs, blk_level);
@@ -0,0 +1,1098 @@
+/*
+ * Read cache filter driver
+ *
+ * Keeps a copy of the clusters read from a slow image (for example one on
+ * NFS or Gluster) in a local cache image, and serves later reads of the
+ * same clusters from there.  Writes go through to the cached image.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/util.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
+#include "qemu/option.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+/*
+ * Layout of the cache image:
+ *
+ *   cluster 0          ReadCacheHeader
+ *   index_offset       nb_slots big-endian 64-bit entries; entry i is the
+ *                      number of the image cluster in slot i plus one, or
+ *                      zero if the slot is empty
+ *   data_offset        nb_slots clusters of data
+ *
+ * The index is only written when the node is closed.  While the in-memory
+ * index differs from the one on disk, the header has the DIRTY flag set and
+ * the whole cache is discarded on the next open.
+ */
+
+#define READ_CACHE_MAGIC    (('Q' << 24) | ('R' << 16) | ('C' << 8) | 0xfb)
+#define READ_CACHE_VERSION  1
+
+#define READ_CACHE_FLAG_DIRTY   (1 << 0)
+
+#define READ_CACHE_NAME_SIZE    1024
+
+#define READ_CACHE_MIN_CLUSTER_SIZE     4096
+#define READ_CACHE_MAX_CLUSTER_SIZE     (2 * 1024 * 1024)
+#define READ_CACHE_DEFAULT_CLUSTER_SIZE (64 * 1024)
+
+/* Keeps the in-memory index and the size of the index I/O reasonable */
+#define READ_CACHE_MAX_SLOTS    (1 << 24)
+
+#define READ_CACHE_OPT_SIZE         "size"
+#define READ_CACHE_OPT_CLUSTER_SIZE "cluster-size"
+#define READ_CACHE_OPT_EVICTION     "eviction"
+
+typedef struct QEMU_PACKED ReadCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t cluster_bits;
+    uint64_t nb_slots;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    uint64_t image_size;
+    char image_name[READ_CACHE_NAME_SIZE];
+} ReadCacheHeader;
+
+typedef enum ReadCacheSlotState {
+    READ_CACHE_SLOT_FREE,       /* on the free list */
+    READ_CACHE_SLOT_FILLING,    /* in the map, data is being written */
+    READ_CACHE_SLOT_VALID,      /* in the map and on the LRU list */
+    READ_CACHE_SLOT_DETACHED,   /* invalidated while in use, freed by the
+                                 * last user */
+} ReadCacheSlotState;
+
+typedef struct ReadCacheSlot {
+    uint64_t cluster;
+    ReadCacheSlotState state;
+    int readers;
+    QTAILQ_ENTRY(ReadCacheSlot) next;
+} ReadCacheSlot;
+
+typedef struct ReadCacheFill {
+    BlockDriverState *bs;
+    void *buf;
+    int nb_clusters;
+    ReadCacheSlot **slots;      /* NULL for clusters that are not cached */
+} ReadCacheFill;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache;
+
+    uint32_t cluster_bits;
+    uint64_t cluster_size;
+    uint64_t nb_slots;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    uint64_t image_size;
+    uint64_t size;              /* the "size" option, or 0 */
+    ReadCacheEviction eviction;
+
+    ReadCacheSlot *slots;
+    GHashTable *map;            /* image cluster -> ReadCacheSlot */
+    QTAILQ_HEAD(, ReadCacheSlot) free_slots;
+    QTAILQ_HEAD(, ReadCacheSlot) lru;   /* eviction candidates, oldest first */
+
+    /* Protects the DIRTY flag in the header */
+    CoMutex header_lock;
+    bool dirty;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t used_slots;
+} BDRVReadCacheState;
+
+static QemuOptsList read_cache_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cache image",
+        },
+        {
+            .name = READ_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Granularity of the cache",
+        },
+        {
+            .name = READ_CACHE_OPT_EVICTION,
+            .type = QEMU_OPT_STRING,
+            .help = "Replacement policy (lru, fifo)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static uint64_t read_cache_slot_offset(BDRVReadCacheState *s,
+                                       ReadCacheSlot *slot)
+{
+    return s->data_offset + ((slot - s->slots) << s->cluster_bits);
+}
+
+static uint64_t read_cache_index_size(BDRVReadCacheState *s,
+                                      uint64_t nb_slots)
+{
+    return ROUND_UP(nb_slots * sizeof(uint64_t), s->cluster_size);
+}
+
+/* The header, one cluster of index and one cluster of data */
+static uint64_t read_cache_min_size(BDRVReadCacheState *s)
+{
+    return 3 * s->cluster_size;
+}
+
+/* Returns the number of slots that fit in a cache image of @size bytes */
+static uint64_t read_cache_nb_slots(BDRVReadCacheState *s, uint64_t size)
+{
+    uint64_t avail, nb_slots;
+
+    if (size < read_cache_min_size(s)) {
+        return 0;
+    }
+    avail = size - s->cluster_size;
+    nb_slots = avail / (s->cluster_size + sizeof(uint64_t));
+    if (read_cache_index_size(s, nb_slots) + (nb_slots << s->cluster_bits) >
+        avail) {
+        nb_slots = (avail - read_cache_index_size(s, nb_slots)) >>
+                   s->cluster_bits;
+    }
+
+    return MIN(nb_slots, READ_CACHE_MAX_SLOTS);
+}
+
+static void read_cache_set_layout(BDRVReadCacheState *s, uint64_t nb_slots)
+{
+    s->nb_slots = nb_slots;
+    s->index_offset = s->cluster_size;
+    s->data_offset = s->index_offset + read_cache_index_size(s, nb_slots);
+}
+
+static void read_cache_free_slot(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    assert(slot->readers == 0);
+    slot->state = READ_CACHE_SLOT_FREE;
+    QTAILQ_INSERT_TAIL(&s->free_slots, slot, next);
+}
+
+/*
+ * Take @slot out of the cache.  Slots that are still being read or
+ * filled are freed by their user.
+ */
+static void read_cache_detach_slot(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    g_hash_table_remove(s->map, &slot->cluster);
+
+    if (slot->state == READ_CACHE_SLOT_VALID) {
+        QTAILQ_REMOVE(&s->lru, slot, next);
+        s->used_slots--;
+        if (!slot->readers) {
+            read_cache_free_slot(s, slot);
+            return;
+        }
+    }
+    slot->state = READ_CACHE_SLOT_DETACHED;
+}
+
+static void read_cache_invalidate(BDRVReadCacheState *s, uint64_t offset,
+                                  uint64_t bytes)
+{
+    uint64_t first, last, cluster, i;
+    ReadCacheSlot *slot;
+
+    if (!bytes) {
+        return;
+    }
+
+    first = offset >> s->cluster_bits;
+    last = (offset + bytes - 1) >> s->cluster_bits;
+
+    /* Large discards can cover many more clusters than the cache holds */
+    if (last - first >= s->nb_slots) {
+        for (i = 0; i < s->nb_slots; i++) {
+            slot = &s->slots[i];
+            if ((slot->state == READ_CACHE_SLOT_FILLING ||
+                 slot->state == READ_CACHE_SLOT_VALID) &&
+                slot->cluster >= first && slot->cluster <= last) {
+                read_cache_detach_slot(s, slot);
+            }
+        }
+        return;
+    }
+
+    for (cluster = first; cluster <= last; cluster++) {
+        slot = g_hash_table_lookup(s->map, &cluster);
+        if (slot) {
+            read_cache_detach_slot(s, slot);
+        }
+    }
+}
+
+/* Returns the slot that holds valid data for @cluster, or NULL */
+static ReadCacheSlot *read_cache_find(BDRVReadCacheState *s, uint64_t cluster)
+{
+    ReadCacheSlot *slot = g_hash_table_lookup(s->map, &cluster);
+
+    if (slot && slot->state == READ_CACHE_SLOT_VALID) {
+        return slot;
+    }
+    return NULL;
+}
+
+static void read_cache_pin(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    slot->readers++;
+    if (s->eviction == READ_CACHE_EVICTION_LRU) {
+        QTAILQ_REMOVE(&s->lru, slot, next);
+        QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+    }
+}
+
+static void read_cache_unpin(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    assert(slot->readers > 0);
+    if (--slot->readers == 0 && slot->state == READ_CACHE_SLOT_DETACHED) {
+        read_cache_free_slot(s, slot);
+    }
+}
+
+/*
+ * Reserve a slot for @cluster, evicting the first idle entry of the LRU
+ * list if the cache is full.  Returns NULL if all slots are busy.
+ */
+static ReadCacheSlot *read_cache_alloc_slot(BlockDriverState *bs,
+                                            uint64_t cluster)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheSlot *slot;
+
+    slot = QTAILQ_FIRST(&s->free_slots);
+    if (slot) {
+        QTAILQ_REMOVE(&s->free_slots, slot, next);
+    } else {
+        QTAILQ_FOREACH(slot, &s->lru, next) {
+            if (!slot->readers) {
+                break;
+            }
+        }
+        if (!slot) {
+            return NULL;
+        }
+        trace_read_cache_evict(bs, slot->cluster);
+        QTAILQ_REMOVE(&s->lru, slot, next);
+        g_hash_table_remove(s->map, &slot->cluster);
+        s->used_slots--;
+        s->evictions++;
+    }
+
+    slot->cluster = cluster;
+    slot->state = READ_CACHE_SLOT_FILLING;
+    g_hash_table_insert(s->map, &slot->cluster, slot);
+
+    return slot;
+}
+
+static void read_cache_fill_done(BDRVReadCacheState *s, ReadCacheSlot *slot,
+                                 int ret)
+{
+    if (slot->state == READ_CACHE_SLOT_FILLING) {
+        if (ret >= 0) {
+            slot->state = READ_CACHE_SLOT_VALID;
+            QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+            s->used_slots++;
+            return;
+        }
+        g_hash_table_remove(s->map, &slot->cluster);
+    }
+    read_cache_free_slot(s, slot);
+}
+
+static void read_cache_fill_free(BDRVReadCacheState *s, ReadCacheFill *fill,
+                                 int ret)
+{
+    int i;
+
+    for (i = 0; i < fill->nb_clusters; i++) {
+        if (fill->slots[i]) {
+            read_cache_fill_done(s, fill->slots[i], ret);
+        }
+    }
+    qemu_vfree(fill->buf);
+    g_free(fill->slots);
+    g_free(fill);
+}
+
+/* Must be called before the cache image or the cached image are modified */
+static int coroutine_fn read_cache_mark_dirty(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint32_t flags = cpu_to_be32(READ_CACHE_FLAG_DIRTY);
+    QEMUIOVector qiov;
+    struct iovec iov = {
+        .iov_base   = &flags,
+        .iov_len    = sizeof(flags),
+    };
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->header_lock);
+    if (!s->dirty) {
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = bdrv_co_pwritev(s->cache, offsetof(ReadCacheHeader, flags),
+                              sizeof(flags), &qiov, 0);
+        if (ret >= 0) {
+            ret = bdrv_co_flush(s->cache->bs);
+        }
+        if (ret >= 0) {
+            s->dirty = true;
+        }
+    }
+    qemu_co_mutex_unlock(&s->header_lock);
+
+    return ret;
+}
+
+static void coroutine_fn read_cache_fill_entry(void *opaque)
+{
+    ReadCacheFill *fill = opaque;
+    BlockDriverState *bs = fill->bs;
+    BDRVReadCacheState *s = bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int i, ret;
+
+    ret = read_cache_mark_dirty(bs);
+
+    for (i = 0; i < fill->nb_clusters && ret >= 0; i++) {
+        ReadCacheSlot *slot = fill->slots[i];
+
+        /* A write may have invalidated the cluster in the meantime */
+        if (!slot || slot->state != READ_CACHE_SLOT_FILLING) {
+            continue;
+        }
+
+        iov = (struct iovec) {
+            .iov_base   = fill->buf + ((uint64_t)i << s->cluster_bits),
+            .iov_len    = s->cluster_size,
+        };
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_pwritev(s->cache, read_cache_slot_offset(s, slot),
+                              s->cluster_size, &qiov, 0);
+        if (ret < 0) {
+            trace_read_cache_fill_error(bs, slot->cluster, ret);
+            break;
+        }
+        read_cache_fill_done(s, slot, 0);
+        fill->slots[i] = NULL;
+    }
+
+    read_cache_fill_free(s, fill, ret < 0 ? ret : 0);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Read [@offset, @offset + @bytes) from the cached image into @qiov at
+ * @qiov_offset, and copy the complete clusters to the cache in the
+ * background.  None of the clusters may be in the cache.
+ */
+static int coroutine_fn read_cache_co_read_miss(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov,
+                                                size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t start = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    uint64_t end = QEMU_ALIGN_UP(offset + bytes, s->cluster_size);
+    ReadCacheFill *fill;
+    QEMUIOVector local_qiov;
+    struct iovec iov;
+    bool has_slots = false;
+    int i, ret;
+
+    trace_read_cache_miss(bs, offset, bytes);
+
+    end = MIN(end, MAX(s->image_size, offset + bytes));
+
+    fill = g_new0(ReadCacheFill, 1);
+    fill->bs = bs;
+    fill->nb_clusters = DIV_ROUND_UP(end - start, s->cluster_size);
+    fill->slots = g_new0(ReadCacheSlot *, fill->nb_clusters);
+    fill->buf = qemu_try_blockalign(bs->file->bs, end - start);
+    if (fill->buf == NULL) {
+        read_cache_fill_free(s, fill, -ENOMEM);
+        return -ENOMEM;
+    }
+
+    /*
+     * Reserve the slots before reading, so that a write that completes
+     * while the read is in flight invalidates them.
+     */
+    for (i = 0; i < fill->nb_clusters; i++) {
+        uint64_t cluster = (start >> s->cluster_bits) + i;
+
+        if (((cluster + 1) << s->cluster_bits) > s->image_size ||
+            g_hash_table_contains(s->map, &cluster)) {
+            continue;
+        }
+        fill->slots[i] = read_cache_alloc_slot(bs, cluster);
+        has_slots |= fill->slots[i] != NULL;
+    }
+
+    iov = (struct iovec) {
+        .iov_base   = fill->buf,
+        .iov_len    = end - start,
+    };
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    ret = bdrv_co_preadv(bs->file, start, end - start, &local_qiov, 0);
+    if (ret < 0) {
+        read_cache_fill_free(s, fill, ret);
+        return ret;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, fill->buf + (offset - start),
+                        bytes);
+
+    if (!has_slots) {
+        read_cache_fill_free(s, fill, 0);
+        return 0;
+    }
+
+    /* The fill runs when this request yields or completes */
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(read_cache_fill_entry, fill));
+
+    return 0;
+}
+
+static int coroutine_fn read_cache_co_preadv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t end = offset + bytes;
+    uint64_t cur = offset;
+    QEMUIOVector local_qiov;
+    int ret = 0;
+
+    qemu_iovec_init(&local_qiov, qiov->niov);
+
+    while (cur < end && ret >= 0) {
+        uint64_t next = MIN(end, QEMU_ALIGN_DOWN(cur, s->cluster_size) +
+                                 s->cluster_size);
+        ReadCacheSlot *slot = read_cache_find(s, cur >> s->cluster_bits);
+
+        if (!slot) {
+            /* Read all following clusters that are not cached in one go */
+            s->misses++;
+            while (next < end && !read_cache_find(s, next >> s->cluster_bits)) {
+                s->misses++;
+                next = MIN(end, next + s->cluster_size);
+            }
+            ret = read_cache_co_read_miss(bs, cur, next - cur, qiov,
+                                          cur - offset);
+            cur = next;
+            continue;
+        }
+
+        s->hits++;
+        read_cache_pin(s, slot);
+
+        qemu_iovec_reset(&local_qiov);
+        qemu_iovec_concat(&local_qiov, qiov, cur - offset, next - cur);
+
+        ret = bdrv_co_preadv(s->cache,
+                             read_cache_slot_offset(s, slot) +
+                             (cur & (s->cluster_size - 1)),
+                             next - cur, &local_qiov, 0);
+        if (ret < 0) {
+            /* Forget about the cluster and read it from the image */
+            trace_read_cache_hit_error(bs, slot->cluster, ret);
+            if (slot->state == READ_CACHE_SLOT_VALID) {
+                read_cache_detach_slot(s, slot);
+            }
+            ret = bdrv_co_preadv(bs->file, cur, next - cur, &local_qiov, 0);
+        }
+
+        read_cache_unpin(s, slot);
+        cur = next;
+    }
+
+    qemu_iovec_destroy(&local_qiov);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn read_cache_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = read_cache_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    read_cache_invalidate(s, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = read_cache_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_invalidate(s, offset, bytes);
+
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = read_cache_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_pdiscard(bs->file->bs, offset, bytes);
+    read_cache_invalidate(s, offset, bytes);
+
+    return ret;
+}
+
+static int read_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int read_cache_truncate(BlockDriverState *bs, int64_t offset,
+                               PreallocMode prealloc, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint32_t flags = cpu_to_be32(READ_CACHE_FLAG_DIRTY);
+    uint64_t image_size = cpu_to_be64(offset);
+    uint64_t end;
+    int ret;
+
+    /* Called outside coroutine context with the node drained */
+    ret = bdrv_pwrite_sync(s->cache, offsetof(ReadCacheHeader, flags),
+                           &flags, sizeof(flags));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+        return ret;
+    }
+    s->dirty = true;
+
+    ret = bdrv_truncate(bs->file, offset, prealloc, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Drop the clusters that are now past the end, or only partly inside */
+    end = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+    if (end < s->image_size) {
+        read_cache_invalidate(s, end, s->image_size - end);
+    }
+    s->image_size = offset;
+
+    ret = bdrv_pwrite_sync(s->cache, offsetof(ReadCacheHeader, image_size),
+                           &image_size, sizeof(image_size));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+        return ret;
+    }
+
+    return 0;
+}
+
+static int read_cache_load_index(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t *index;
+    uint64_t i;
+    int ret;
+
+    index = g_try_new(uint64_t, s->nb_slots);
+    if (index == NULL) {
+        error_setg(errp, "Could not allocate the cache index");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache, s->index_offset, index,
+                     s->nb_slots * sizeof(uint64_t));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache index");
+        goto out;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        ReadCacheSlot *slot = &s->slots[i];
+        uint64_t entry = be64_to_cpu(index[i]);
+
+        if (entry == 0 || entry > s->image_size >> s->cluster_bits) {
+            continue;
+        }
+        slot->cluster = entry - 1;
+        if (g_hash_table_contains(s->map, &slot->cluster)) {
+            continue;
+        }
+        QTAILQ_REMOVE(&s->free_slots, slot, next);
+        slot->state = READ_CACHE_SLOT_VALID;
+        g_hash_table_insert(s->map, &slot->cluster, slot);
+        QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+        s->used_slots++;
+    }
+    ret = 0;
+
+out:
+    g_free(index);
+    return ret;
+}
+
+static int read_cache_save_index(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint32_t flags = 0;
+    uint64_t *index;
+    uint64_t i;
+    int ret;
+
+    index = g_try_new0(uint64_t, s->nb_slots);
+    if (index == NULL) {
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        if (s->slots[i].state == READ_CACHE_SLOT_VALID) {
+            index[i] = cpu_to_be64(s->slots[i].cluster + 1);
+        }
+    }
+
+    ret = bdrv_pwrite(s->cache, s->index_offset, index,
+                      s->nb_slots * sizeof(uint64_t));
+    g_free(index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The index must be stable before the header says it is valid */
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_pwrite(s->cache, offsetof(ReadCacheHeader, flags),
+                      &flags, sizeof(flags));
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dirty = false;
+    return 0;
+}
+
+/*
+ * Write a new header for an empty cache.  The DIRTY flag stays set until
+ * the index is first saved.
+ */
+static int read_cache_format(BlockDriverState *bs, uint64_t size,
+                             Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header;
+    int64_t cache_len;
+    uint64_t nb_slots;
+    int ret;
+
+    cache_len = bdrv_getlength(s->cache->bs);
+    if (cache_len < 0) {
+        error_setg_errno(errp, -cache_len, "Could not get the cache size");
+        return cache_len;
+    }
+
+    if (size == 0) {
+        size = cache_len;
+    }
+
+    nb_slots = read_cache_nb_slots(s, size);
+    if (nb_slots == 0) {
+        error_setg(errp, "The cache must be at least %" PRIu64 " bytes in "
+                   "size", read_cache_min_size(s));
+        return -EINVAL;
+    }
+    read_cache_set_layout(s, nb_slots);
+
+    if (cache_len < s->data_offset + (nb_slots << s->cluster_bits)) {
+        ret = bdrv_truncate(s->cache, size, PREALLOC_MODE_OFF, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic        = cpu_to_be32(READ_CACHE_MAGIC);
+    header.version      = cpu_to_be32(READ_CACHE_VERSION);
+    header.flags        = cpu_to_be32(READ_CACHE_FLAG_DIRTY);
+    header.cluster_bits = cpu_to_be32(s->cluster_bits);
+    header.nb_slots     = cpu_to_be64(s->nb_slots);
+    header.index_offset = cpu_to_be64(s->index_offset);
+    header.data_offset  = cpu_to_be64(s->data_offset);
+    header.image_size   = cpu_to_be64(s->image_size);
+    pstrcpy(header.image_name, sizeof(header.image_name),
+            bs->file->bs->filename);
+
+    ret = bdrv_pwrite(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+        return ret;
+    }
+
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+        return ret;
+    }
+
+    s->dirty = true;
+    return 0;
+}
+
+/*
+ * Returns true if @header describes a cleanly closed cache of the current
+ * image with the requested layout.
+ */
+static bool read_cache_header_valid(BlockDriverState *bs,
+                                    ReadCacheHeader *header, uint64_t size)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t cache_len = bdrv_getlength(s->cache->bs);
+
+    if (header->magic != READ_CACHE_MAGIC ||
+        header->version != READ_CACHE_VERSION ||
+        (header->flags & READ_CACHE_FLAG_DIRTY) ||
+        header->cluster_bits != s->cluster_bits ||
+        header->image_size != s->image_size ||
+        strncmp(header->image_name, bs->file->bs->filename,
+                sizeof(header->image_name) - 1)) {
+        return false;
+    }
+
+    if (header->nb_slots == 0 || header->nb_slots > READ_CACHE_MAX_SLOTS ||
+        (size && header->nb_slots != read_cache_nb_slots(s, size))) {
+        return false;
+    }
+
+    read_cache_set_layout(s, header->nb_slots);
+    return header->index_offset == s->index_offset &&
+           header->data_offset == s->data_offset &&
+           cache_len >= s->data_offset + (s->nb_slots << s->cluster_bits);
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  const BdrvChildRole *role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    if (role == &child_format) {
+        /* The cache image belongs to this node, regardless of the parents */
+        *nperm = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE | BLK_PERM_RESIZE;
+        *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED;
+        return;
+    }
+
+    bdrv_filter_default_perms(bs, c, role, reopen_queue, perm, shared,
+                              nperm, nshared);
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t size, cluster_size, i;
+    int64_t image_size;
+    bool reformat = false;
+    int ret;
+
+    opts = qemu_opts_create(&read_cache_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    cluster_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CLUSTER_SIZE,
+                                     READ_CACHE_DEFAULT_CLUSTER_SIZE);
+    if (!is_power_of_2(cluster_size) ||
+        cluster_size < READ_CACHE_MIN_CLUSTER_SIZE ||
+        cluster_size > READ_CACHE_MAX_CLUSTER_SIZE) {
+        error_setg(errp, "Cluster size must be a power of two between %d "
+                   "and %dk", READ_CACHE_MIN_CLUSTER_SIZE,
+                   READ_CACHE_MAX_CLUSTER_SIZE / 1024);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->cluster_size = cluster_size;
+    s->cluster_bits = ctz32(cluster_size);
+
+    size = qemu_opt_get_size(opts, READ_CACHE_OPT_SIZE, 0);
+    s->size = size;
+
+    s->eviction = qapi_enum_parse(&ReadCacheEviction_lookup,
+                                  qemu_opt_get(opts, READ_CACHE_OPT_EVICTION),
+                                  READ_CACHE_EVICTION_LRU, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file,
+                               false, errp);
+    if (!bs->file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /* The cache is written to even if the node is read-only */
+    if (!qdict_haskey(options, "cache-file")) {
+        qdict_set_default_str(options, "cache-file.read-only", "off");
+    }
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs, &child_format,
+                               false, errp);
+    if (!s->cache) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->supported_write_flags = bs->file->bs->supported_write_flags;
+    bs->supported_zero_flags = bs->file->bs->supported_zero_flags;
+
+    image_size = bdrv_getlength(bs->file->bs);
+    if (image_size < 0) {
+        error_setg_errno(errp, -image_size, "Could not get the image size");
+        ret = image_size;
+        goto fail;
+    }
+    s->image_size = image_size;
+
+    ret = bdrv_pread(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache header");
+        goto fail;
+    }
+    be32_to_cpus(&header.magic);
+    be32_to_cpus(&header.version);
+    be32_to_cpus(&header.flags);
+    be32_to_cpus(&header.cluster_bits);
+    be64_to_cpus(&header.nb_slots);
+    be64_to_cpus(&header.index_offset);
+    be64_to_cpus(&header.data_offset);
+    be64_to_cpus(&header.image_size);
+    header.image_name[sizeof(header.image_name) - 1] = '\0';
+
+    if (!read_cache_header_valid(bs, &header, size)) {
+        reformat = true;
+        ret = read_cache_format(bs, size, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    s->slots = g_try_new0(ReadCacheSlot, s->nb_slots);
+    if (s->slots == NULL) {
+        error_setg(errp, "Could not allocate the cache index");
+        ret = -ENOMEM;
+        goto fail;
+    }
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->free_slots);
+    QTAILQ_INIT(&s->lru);
+    for (i = 0; i < s->nb_slots; i++) {
+        QTAILQ_INSERT_TAIL(&s->free_slots, &s->slots[i], next);
+    }
+    qemu_co_mutex_init(&s->header_lock);
+
+    if (!reformat) {
+        ret = read_cache_load_index(bs, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    trace_read_cache_open(bs, s->nb_slots, s->used_slots, reformat);
+    ret = 0;
+    goto out;
+
+fail:
+    if (s->map) {
+        g_hash_table_destroy(s->map);
+    }
+    g_free(s->slots);
+    if (s->cache) {
+        bdrv_unref_child(bs, s->cache);
+    }
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (s->dirty) {
+        /* If this fails, the cache is discarded on the next open */
+        read_cache_save_index(bs);
+    }
+
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+}
+
+static int read_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                     BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static bool read_cache_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                   BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static void read_cache_refresh_filename(BlockDriverState *bs, QDict *options)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QDict *opts;
+
+    /* bs->file->bs has already been refreshed */
+    bdrv_refresh_filename(s->cache->bs);
+
+    if (!bs->file->bs->full_open_options ||
+        !s->cache->bs->full_open_options) {
+        return;
+    }
+
+    opts = qdict_new();
+    qdict_put_str(opts, "driver", "read-cache");
+
+    QINCREF(bs->file->bs->full_open_options);
+    qdict_put(opts, "file", bs->file->bs->full_open_options);
+    QINCREF(s->cache->bs->full_open_options);
+    qdict_put(opts, "cache-file", s->cache->bs->full_open_options);
+
+    if (s->size) {
+        qdict_put_int(opts, READ_CACHE_OPT_SIZE, s->size);
+    }
+    qdict_put_int(opts, READ_CACHE_OPT_CLUSTER_SIZE, s->cluster_size);
+    qdict_put_str(opts, READ_CACHE_OPT_EVICTION,
+                  ReadCacheEviction_str(s->eviction));
+
+    bs->full_open_options = opts;
+}
+
+static BlockStatsSpecific *read_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BlockStatsSpecificReadCache *rstats =
+        g_new0(BlockStatsSpecificReadCache, 1);
+
+    rstats->hits = s->hits;
+    rstats->misses = s->misses;
+    rstats->evictions = s->evictions;
+    rstats->used_clusters = s->used_slots;
+    rstats->total_clusters = s->nb_slots;
+
+    *stats = (BlockStatsSpecific){
+        .type               = BLOCK_STATS_SPECIFIC_KIND_READ_CACHE,
+        .u.read_cache.data  = rstats,
+    };
+
+    return stats;
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        =   "read-cache",
+    .protocol_name                      =   "read-cache",
+    .instance_size                      =   sizeof(BDRVReadCacheState),
+
+    .bdrv_file_open                     =   read_cache_open,
+    .bdrv_close                         =   read_cache_close,
+    .bdrv_co_flush                      =   read_cache_co_flush,
+
+    .bdrv_child_perm                    =   read_cache_child_perm,
+
+    .bdrv_truncate                      =   read_cache_truncate,
+    .bdrv_getlength                     =   read_cache_getlength,
+
+    .bdrv_co_preadv                     =   read_cache_co_preadv,
+    .bdrv_co_pwritev                    =   read_cache_co_pwritev,
+
+    .bdrv_co_pwrite_zeroes              =   read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   =   read_cache_co_pdiscard,
+
+    .bdrv_recurse_is_first_non_filter   =
+        read_cache_recurse_is_first_non_filter,
+
+    .bdrv_refresh_filename              =   read_cache_refresh_filename,
+    .bdrv_reopen_prepare                =   read_cache_reopen_prepare,
+    .bdrv_co_get_block_status           =   bdrv_co_get_block_status_from_file,
+    .bdrv_get_specific_stats            =   read_cache_get_specific_stats,
+
+    .is_filter                          =   true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -60,6 +60,17 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * A group can be nested in a parent group, whose limits then apply to the
+ * requests of all members of its descendants as well.  A parent group
+ * only contributes its ThrottleState: requests that exceed its limits wait
+ * on the timers of their own member.  The lock of a parent group is always
+ * taken after the lock of its child, never the other way round.
+ *
+ * Member weights only order the requests inside one group.  Sibling groups
+ * are not weighted against each other: each of them is only capped by its
+ * own limits, and whichever member's timer fires first gets the capacity
+ * of the parent.
  */
 typedef struct ThrottleGroup {
     Object parent_obj;
@@ -68,10 +79,15 @@ typedef struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    /* These are constant once the group is initialized */
+    char *parent_name;
+    struct ThrottleGroup *parent;
+
+    QemuMutex lock; /* This lock protects the following five fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
+    double vtime[2]; /* virtual time of the last request let through */
     bool any_timer_armed[2];
     QEMUClockType clock_type;
 
@@ -189,6 +205,11 @@ static ThrottleGroupMember *throttle_group_next_tgm(ThrottleGroupMember *tgm)
     return next;
 }
 
+static inline unsigned tgm_weight(ThrottleGroupMember *tgm)
+{
+    return MAX(tgm->weight, 1);
+}
+
 /*
  * Return whether a ThrottleGroupMember has pending requests.
  *
@@ -204,8 +225,11 @@ static inline bool tgm_has_pending_reqs(ThrottleGroupMember *tgm,
     return tgm->pending_reqs[is_write];
 }
 
-/* Return the next ThrottleGroupMember in the round-robin sequence with pending
- * I/O requests.
+/* Return the ThrottleGroupMember with pending I/O requests that is
+ * furthest behind in its share of the group, i.e. the one with the
+ * smallest virtual time.  Ties are broken in round-robin order, starting
+ * with the current token.  Members without pending requests are skipped,
+ * so their share goes to the others.
  *
  * This assumes that tg->lock is held.
  *
@@ -219,21 +243,22 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
 {
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
-    ThrottleGroupMember *token, *start;
-
-    start = token = tg->tokens[is_write];
+    ThrottleGroupMember *token = NULL, *iter, *start;
 
-    /* get next bs round in round robin style */
-    token = throttle_group_next_tgm(token);
-    while (token != start && !tgm_has_pending_reqs(token, is_write)) {
-        token = throttle_group_next_tgm(token);
-    }
+    start = iter = tg->tokens[is_write];
+    do {
+        if (tgm_has_pending_reqs(iter, is_write) &&
+            (!token || iter->vtime[is_write] < token->vtime[is_write])) {
+            token = iter;
+        }
+        iter = throttle_group_next_tgm(iter);
+    } while (iter != start);
 
-    /* If no IO are queued for scheduling on the next round robin token
-     * then decide the token is the current tgm because chances are
-     * the current tgm got the current request queued.
+    /* If no IO are queued for scheduling then decide the token is the
+     * current tgm because chances are the current tgm got the current
+     * request queued.
      */
-    if (token == start && !tgm_has_pending_reqs(token, is_write)) {
+    if (!token) {
         token = tgm;
     }
 
@@ -243,6 +268,52 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
     return token;
 }
 
+/* Return how long a request has to wait because of the limits of the
+ * ancestors of a group.
+ *
+ * This assumes that tg->lock is held; the locks of the ancestors are taken
+ * in turn.
+ */
+static int64_t throttle_group_parent_delay(ThrottleGroup *tg, bool is_write,
+                                           int64_t now)
+{
+    int64_t wait = 0;
+
+    for (tg = tg->parent; tg; tg = tg->parent) {
+        qemu_mutex_lock(&tg->lock);
+        wait = MAX(wait, throttle_compute_delay(&tg->ts, is_write, now));
+        qemu_mutex_unlock(&tg->lock);
+    }
+
+    return wait;
+}
+
+/* Account a request in the ThrottleState of a group and of all its
+ * ancestors, and return its cost: the share of the capacity of the most
+ * restrictive limit along the chain that it uses, as computed by
+ * throttle_compute_cost().  Bytes are what counts under bps limits,
+ * requests under iops limits.  Without any limits, every request costs
+ * the same.
+ *
+ * This assumes that tg->lock is held.
+ */
+static double throttle_group_account(ThrottleGroup *tg, bool is_write,
+                                     unsigned int bytes)
+{
+    double cost = throttle_compute_cost(&tg->ts, is_write, bytes);
+
+    throttle_account(&tg->ts, is_write, bytes);
+
+    for (tg = tg->parent; tg; tg = tg->parent) {
+        qemu_mutex_lock(&tg->lock);
+        cost = MAX(cost, throttle_compute_cost(&tg->ts, is_write, bytes));
+        throttle_account(&tg->ts, is_write, bytes);
+        qemu_mutex_unlock(&tg->lock);
+    }
+
+    return cost ?: 1;
+}
+
 /* Check if the next I/O request for a ThrottleGroupMember needs to be
  * throttled or not. If there's no timer set in this group, set one and update
  * the token accordingly.
@@ -272,6 +343,19 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
 
     must_wait = throttle_schedule_timer(ts, tt, is_write);
 
+    /* The limits of the parent groups apply as well */
+    if (!must_wait && tg->parent) {
+        int64_t now = qemu_clock_get_ns(tg->clock_type);
+        int64_t wait = throttle_group_parent_delay(tg, is_write, now);
+
+        if (wait) {
+            if (!timer_pending(tt->timers[is_write])) {
+                timer_mod(tt->timers[is_write], now + wait);
+            }
+            must_wait = true;
+        }
+    }
+
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
         tg->tokens[is_write] = tgm;
@@ -351,16 +435,26 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
                                                         bool is_write)
 {
     bool must_wait;
+    double cost;
     ThrottleGroupMember *token;
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
 
+    /* A member that had nothing queued does not get credit for the time it
+     * was idle: it starts no earlier than the last request let through.
+     */
+    if (!tgm->pending_reqs[is_write]) {
+        tgm->vtime[is_write] = MAX(tgm->vtime[is_write], tg->vtime[is_write]);
+    }
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
 
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
+        int64_t start = qemu_clock_get_ns(tg->clock_type);
+
         tgm->pending_reqs[is_write]++;
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
@@ -369,10 +463,20 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+
+        tgm->throttled_ops[is_write]++;
+        tgm->throttled_ns[is_write] += qemu_clock_get_ns(tg->clock_type) -
+                                       start;
     }
 
-    /* The I/O will be executed, so do the accounting */
-    throttle_account(tgm->throttle_state, is_write, bytes);
+    /* The I/O will be executed, so do the accounting.  The virtual time of
+     * a member advances by the cost of its requests divided by its weight.
+     */
+    cost = throttle_group_account(tg, is_write, bytes);
+    tg->vtime[is_write] = tgm->vtime[is_write];
+    tgm->vtime[is_write] += cost / tgm_weight(tgm);
+    tgm->nr_ops[is_write]++;
+    tgm->nr_bytes[is_write] += bytes;
 
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
@@ -461,6 +565,31 @@ void throttle_group_get_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     qemu_mutex_unlock(&tg->lock);
 }
 
+/* Get the statistics of a ThrottleGroupMember.
+ *
+ * @tgm:    a registered ThrottleGroupMember
+ * @stats:  the statistics will be written here
+ */
+void throttle_group_get_member_stats(ThrottleGroupMember *tgm,
+                                     BlockStatsSpecificThrottle *stats)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+
+    qemu_mutex_lock(&tg->lock);
+    stats->group = g_strdup(tg->name);
+    stats->weight = tgm_weight(tgm);
+    stats->rd_operations = tgm->nr_ops[0];
+    stats->wr_operations = tgm->nr_ops[1];
+    stats->rd_bytes = tgm->nr_bytes[0];
+    stats->wr_bytes = tgm->nr_bytes[1];
+    stats->rd_throttled = tgm->throttled_ops[0];
+    stats->wr_throttled = tgm->throttled_ops[1];
+    stats->rd_throttled_ns = tgm->throttled_ns[0];
+    stats->wr_throttled_ns = tgm->throttled_ns[1];
+    qemu_mutex_unlock(&tg->lock);
+}
+
 /* ThrottleTimers callback. This wakes up a request that was waiting
  * because it had been throttled.
  *
@@ -519,6 +648,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
         if (!tg->tokens[i]) {
             tg->tokens[i] = tgm;
         }
+        tgm->vtime[i] = tg->vtime[i];
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
@@ -734,6 +864,18 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp)
     if (!throttle_is_valid(&cfg, errp)) {
         return;
     }
+
+    if (tg->parent_name) {
+        tg->parent = throttle_group_by_name(tg->parent_name);
+        if (!tg->parent) {
+            error_setg(errp, "Throttle group '%s' does not exist",
+                       tg->parent_name);
+            return;
+        }
+        /* The parent cannot be deleted while it has child groups */
+        object_ref(OBJECT(tg->parent));
+    }
+
     throttle_config(&tg->ts, tg->clock_type, &cfg);
     QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     tg->is_initialized = true;
@@ -747,8 +889,12 @@ static void throttle_group_obj_finalize(Object *obj)
     if (tg->is_initialized) {
         QTAILQ_REMOVE(&throttle_groups, tg, list);
     }
+    if (tg->parent) {
+        object_unref(OBJECT(tg->parent));
+    }
     qemu_mutex_destroy(&tg->lock);
     g_free(tg->name);
+    g_free(tg->parent_name);
 }
 
 static void throttle_group_set(Object *obj, Visitor *v, const char * name,
@@ -881,6 +1027,27 @@ static void throttle_group_get_limits(Object *obj, Visitor *v,
     visit_type_ThrottleLimits(v, name, &argp, errp);
 }
 
+static char *throttle_group_get_parent(Object *obj, Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    return g_strdup(tg->parent_name ?: "");
+}
+
+static void throttle_group_set_parent(Object *obj, const char *value,
+                                      Error **errp)
+{
+    ThrottleGroup *tg = THROTTLE_GROUP(obj);
+
+    if (tg->is_initialized) {
+        error_setg(errp, "Property cannot be set after initialization");
+        return;
+    }
+
+    g_free(tg->parent_name);
+    tg->parent_name = g_strdup(value);
+}
+
 static bool throttle_group_can_be_deleted(UserCreatable *uc)
 {
     return OBJECT(uc)->ref == 1;
@@ -912,6 +1079,12 @@ static void throttle_group_obj_class_init(ObjectClass *klass, void *class_data)
                               throttle_group_set_limits,
                               NULL, NULL,
                               &error_abort);
+
+    /* Group whose limits apply to this group as well */
+    object_class_property_add_str(klass, "parent",
+                                  throttle_group_get_parent,
+                                  throttle_group_set_parent,
+                                  &error_abort);
 }
 
 static const TypeInfo throttle_group_info = {
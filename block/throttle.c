@@ -22,6 +22,8 @@
 #include "qemu/throttle-options.h"
 #include "qapi/error.h"
 
+#define THROTTLE_MAX_WEIGHT 1000
+
 static QemuOptsList throttle_opts = {
     .name = "throttle",
     .head = QTAILQ_HEAD_INITIALIZER(throttle_opts.head),
@@ -31,6 +33,11 @@ static QemuOptsList throttle_opts = {
             .type = QEMU_OPT_STRING,
             .help = "Name of the throttle group",
         },
+        {
+            .name = QEMU_OPT_THROTTLE_WEIGHT,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Share of this node in the throttle group",
+        },
         { /* end of list */ }
     },
 };
@@ -41,6 +48,7 @@ static int throttle_configure_tgm(BlockDriverState *bs,
 {
     int ret;
     const char *group_name;
+    uint64_t weight;
     Error *local_err = NULL;
     QemuOpts *opts = qemu_opts_create(&throttle_opts, NULL, 0, &error_abort);
 
@@ -62,6 +70,15 @@ static int throttle_configure_tgm(BlockDriverState *bs,
         goto fin;
     }
 
+    weight = qemu_opt_get_number(opts, QEMU_OPT_THROTTLE_WEIGHT, 1);
+    if (weight < 1 || weight > THROTTLE_MAX_WEIGHT) {
+        error_setg(errp, "weight must be between 1 and %d",
+                   THROTTLE_MAX_WEIGHT);
+        ret = -EINVAL;
+        goto fin;
+    }
+    tgm->weight = weight;
+
     /* Register membership to group with name group_name */
     throttle_group_register_tgm(tgm, group_name, bdrv_get_aio_context(bs));
     ret = 0;
@@ -191,6 +208,22 @@ static void throttle_reopen_abort(BDRVReopenState *reopen_state)
     reopen_state->opaque = NULL;
 }
 
+static BlockStatsSpecific *throttle_get_specific_stats(BlockDriverState *bs)
+{
+    ThrottleGroupMember *tgm = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BlockStatsSpecificThrottle *tstats = g_new0(BlockStatsSpecificThrottle, 1);
+
+    throttle_group_get_member_stats(tgm, tstats);
+
+    *stats = (BlockStatsSpecific){
+        .type               = BLOCK_STATS_SPECIFIC_KIND_THROTTLE,
+        .u.throttle.data    = tstats,
+    };
+
+    return stats;
+}
+
 static bool throttle_recurse_is_first_non_filter(BlockDriverState *bs,
                                                  BlockDriverState *candidate)
 {
@@ -240,6 +273,7 @@ static BlockDriver bdrv_throttle = {
     .bdrv_reopen_commit                 =   throttle_reopen_commit,
     .bdrv_reopen_abort                  =   throttle_reopen_abort,
     .bdrv_co_get_block_status           =   bdrv_co_get_block_status_from_file,
+    .bdrv_get_specific_stats            =   throttle_get_specific_stats,
 
     .bdrv_co_drain_begin                =   throttle_co_drain_begin,
     .bdrv_co_drain_end                  =   throttle_co_drain_end,
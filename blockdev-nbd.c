@@ -159,11 +159,12 @@ void qmp_nbd_server_start(SocketAddressLegacy *addr,
 }
 
 void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
-                        Error **errp)
+                        bool has_bitmap, const char *bitmap, Error **errp)
 {
     BlockDriverState *bs = NULL;
     BlockBackend *on_eject_blk;
     NBDExport *exp;
+    Error *local_err = NULL;
 
     if (!nbd_server) {
         error_setg(errp, "NBD server not running");
@@ -189,12 +190,25 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         writable = false;
     }
 
-    exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
+    /* All clients of the export share its BlockBackend, so a flush on any
+     * connection also covers writes completed on the others */
+    exp = nbd_export_new(bs, 0, -1,
+                         (writable ? 0 : NBD_FLAG_READ_ONLY) |
+                         NBD_FLAG_CAN_MULTI_CONN,
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
     }
 
+    if (has_bitmap) {
+        nbd_export_bitmap(exp, bitmap, NULL, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            nbd_export_put(exp);
+            return;
+        }
+    }
+
     nbd_export_set_name(exp, device);
 
     /* The list of named exports has a strong reference to this export now and
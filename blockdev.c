@@ -370,11 +370,7 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         }
 
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
-            if (!strcmp(aio, "native")) {
-                *bdrv_flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(aio, "threads")) {
-                /* this is the default */
-            } else {
+            if (bdrv_parse_aio(aio, bdrv_flags) < 0) {
                error_setg(errp, "invalid aio option");
                return;
             }
@@ -2683,6 +2679,12 @@ void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
         goto out;
     }
 
+    if (throttle_enabled(&cfg) && blk_get_multiqueue(blk)) {
+        error_setg(errp, "I/O limits are not supported for a device that "
+                   "is served by several IOThreads");
+        goto out;
+    }
+
     if (throttle_enabled(&cfg)) {
         /* Enable I/O limits if they're not enabled yet, otherwise
          * just update the throttling group. */
@@ -2705,6 +2707,85 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_latency_histogram_set(const char *id,
+                                     bool has_boundaries,
+                                     uint64List *boundaries,
+                                     bool has_boundaries_read,
+                                     uint64List *boundaries_read,
+                                     bool has_boundaries_write,
+                                     uint64List *boundaries_write,
+                                     bool has_boundaries_flush,
+                                     uint64List *boundaries_flush,
+                                     Error **errp)
+{
+    BlockBackend *blk = qmp_get_blk(NULL, id, errp);
+    BlockAcctStats *stats;
+    AioContext *aio_context;
+    int ret;
+
+    if (!blk) {
+        return;
+    }
+
+    aio_context = blk_get_aio_context(blk);
+    aio_context_acquire(aio_context);
+
+    stats = blk_get_stats(blk);
+
+    if (!has_boundaries && !has_boundaries_read && !has_boundaries_write &&
+        !has_boundaries_flush)
+    {
+        block_latency_histograms_clear(stats);
+        goto out;
+    }
+
+    /* Check all the lists first, so that an error leaves every histogram
+     * as it was */
+    if (has_boundaries && !block_latency_histogram_check(boundaries)) {
+        error_setg(errp, "Device '%s' set boundaries fail", id);
+        goto out;
+    }
+    if (has_boundaries_read &&
+        !block_latency_histogram_check(boundaries_read)) {
+        error_setg(errp, "Device '%s' set read boundaries fail", id);
+        goto out;
+    }
+    if (has_boundaries_write &&
+        !block_latency_histogram_check(boundaries_write)) {
+        error_setg(errp, "Device '%s' set write boundaries fail", id);
+        goto out;
+    }
+    if (has_boundaries_flush &&
+        !block_latency_histogram_check(boundaries_flush)) {
+        error_setg(errp, "Device '%s' set flush boundaries fail", id);
+        goto out;
+    }
+
+    if (has_boundaries || has_boundaries_read) {
+        ret = block_latency_histogram_set(
+            stats, BLOCK_ACCT_READ,
+            has_boundaries_read ? boundaries_read : boundaries);
+        assert(ret == 0);
+    }
+
+    if (has_boundaries || has_boundaries_write) {
+        ret = block_latency_histogram_set(
+            stats, BLOCK_ACCT_WRITE,
+            has_boundaries_write ? boundaries_write : boundaries);
+        assert(ret == 0);
+    }
+
+    if (has_boundaries || has_boundaries_flush) {
+        ret = block_latency_histogram_set(
+            stats, BLOCK_ACCT_FLUSH,
+            has_boundaries_flush ? boundaries_flush : boundaries);
+        assert(ret == 0);
+    }
+
+out:
+    aio_context_release(aio_context);
+}
+
 void qmp_block_dirty_bitmap_add(const char *node, const char *name,
                                 bool has_granularity, uint32_t granularity,
                                 bool has_persistent, bool persistent,
@@ -0,0 +1,839 @@
+/*
+ * vhost-user-blk sample application
+ *
+ * Serves a raw file or block device to a vhost-user-blk master.  With
+ * Linux AIO available, requests are submitted asynchronously on an
+ * O_DIRECT file descriptor; in polling mode (-p) guest notifications are
+ * disabled and the process busy-polls its virtqueues and the AIO
+ * completion ring, so it is meant to run pinned to a dedicated host CPU.
+ *
+ * This work is largely based on the "vhost-user-scsi" sample and
+ * "hw/block/virtio-blk.c".
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 only.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "contrib/libvhost-user/libvhost-user-glib.h"
+#include "contrib/libvhost-user/libvhost-user.h"
+
+#include <glib.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#ifdef CONFIG_LINUX_AIO
+#include <libaio.h>
+#include <sys/eventfd.h>
+
+/* Requests in flight per backend; also the size of the completion batch */
+#define VUB_AIO_DEPTH 128
+#endif
+
+#define VUB_SERIAL "vhost_user_blk"
+
+typedef struct VubDev {
+    VugDev parent;
+    int blk_fd;
+    char *blk_name;
+    GMainLoop *loop;
+    struct virtio_blk_config blkcfg;
+    /* Logical block size; offsets, lengths and buffers of O_DIRECT
+     * requests must be aligned to it */
+    uint32_t blk_size;
+    bool direct;
+    bool enable_ro;
+    bool poll;
+    uint8_t wce;
+#ifdef CONFIG_LINUX_AIO
+    io_context_t aio_ctx;
+    int aio_efd;
+    int aio_inflight;
+    bool aio_full;
+#endif
+} VubDev;
+
+typedef struct VubReq {
+    VuVirtqElement elem;
+    VubDev *vdev_blk;
+    VuVirtq *vq;
+    struct virtio_blk_outhdr *out;
+    uint8_t *status;
+    struct iovec *iov;
+    unsigned int iov_cnt;
+    size_t size;
+    uint32_t type;
+    /* Aligned copy of the data for guest buffers unfit for O_DIRECT */
+    void *bounce;
+    struct iovec bounce_iov;
+#ifdef CONFIG_LINUX_AIO
+    struct iocb iocb;
+#endif
+} VubReq;
+
+/** libvhost-user callbacks **/
+
+static void vub_panic_cb(VuDev *vu_dev, const char *buf)
+{
+    VugDev *gdev;
+    VubDev *vdev_blk;
+
+    assert(vu_dev);
+
+    gdev = container_of(vu_dev, VugDev, parent);
+    vdev_blk = container_of(gdev, VubDev, parent);
+    if (buf) {
+        g_warning("vu_panic: %s", buf);
+    }
+
+    g_main_loop_quit(vdev_blk->loop);
+}
+
+/** request handling **/
+
+static size_t vub_iov_size(const struct iovec *iov, unsigned int iov_cnt)
+{
+    size_t len = 0;
+    unsigned int i;
+
+    for (i = 0; i < iov_cnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+static size_t vub_iov_from_buf(const struct iovec *iov, unsigned int iov_cnt,
+                               const void *buf, size_t size)
+{
+    size_t done = 0;
+    unsigned int i;
+
+    for (i = 0; i < iov_cnt && done < size; i++) {
+        size_t len = MIN(iov[i].iov_len, size - done);
+
+        memcpy(iov[i].iov_base, buf + done, len);
+        done += len;
+    }
+    return done;
+}
+
+static size_t vub_iov_to_buf(const struct iovec *iov, unsigned int iov_cnt,
+                             void *buf, size_t size)
+{
+    size_t done = 0;
+    unsigned int i;
+
+    for (i = 0; i < iov_cnt && done < size; i++) {
+        size_t len = MIN(iov[i].iov_len, size - done);
+
+        memcpy(buf + done, iov[i].iov_base, len);
+        done += len;
+    }
+    return done;
+}
+
+static void vub_req_free(VubReq *req)
+{
+    free(req->bounce);
+    free(req);
+}
+
+static void vub_req_complete(VubReq *req, uint8_t status)
+{
+    VuDev *vu_dev = &req->vdev_blk->parent.parent;
+    size_t in_len = 1;
+
+    if (req->type == VIRTIO_BLK_T_IN && status == VIRTIO_BLK_S_OK) {
+        in_len += req->size;
+    }
+
+    *req->status = status;
+    vu_queue_push(vu_dev, req->vq, &req->elem, in_len);
+    vu_queue_notify(vu_dev, req->vq);
+    vub_req_free(req);
+}
+
+/* Split the descriptor chain into header, data and status.  The header
+ * and status byte may share a buffer with the data, so trim them off the
+ * first out and the last in iovec instead of assuming a fixed layout. */
+static int vub_req_parse(VubReq *req)
+{
+    VuVirtqElement *elem = &req->elem;
+    struct iovec *out_sg = elem->out_sg;
+    unsigned int out_num = elem->out_num;
+    struct iovec *last;
+
+    if (out_num < 1 || elem->in_num < 1) {
+        return -EINVAL;
+    }
+
+    if (out_sg[0].iov_len < sizeof(struct virtio_blk_outhdr)) {
+        return -EINVAL;
+    }
+    req->out = out_sg[0].iov_base;
+    out_sg[0].iov_base += sizeof(struct virtio_blk_outhdr);
+    out_sg[0].iov_len -= sizeof(struct virtio_blk_outhdr);
+    if (out_sg[0].iov_len == 0) {
+        out_sg++;
+        out_num--;
+    }
+
+    last = &elem->in_sg[elem->in_num - 1];
+    if (last->iov_len < 1) {
+        return -EINVAL;
+    }
+    last->iov_len--;
+    req->status = last->iov_base + last->iov_len;
+
+    req->type = le32_to_cpu(req->out->type) & ~VIRTIO_BLK_T_BARRIER;
+    if (req->type == VIRTIO_BLK_T_OUT) {
+        req->iov = out_sg;
+        req->iov_cnt = out_num;
+    } else {
+        req->iov = elem->in_sg;
+        req->iov_cnt = elem->in_num - (last->iov_len == 0);
+    }
+    req->size = vub_iov_size(req->iov, req->iov_cnt);
+
+    return 0;
+}
+
+static int vub_do_flush(VubDev *vdev_blk)
+{
+    return fdatasync(vdev_blk->blk_fd) ? -errno : 0;
+}
+
+static void vub_rw_done(VubReq *req, ssize_t ret)
+{
+    uint8_t status = VIRTIO_BLK_S_OK;
+
+    if (ret < 0 || (size_t)ret != req->size) {
+        status = VIRTIO_BLK_S_IOERR;
+    } else if (req->bounce && req->type == VIRTIO_BLK_T_IN) {
+        vub_iov_from_buf(req->iov, req->iov_cnt, req->bounce, req->size);
+    } else if (req->type == VIRTIO_BLK_T_OUT && !req->vdev_blk->wce &&
+               vub_do_flush(req->vdev_blk) < 0) {
+        /* Write-through mode: the guest expects stable data on completion */
+        status = VIRTIO_BLK_S_IOERR;
+    }
+
+    vub_req_complete(req, status);
+}
+
+/* O_DIRECT needs every guest buffer to start and end on a logical block
+ * boundary.  Guests normally honour blk_size, but nothing forces them to,
+ * so misaligned requests are served from an aligned bounce buffer. */
+static int vub_req_prepare_bounce(VubReq *req)
+{
+    VubDev *vdev_blk = req->vdev_blk;
+    unsigned int i;
+
+    if (!vdev_blk->direct) {
+        return 0;
+    }
+    for (i = 0; i < req->iov_cnt; i++) {
+        if ((uintptr_t)req->iov[i].iov_base % vdev_blk->blk_size ||
+            req->iov[i].iov_len % vdev_blk->blk_size) {
+            break;
+        }
+    }
+    if (i == req->iov_cnt) {
+        return 0;
+    }
+
+    if (posix_memalign(&req->bounce, vdev_blk->blk_size, req->size)) {
+        req->bounce = NULL;
+        return -ENOMEM;
+    }
+    if (req->type == VIRTIO_BLK_T_OUT) {
+        vub_iov_to_buf(req->iov, req->iov_cnt, req->bounce, req->size);
+    }
+    req->bounce_iov.iov_base = req->bounce;
+    req->bounce_iov.iov_len = req->size;
+    return 0;
+}
+
+static void vub_process_vq(VuDev *vu_dev, int idx);
+
+/* Scan every started queue, for the busy-poll loop and for picking up
+ * requests that were left on the ring while the AIO context was full */
+static void vub_process_queues(VubDev *vdev_blk)
+{
+    VuDev *vu_dev = &vdev_blk->parent.parent;
+    int i;
+
+    for (i = 0; i < VHOST_MAX_NR_VIRTQUEUE; i++) {
+        VuVirtq *vq = vu_get_queue(vu_dev, i);
+
+        if (vu_queue_started(vu_dev, vq) && !vu_queue_empty(vu_dev, vq)) {
+            vub_process_vq(vu_dev, i);
+        }
+    }
+}
+
+#ifdef CONFIG_LINUX_AIO
+static void vub_aio_reap(VubDev *vdev_blk)
+{
+    struct io_event events[VUB_AIO_DEPTH];
+    struct timespec ts = { 0 };
+    int i, n;
+
+    do {
+        n = io_getevents(vdev_blk->aio_ctx, 0, VUB_AIO_DEPTH, events, &ts);
+        for (i = 0; i < n; i++) {
+            VubReq *req = events[i].data;
+
+            vdev_blk->aio_inflight--;
+            vub_rw_done(req, (int64_t)events[i].res);
+        }
+    } while (n == VUB_AIO_DEPTH);
+}
+
+static void vub_aio_event_cb(VuDev *vu_dev, int condition, void *data)
+{
+    VubDev *vdev_blk = data;
+    uint64_t cnt;
+
+    if (read(vdev_blk->aio_efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        g_warning("Failed to read AIO eventfd: %s", strerror(errno));
+    }
+    vub_aio_reap(vdev_blk);
+
+    if (vdev_blk->aio_full) {
+        vdev_blk->aio_full = false;
+        vub_process_queues(vdev_blk);
+    }
+}
+
+/* Returns -EAGAIN if the AIO context is full and the request must wait */
+static int vub_rw_submit(VubReq *req, uint64_t offset)
+{
+    VubDev *vdev_blk = req->vdev_blk;
+    struct iocb *iocbs[1] = { &req->iocb };
+    struct iovec *iov = req->bounce ? &req->bounce_iov : req->iov;
+    unsigned int iov_cnt = req->bounce ? 1 : req->iov_cnt;
+    int ret;
+
+    if (vdev_blk->aio_inflight >= VUB_AIO_DEPTH) {
+        vdev_blk->aio_full = true;
+        return -EAGAIN;
+    }
+
+    if (req->type == VIRTIO_BLK_T_IN) {
+        io_prep_preadv(&req->iocb, vdev_blk->blk_fd, iov, iov_cnt, offset);
+    } else {
+        io_prep_pwritev(&req->iocb, vdev_blk->blk_fd, iov, iov_cnt, offset);
+    }
+    if (!vdev_blk->poll) {
+        io_set_eventfd(&req->iocb, vdev_blk->aio_efd);
+    }
+    req->iocb.data = req;
+
+    ret = io_submit(vdev_blk->aio_ctx, 1, iocbs);
+    if (ret == -EAGAIN) {
+        vdev_blk->aio_full = true;
+        return ret;
+    } else if (ret != 1) {
+        vub_rw_done(req, ret < 0 ? ret : -EIO);
+        return 0;
+    }
+
+    vdev_blk->aio_inflight++;
+    return 0;
+}
+#else
+static int vub_rw_submit(VubReq *req, uint64_t offset)
+{
+    VubDev *vdev_blk = req->vdev_blk;
+    struct iovec *iov = req->bounce ? &req->bounce_iov : req->iov;
+    unsigned int iov_cnt = req->bounce ? 1 : req->iov_cnt;
+    ssize_t ret;
+
+    do {
+        if (req->type == VIRTIO_BLK_T_IN) {
+            ret = preadv(vdev_blk->blk_fd, iov, iov_cnt, offset);
+        } else {
+            ret = pwritev(vdev_blk->blk_fd, iov, iov_cnt, offset);
+        }
+    } while (ret < 0 && errno == EINTR);
+
+    vub_rw_done(req, ret < 0 ? -errno : ret);
+    return 0;
+}
+#endif
+
+/* Returns -EAGAIN if the request could not be started yet */
+static int vub_process_req(VubReq *req)
+{
+    VubDev *vdev_blk = req->vdev_blk;
+    uint64_t sector;
+
+    if (vub_req_parse(req) < 0) {
+        g_warning("Invalid virtio-blk request layout");
+        vub_panic_cb(&vdev_blk->parent.parent, NULL);
+        free(req);
+        return 0;
+    }
+
+    switch (req->type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+        if (req->type == VIRTIO_BLK_T_OUT && vdev_blk->enable_ro) {
+            vub_req_complete(req, VIRTIO_BLK_S_IOERR);
+            return 0;
+        }
+        /* sector is always in 512-byte units, whatever blk_size is */
+        sector = le64_to_cpu(req->out->sector);
+        if (req->size % vdev_blk->blk_size ||
+            (sector * 512) % vdev_blk->blk_size ||
+            sector + req->size / 512 > le64_to_cpu(vdev_blk->blkcfg.capacity)) {
+            vub_req_complete(req, VIRTIO_BLK_S_IOERR);
+            return 0;
+        }
+        if (vub_req_prepare_bounce(req) < 0) {
+            vub_req_complete(req, VIRTIO_BLK_S_IOERR);
+            return 0;
+        }
+        return vub_rw_submit(req, sector * 512);
+    case VIRTIO_BLK_T_FLUSH:
+        vub_req_complete(req, vub_do_flush(vdev_blk) < 0 ?
+                         VIRTIO_BLK_S_IOERR : VIRTIO_BLK_S_OK);
+        return 0;
+    case VIRTIO_BLK_T_GET_ID:
+        vub_iov_from_buf(req->iov, req->iov_cnt, VUB_SERIAL,
+                         MIN(strlen(VUB_SERIAL) + 1, VIRTIO_BLK_ID_BYTES));
+        vub_req_complete(req, VIRTIO_BLK_S_OK);
+        return 0;
+    default:
+        vub_req_complete(req, VIRTIO_BLK_S_UNSUPP);
+        return 0;
+    }
+}
+
+static void vub_process_vq(VuDev *vu_dev, int idx)
+{
+    VugDev *gdev;
+    VubDev *vdev_blk;
+    VuVirtq *vq;
+
+    assert(vu_dev);
+
+    gdev = container_of(vu_dev, VugDev, parent);
+    vdev_blk = container_of(gdev, VubDev, parent);
+    if (idx < 0 || idx >= VHOST_MAX_NR_VIRTQUEUE) {
+        g_warning("VQ Index out of range: %d", idx);
+        vub_panic_cb(vu_dev, NULL);
+        return;
+    }
+
+    vq = vu_get_queue(vu_dev, idx);
+
+    while (1) {
+        VubReq *req;
+
+        req = vu_queue_pop(vu_dev, vq, sizeof(VubReq));
+        if (!req) {
+            break;
+        }
+
+        req->vdev_blk = vdev_blk;
+        req->vq = vq;
+        req->bounce = NULL;
+
+        if (vub_process_req(req) == -EAGAIN) {
+            /* Leave the request on the ring until completions free a slot */
+            vu_queue_rewind(vu_dev, vq, 1);
+            vub_req_free(req);
+            break;
+        }
+    }
+}
+
+/* Busy-poll callback for -p: kicks are suppressed, so every started queue
+ * is scanned on each main loop iteration and completions are reaped
+ * without waiting for the eventfd. */
+static gboolean vub_poll_cb(gpointer opaque)
+{
+    VubDev *vdev_blk = opaque;
+
+    vub_process_queues(vdev_blk);
+#ifdef CONFIG_LINUX_AIO
+    if (vdev_blk->aio_inflight) {
+        vub_aio_reap(vdev_blk);
+    }
+#endif
+
+    return TRUE;
+}
+
+static void vub_queue_set_started(VuDev *vu_dev, int idx, bool started)
+{
+    VugDev *gdev = container_of(vu_dev, VugDev, parent);
+    VubDev *vdev_blk = container_of(gdev, VubDev, parent);
+    VuVirtq *vq;
+
+    assert(vu_dev);
+
+    vq = vu_get_queue(vu_dev, idx);
+    vu_set_queue_handler(vu_dev, vq, started ? vub_process_vq : NULL);
+    if (started && vdev_blk->poll) {
+        vu_queue_set_notification(vu_dev, vq, 0);
+    }
+}
+
+static uint64_t vub_get_features(VuDev *dev)
+{
+    uint64_t features;
+    VugDev *gdev;
+    VubDev *vdev_blk;
+
+    gdev = container_of(dev, VugDev, parent);
+    vdev_blk = container_of(gdev, VubDev, parent);
+
+    features = 1ull << VIRTIO_BLK_F_SIZE_MAX |
+               1ull << VIRTIO_BLK_F_SEG_MAX |
+               1ull << VIRTIO_BLK_F_TOPOLOGY |
+               1ull << VIRTIO_BLK_F_BLK_SIZE |
+               1ull << VIRTIO_BLK_F_FLUSH |
+               1ull << VIRTIO_BLK_F_CONFIG_WCE |
+               1ull << VIRTIO_F_VERSION_1 |
+               1ull << VHOST_USER_F_PROTOCOL_FEATURES;
+
+    if (vdev_blk->enable_ro) {
+        features |= 1ull << VIRTIO_BLK_F_RO;
+    }
+
+    return features;
+}
+
+static uint64_t vub_get_protocol_features(VuDev *dev)
+{
+    return 1ull << VHOST_USER_PROTOCOL_F_CONFIG;
+}
+
+static int vub_get_config(VuDev *vu_dev, uint8_t *config, uint32_t len)
+{
+    VugDev *gdev;
+    VubDev *vdev_blk;
+
+    if (len > sizeof(struct virtio_blk_config)) {
+        return -1;
+    }
+
+    gdev = container_of(vu_dev, VugDev, parent);
+    vdev_blk = container_of(gdev, VubDev, parent);
+    vdev_blk->blkcfg.wce = vdev_blk->wce;
+    memcpy(config, &vdev_blk->blkcfg, len);
+
+    return 0;
+}
+
+static int vub_set_config(VuDev *vu_dev, const uint8_t *data,
+                          uint32_t offset, uint32_t size, uint32_t flags)
+{
+    VugDev *gdev;
+    VubDev *vdev_blk;
+
+    /* don't support live migration */
+    if (flags != VHOST_SET_CONFIG_TYPE_MASTER) {
+        return -1;
+    }
+
+    if (offset != offsetof(struct virtio_blk_config, wce) ||
+        size != 1) {
+        return -1;
+    }
+
+    gdev = container_of(vu_dev, VugDev, parent);
+    vdev_blk = container_of(gdev, VubDev, parent);
+    vdev_blk->wce = *data;
+
+    return 0;
+}
+
+static const VuDevIface vub_iface = {
+    .get_features = vub_get_features,
+    .queue_set_started = vub_queue_set_started,
+    .get_protocol_features = vub_get_protocol_features,
+    .get_config = vub_get_config,
+    .set_config = vub_set_config,
+};
+
+/** misc helpers **/
+
+static int unix_sock_new(char *unix_fn)
+{
+    int sock;
+    struct sockaddr_un un;
+    size_t len;
+
+    assert(unix_fn);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock <= 0) {
+        perror("socket");
+        return -1;
+    }
+
+    un.sun_family = AF_UNIX;
+    (void)snprintf(un.sun_path, sizeof(un.sun_path), "%s", unix_fn);
+    len = sizeof(un.sun_family) + strlen(un.sun_path);
+
+    (void)unlink(unix_fn);
+    if (bind(sock, (struct sockaddr *)&un, len) < 0) {
+        perror("bind");
+        goto fail;
+    }
+
+    if (listen(sock, 1) < 0) {
+        perror("listen");
+        goto fail;
+    }
+
+    return sock;
+
+fail:
+    (void)close(sock);
+
+    return -1;
+}
+
+/* Find the alignment O_DIRECT requires: the logical sector size for block
+ * devices, st_blksize for regular files.  Also return the physical block
+ * size so that the guest can be told to avoid read-modify-write cycles. */
+static int vub_probe_block_size(VubDev *vdev_blk, uint32_t *phys_size)
+{
+    struct stat st;
+    int size;
+    unsigned int pbsize;
+
+    *phys_size = 512;
+    if (fstat(vdev_blk->blk_fd, &st) < 0) {
+        return -errno;
+    }
+
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(vdev_blk->blk_fd, BLKSSZGET, &size) < 0) {
+            return -errno;
+        }
+        if (ioctl(vdev_blk->blk_fd, BLKPBSZGET, &pbsize) == 0) {
+            *phys_size = pbsize;
+        }
+    } else if (vdev_blk->direct) {
+        /* st_blksize may be a large preferred I/O size, e.g. on NFS */
+        size = MAX(MIN(st.st_blksize, 4096), 512);
+    } else {
+        size = 512;
+    }
+
+    if (size < 512 || size > 4096 || !is_power_of_2(size)) {
+        return -EINVAL;
+    }
+    vdev_blk->blk_size = size;
+    if (*phys_size < vdev_blk->blk_size || !is_power_of_2(*phys_size)) {
+        *phys_size = vdev_blk->blk_size;
+    }
+    return 0;
+}
+
+static int vub_open(VubDev *vdev_blk)
+{
+    int flags = vdev_blk->enable_ro ? O_RDONLY : O_RDWR;
+    uint32_t phys_size;
+    off_t size;
+    int ret;
+
+#ifdef CONFIG_LINUX_AIO
+    /* Linux AIO is only asynchronous on O_DIRECT file descriptors */
+    vdev_blk->blk_fd = open(vdev_blk->blk_name, flags | O_DIRECT);
+    vdev_blk->direct = vdev_blk->blk_fd >= 0;
+    if (vdev_blk->blk_fd < 0 && errno == EINVAL) {
+        g_warning("%s does not support O_DIRECT, using the page cache",
+                  vdev_blk->blk_name);
+        vdev_blk->blk_fd = open(vdev_blk->blk_name, flags);
+    }
+#else
+    vdev_blk->blk_fd = open(vdev_blk->blk_name, flags);
+#endif
+    if (vdev_blk->blk_fd < 0) {
+        fprintf(stderr, "Error: Open block device %s failed: %s\n",
+                vdev_blk->blk_name, strerror(errno));
+        return -1;
+    }
+
+    ret = vub_probe_block_size(vdev_blk, &phys_size);
+    if (ret < 0) {
+        fprintf(stderr, "Error: Cannot get block size of %s: %s\n",
+                vdev_blk->blk_name, strerror(-ret));
+        return -1;
+    }
+
+    size = lseek(vdev_blk->blk_fd, 0, SEEK_END);
+    if (size < 0) {
+        fprintf(stderr, "Error: Cannot get size of %s: %s\n",
+                vdev_blk->blk_name, strerror(errno));
+        return -1;
+    }
+
+    memset(&vdev_blk->blkcfg, 0, sizeof(vdev_blk->blkcfg));
+    /* A partial block at the end cannot be accessed with O_DIRECT */
+    size = QEMU_ALIGN_DOWN(size, vdev_blk->blk_size);
+    vdev_blk->blkcfg.capacity = cpu_to_le64(size >> 9);
+    vdev_blk->blkcfg.size_max = cpu_to_le32(1 << 20);
+    vdev_blk->blkcfg.seg_max = cpu_to_le32(128 - 2);
+    vdev_blk->blkcfg.blk_size = cpu_to_le32(vdev_blk->blk_size);
+    vdev_blk->blkcfg.physical_block_exp =
+        ctz32(phys_size / vdev_blk->blk_size);
+    vdev_blk->blkcfg.min_io_size = cpu_to_le16(1);
+    vdev_blk->blkcfg.opt_io_size = cpu_to_le32(1);
+    vdev_blk->blkcfg.num_queues = cpu_to_le16(1);
+    vdev_blk->wce = 1;
+
+#ifdef CONFIG_LINUX_AIO
+    if (io_setup(VUB_AIO_DEPTH, &vdev_blk->aio_ctx) < 0) {
+        fprintf(stderr, "Error: Cannot set up Linux AIO context\n");
+        return -1;
+    }
+    vdev_blk->aio_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vdev_blk->aio_efd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+static void vub_free(VubDev *vdev_blk)
+{
+    if (!vdev_blk) {
+        return;
+    }
+
+#ifdef CONFIG_LINUX_AIO
+    if (vdev_blk->aio_ctx) {
+        io_destroy(vdev_blk->aio_ctx);
+    }
+    if (vdev_blk->aio_efd >= 0) {
+        close(vdev_blk->aio_efd);
+    }
+#endif
+    g_main_loop_unref(vdev_blk->loop);
+    if (vdev_blk->blk_fd >= 0) {
+        close(vdev_blk->blk_fd);
+    }
+    g_free(vdev_blk);
+}
+
+/** vhost-user-blk **/
+
+int main(int argc, char **argv)
+{
+    VubDev *vdev_blk = NULL;
+    char *unix_socket = NULL;
+    char *blk_file = NULL;
+    bool enable_ro = false;
+    bool poll_mode = false;
+    int lsock = -1, csock = -1, opt, err = EXIT_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "b:rps:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            blk_file = g_strdup(optarg);
+            break;
+        case 's':
+            unix_socket = g_strdup(optarg);
+            break;
+        case 'r':
+            enable_ro = true;
+            break;
+        case 'p':
+            poll_mode = true;
+            break;
+        case 'h':
+        default:
+            goto help;
+        }
+    }
+
+    if (!unix_socket || !blk_file) {
+        goto help;
+    }
+
+    lsock = unix_sock_new(unix_socket);
+    if (lsock < 0) {
+        goto err;
+    }
+
+    csock = accept(lsock, NULL, NULL);
+    if (csock < 0) {
+        perror("accept");
+        goto err;
+    }
+
+    vdev_blk = g_new0(VubDev, 1);
+    vdev_blk->loop = g_main_loop_new(NULL, FALSE);
+    vdev_blk->blk_name = blk_file;
+    vdev_blk->blk_fd = -1;
+    vdev_blk->enable_ro = enable_ro;
+    vdev_blk->poll = poll_mode;
+#ifdef CONFIG_LINUX_AIO
+    vdev_blk->aio_efd = -1;
+#endif
+
+    if (vub_open(vdev_blk) < 0) {
+        goto err;
+    }
+
+    vug_init(&vdev_blk->parent, csock, vub_panic_cb, &vub_iface);
+
+    if (poll_mode) {
+        g_idle_add(vub_poll_cb, vdev_blk);
+    }
+#ifdef CONFIG_LINUX_AIO
+    else {
+        vdev_blk->parent.parent.set_watch(&vdev_blk->parent.parent,
+                                          vdev_blk->aio_efd, VU_WATCH_IN,
+                                          vub_aio_event_cb, vdev_blk);
+    }
+#endif
+
+    g_main_loop_run(vdev_blk->loop);
+
+    vug_deinit(&vdev_blk->parent);
+
+out:
+    vub_free(vdev_blk);
+    if (csock >= 0) {
+        close(csock);
+    }
+    if (lsock >= 0) {
+        close(lsock);
+    }
+    if (unix_socket) {
+        unlink(unix_socket);
+    }
+    g_free(unix_socket);
+    g_free(blk_file);
+
+    return err;
+
+err:
+    err = EXIT_FAILURE;
+    goto out;
+
+help:
+    fprintf(stderr, "Usage: %s [ -b block device or file, -s UNIX domain "
+            "socket ] | [ -r Enable read-only ] | [ -p Poll mode ] | [ -h ]\n",
+            argv[0]);
+    fprintf(stderr, "          -b block device or file path\n");
+    fprintf(stderr, "          -s UNIX domain socket path\n");
+    fprintf(stderr, "          -r enable read-only\n");
+    fprintf(stderr, "          -p busy-poll virtqueues and AIO completions\n");
+    fprintf(stderr, "          -h print help and quit\n");
+
+    goto err;
+}
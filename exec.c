@@ -2392,6 +2392,12 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
         tb_unlock();
     }
 
+    /* Let migration know which vcpu dirties the most pages */
+    if (!cpu_physical_memory_get_dirty_flag(ram_addr,
+                                            DIRTY_MEMORY_MIGRATION)) {
+        atomic_inc(&current_cpu->dirty_pages);
+    }
+
     /* Set both VGA and migration bits for simplicity and to remove
      * the notdirty callback faster.
      */
@@ -222,6 +222,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                       info->ram->dirty_sync_time);
+        monitor_printf(mon, "zero scan pages: %" PRIu64 " pages\n",
+                       info->ram->zero_scan_pages);
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
 
@@ -235,6 +239,28 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         }
     }
 
+    if (info->has_iterations) {
+        MigrationIterationStatsList *it;
+
+        monitor_printf(mon, "iterations:\n");
+        for (it = info->iterations; it; it = it->next) {
+            MigrationIterationStats *stats = it->value;
+
+            monitor_printf(mon, "  %" PRId64 ": %" PRId64 " ms, sync %"
+                           PRId64 " us, %" PRId64 " kbytes, %0.2f mbps, "
+                           "zero %" PRId64 " normal %" PRId64
+                           " xbzrle %" PRId64 " compress %" PRId64
+                           " multifd %" PRId64 " pages, "
+                           "expected downtime %" PRId64 " ms\n",
+                           stats->iteration, stats->duration,
+                           stats->sync_time, stats->transferred >> 10,
+                           stats->mbps, stats->zero_pages,
+                           stats->normal_pages, stats->xbzrle_pages,
+                           stats->compress_pages, stats->multifd_pages,
+                           stats->expected_downtime);
+        }
+    }
+
     if (info->has_disk) {
         monitor_printf(mon, "transferred disk: %" PRIu64 " kbytes\n",
                        info->disk->transferred >> 10);
@@ -257,6 +283,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
     }
 
     if (info->has_cpu_throttle_percentage) {
@@ -264,6 +294,17 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_vcpu_throttle) {
+        VcpuThrottleInfoList *vt;
+
+        for (vt = info->vcpu_throttle; vt; vt = vt->next) {
+            monitor_printf(mon, "vcpu %" PRId64 " dirty rate: %" PRIu64
+                           " bytes/s throttle percentage: %" PRId64 "\n",
+                           vt->value->cpu_index, vt->value->dirty_rate,
+                           vt->value->throttle_percentage);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -296,6 +337,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRId64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_COMPRESS_LEVEL),
             params->compress_level);
+        assert(params->has_compress_method);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_COMPRESS_METHOD),
+            CompressMethod_str(params->compress_method));
         assert(params->has_compress_threads);
         monitor_printf(mon, "%s: %" PRId64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_COMPRESS_THREADS),
@@ -345,6 +390,15 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %" PRId64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_BITMAP_SYNC_THREADS),
+            params->x_bitmap_sync_threads);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_CPU_THROTTLE_PER_VCPU),
+            params->x_cpu_throttle_per_vcpu ? "on" : "off");
+        monitor_printf(mon, "%s: %" PRId64 "\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_ZERO_PAGE_THREADS),
+            params->x_zero_page_threads);
     }
 
     qapi_free_MigrationParameters(params);
@@ -1587,6 +1641,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_compress_level = true;
         visit_type_int(v, param, &p->compress_level, &err);
         break;
+    case MIGRATION_PARAMETER_COMPRESS_METHOD:
+        p->has_compress_method = true;
+        visit_type_CompressMethod(v, param, &p->compress_method, &err);
+        break;
     case MIGRATION_PARAMETER_COMPRESS_THREADS:
         p->has_compress_threads = true;
         visit_type_int(v, param, &p->compress_threads, &err);
@@ -1659,6 +1717,18 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         }
         p->xbzrle_cache_size = cache_size;
         break;
+    case MIGRATION_PARAMETER_X_BITMAP_SYNC_THREADS:
+        p->has_x_bitmap_sync_threads = true;
+        visit_type_int(v, param, &p->x_bitmap_sync_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_X_CPU_THROTTLE_PER_VCPU:
+        p->has_x_cpu_throttle_per_vcpu = true;
+        visit_type_bool(v, param, &p->x_cpu_throttle_per_vcpu, &err);
+        break;
+    case MIGRATION_PARAMETER_X_ZERO_PAGE_THREADS:
+        p->has_x_zero_page_threads = true;
+        visit_type_int(v, param, &p->x_zero_page_threads, &err);
+        break;
     default:
         assert(0);
     }
@@ -2203,7 +2273,8 @@ void hmp_nbd_server_start(Monitor *mon, const QDict *qdict)
             continue;
         }
 
-        qmp_nbd_server_add(info->value->device, true, writable, &local_err);
+        qmp_nbd_server_add(info->value->device, true, writable, false, NULL,
+                           &local_err);
 
         if (local_err != NULL) {
             qmp_nbd_server_stop(NULL);
@@ -2223,7 +2294,7 @@ void hmp_nbd_server_add(Monitor *mon, const QDict *qdict)
     bool writable = qdict_get_try_bool(qdict, "writable", false);
     Error *local_err = NULL;
 
-    qmp_nbd_server_add(device, true, writable, &local_err);
+    qmp_nbd_server_add(device, true, writable, false, NULL, &local_err);
 
     if (local_err != NULL) {
         hmp_handle_error(mon, &local_err);
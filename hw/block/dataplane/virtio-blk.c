@@ -26,43 +26,82 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+typedef struct VirtIOBlockDataPlaneContext {
+    VirtIOBlockDataPlane *s;
+    AioContext *ctx;
+    QEMUBH *bh;                     /* bh for guest notification */
+    unsigned long *batch_notify_vqs;
+} VirtIOBlockDataPlaneContext;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
 
     VirtIOBlkConf *conf;
     VirtIODevice *vdev;
-    QEMUBH *bh;                     /* bh for guest notification */
-    unsigned long *batch_notify_vqs;
 
     /* Note that these EventNotifiers are assigned by value.  This is
      * fine as long as you do not call event_notifier_cleanup on them
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
-    AioContext *ctx;
+    unsigned num_iothreads;
+    IOThread **iothreads;
+    AioContext *ctx;                /* AioContext of the BlockBackend */
+
+    /* One entry per IOThread, or a single one for the main loop.  While
+     * multiqueue is true, virtqueue i is processed in contexts[i %
+     * num_contexts]; otherwise all virtqueues use contexts[0].
+     */
+    unsigned num_contexts;
+    VirtIOBlockDataPlaneContext *contexts;
+    bool multiqueue;
+    bool external_disabled;
+    Error *blocker;
 };
 
+static VirtIOBlockDataPlaneContext *
+virtio_blk_data_plane_vq_context(VirtIOBlockDataPlane *s, VirtQueue *vq)
+{
+    unsigned i = virtio_get_queue_index(vq);
+
+    return &s->contexts[s->multiqueue ? i % s->num_contexts : 0];
+}
+
+/* Return the AioContext that processes requests from @vq */
+AioContext *virtio_blk_data_plane_get_aio_context(VirtIOBlockDataPlane *s,
+                                                  VirtQueue *vq)
+{
+    return virtio_blk_data_plane_vq_context(s, vq)->ctx;
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
-    set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
-    qemu_bh_schedule(s->bh);
+    VirtIOBlockDataPlaneContext *c = virtio_blk_data_plane_vq_context(s, vq);
+    unsigned i = virtio_get_queue_index(vq);
+
+    /* The caller need not be running in c->ctx, and notify_guest_bh() may
+     * be clearing the bitmap there at the same time.
+     */
+    atomic_or(&c->batch_notify_vqs[BIT_WORD(i)], BIT_MASK(i));
+    qemu_bh_schedule(c->bh);
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneContext *c = opaque;
+    VirtIOBlockDataPlane *s = c->s;
     unsigned nvqs = s->conf->num_queues;
     unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
+    for (j = 0; j < BITS_TO_LONGS(nvqs); j++) {
+        bitmap[j] = atomic_xchg(&c->batch_notify_vqs[j], 0);
+    }
 
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j];
+        unsigned long bits = bitmap[j / BITS_PER_LONG];
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -83,18 +122,58 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **iothreads = NULL;
+    unsigned num_iothreads = 0;
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothreads) {
+        char **ids = g_strsplit(conf->iothreads, ":", -1);
+
+        if (conf->iothread) {
+            error_setg(errp, "iothread and iothreads cannot be used together");
+            g_strfreev(ids);
+            return;
+        }
+        num_iothreads = g_strv_length(ids);
+        if (num_iothreads == 0 || num_iothreads > conf->num_queues) {
+            error_setg(errp, "iothreads must list between 1 and num-queues "
+                       "IOThread IDs separated by colons");
+            g_strfreev(ids);
+            return;
+        }
+
+        iothreads = g_new(IOThread *, num_iothreads);
+        for (i = 0; i < num_iothreads; i++) {
+            Object *obj = object_resolve_path_type(ids[i], TYPE_IOTHREAD,
+                                                   NULL);
+            if (!obj) {
+                error_setg(errp, "IOThread '%s' not found", ids[i]);
+                g_free(iothreads);
+                g_strfreev(ids);
+                return;
+            }
+            iothreads[i] = IOTHREAD(obj);
+        }
+        g_strfreev(ids);
+    } else if (conf->iothread) {
+        iothreads = g_new(IOThread *, 1);
+        iothreads[0] = conf->iothread;
+        num_iothreads = 1;
+    }
+
+    if (num_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
                        "(transport does not support notifiers)");
+            g_free(iothreads);
             return;
         }
         if (!virtio_device_ioeventfd_enabled(vdev)) {
             error_setg(errp, "ioeventfd is required for iothread");
+            g_free(iothreads);
             return;
         }
 
@@ -103,6 +182,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
          */
         if (blk_op_is_blocked(conf->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
             error_prepend(errp, "cannot start virtio-blk dataplane: ");
+            g_free(iothreads);
             return;
         }
     }
@@ -114,16 +194,30 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
+    s->num_iothreads = num_iothreads;
+    s->iothreads = iothreads;
+
+    s->num_contexts = MAX(num_iothreads, 1);
+    s->contexts = g_new0(VirtIOBlockDataPlaneContext, s->num_contexts);
+    for (i = 0; i < s->num_contexts; i++) {
+        VirtIOBlockDataPlaneContext *c = &s->contexts[i];
+
+        c->s = s;
+        if (num_iothreads) {
+            object_ref(OBJECT(iothreads[i]));
+            c->ctx = iothread_get_aio_context(iothreads[i]);
+        } else {
+            c->ctx = qemu_get_aio_context();
+        }
+        c->bh = aio_bh_new(c->ctx, notify_guest_bh, c);
+        c->batch_notify_vqs = bitmap_new(conf->num_queues);
+    }
+    s->ctx = s->contexts[0].ctx;
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
-    } else {
-        s->ctx = qemu_get_aio_context();
+    if (s->num_contexts > 1) {
+        error_setg(&s->blocker, "virtio-blk device is served by several "
+                   "IOThreads");
     }
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
-    s->batch_notify_vqs = bitmap_new(conf->num_queues);
 
     *dataplane = s;
 }
@@ -132,6 +226,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -139,14 +234,91 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->num_contexts; i++) {
+        g_free(s->contexts[i].batch_notify_vqs);
+        qemu_bh_delete(s->contexts[i].bh);
+    }
+    g_free(s->contexts);
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
     }
+    g_free(s->iothreads);
+    error_free(s->blocker);
     g_free(s);
 }
 
+/* Check whether requests of the device can be submitted from all of its
+ * IOThreads at once.
+ *
+ * Context: QEMU global mutex held
+ */
+static bool virtio_blk_data_plane_check_multiqueue(VirtIOBlockDataPlane *s,
+                                                   Error **errp)
+{
+    BlockBackend *blk = s->conf->conf.blk;
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (!bs || !bdrv_supports_multiqueue(bs)) {
+        error_setg(errp, "the block graph does not support requests from "
+                   "several IOThreads");
+        return false;
+    }
+    if (blk_get_public(blk)->throttle_group_member.throttle_state) {
+        error_setg(errp, "I/O limits are enabled");
+        return false;
+    }
+    return true;
+}
+
+/* Called when the BlockBackend is drained.  bdrv_drained_begin() only
+ * disables external events in the AioContext of the BlockBackend, so do
+ * the same for the other IOThreads of a multiqueue device.
+ *
+ * Context: QEMU global mutex held
+ */
+void virtio_blk_data_plane_drained_begin(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->multiqueue || s->external_disabled) {
+        return;
+    }
+
+    s->external_disabled = true;
+    for (i = 0; i < s->num_contexts; i++) {
+        AioContext *ctx = s->contexts[i].ctx;
+
+        if (ctx != s->ctx) {
+            aio_disable_external(ctx);
+
+            /* Virtqueue handlers run with the AioContext lock held, so
+             * after this no handler is still submitting requests.
+             */
+            aio_context_acquire(ctx);
+            aio_context_release(ctx);
+        }
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_blk_data_plane_drained_end(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->external_disabled) {
+        return;
+    }
+
+    s->external_disabled = false;
+    for (i = 0; i < s->num_contexts; i++) {
+        AioContext *ctx = s->contexts[i].ctx;
+
+        if (ctx != s->ctx) {
+            aio_enable_external(ctx);
+        }
+    }
+}
+
 static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
@@ -165,6 +337,8 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     VirtIOBlockDataPlane *s = vblk->dataplane;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vblk)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    BlockBackend *blk = s->conf->conf.blk;
+    Error *local_err = NULL;
     unsigned i;
     unsigned nvqs = s->conf->num_queues;
     int r;
@@ -199,7 +373,30 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     vblk->dataplane_started = true;
     trace_virtio_blk_data_plane_start(s);
 
-    blk_set_aio_context(s->conf->conf.blk, s->ctx);
+    blk_set_aio_context(blk, s->ctx);
+
+    /* The block graph may have changed since the last start, so check
+     * again whether the other IOThreads can submit requests.
+     */
+    if (s->num_contexts > 1) {
+        aio_context_acquire(s->ctx);
+        s->multiqueue = virtio_blk_data_plane_check_multiqueue(s, &local_err);
+        if (s->multiqueue) {
+            blk_set_multiqueue(blk, true);
+            blk_op_block_all(blk, s->blocker);
+            blk_op_unblock(blk, BLOCK_OP_TYPE_RESIZE, s->blocker);
+            blk_op_unblock(blk, BLOCK_OP_TYPE_DRIVE_DEL, s->blocker);
+        }
+        aio_context_release(s->ctx);
+
+        if (local_err) {
+            error_prepend(&local_err, "virtio-blk: processing all "
+                          "virtqueues in one IOThread: ");
+            warn_report_err(local_err);
+        }
+    }
+    trace_virtio_blk_data_plane_multiqueue(s, s->multiqueue ?
+                                           s->num_contexts : 1);
 
     /* Kick right away to begin processing requests already in vring */
     for (i = 0; i < nvqs; i++) {
@@ -209,14 +406,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = virtio_blk_data_plane_get_aio_context(s, vq);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -233,6 +431,7 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     VirtIOBlockDataPlane *s = vblk->dataplane;
     BusState *qbus = qdev_get_parent_bus(DEVICE(vblk));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    BlockBackend *blk = s->conf->conf.blk;
     unsigned i;
     unsigned nvqs = s->conf->num_queues;
 
@@ -249,17 +448,25 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-
     /* Stop notifications for new requests from guest */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = virtio_blk_data_plane_get_aio_context(s, vq);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        aio_context_release(ctx);
     }
 
+    aio_context_acquire(s->ctx);
+
     /* Drain and switch bs back to the QEMU main loop */
-    blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
+    blk_set_aio_context(blk, qemu_get_aio_context());
+
+    if (s->multiqueue) {
+        blk_set_multiqueue(blk, false);
+        blk_op_unblock_all(blk, s->blocker);
+    }
 
     aio_context_release(s->ctx);
 
@@ -270,6 +477,7 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     /* Clean up guest notifier (irq) */
     k->set_guest_notifiers(qbus->parent, nvqs, false);
 
+    s->multiqueue = false;
     vblk->dataplane_started = false;
     s->stopping = false;
 }
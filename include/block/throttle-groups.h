@@ -43,14 +43,29 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int io_limits_disabled;
 
+    /* Share of the group relative to the other members, measured in bytes
+     * under bps limits and in requests under iops limits.  Zero counts as
+     * one.  Must be set before the member is registered.
+     */
+    unsigned int weight;
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
     ThrottleState *throttle_state;
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
+    /* Cost of the requests let through so far, divided by the weight; the
+     * pending member with the smallest value goes next */
+    double         vtime[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /* Statistics, also protected by the ThrottleGroup lock */
+    uint64_t       nr_ops[2];
+    uint64_t       nr_bytes[2];
+    uint64_t       throttled_ops[2];
+    uint64_t       throttled_ns[2];
+
 } ThrottleGroupMember;
 
 #define TYPE_THROTTLE_GROUP "throttle-group"
@@ -63,6 +78,8 @@ void throttle_group_unref(ThrottleState *ts);
 
 void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg);
 void throttle_group_get_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg);
+void throttle_group_get_member_stats(ThrottleGroupMember *tgm,
+                                     BlockStatsSpecificThrottle *stats);
 
 void throttle_group_register_tgm(ThrottleGroupMember *tgm,
                                 const char *groupname,
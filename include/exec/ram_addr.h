@@ -47,6 +47,12 @@ struct RAMBlock {
      * of the postcopy phase
      */
     unsigned long *unsentmap;
+    /* pages found to be zero by the migration zero page scan threads */
+    unsigned long *zero_bmap;
+    /* chunks of zero_bmap that the scan threads have completed */
+    unsigned long *zero_scanned;
+    /* next chunk for the zero page scan threads to claim */
+    unsigned long zero_scan_next;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
 };
@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
@@ -47,6 +48,7 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
+    QemuMutex rq_lock;
     void *rq;
     QEMUBH *bh;
     VirtIOBlkConf conf;
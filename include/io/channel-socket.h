@@ -48,6 +48,9 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    /* zero copy writes issued, and those the kernel reported done */
+    uint64_t zero_copy_queued;
+    uint64_t zero_copy_sent;
 };
 
 
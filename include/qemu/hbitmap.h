@@ -145,6 +145,16 @@ void hbitmap_reset_all(HBitmap *hb);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_next_zero:
+ * @hb: The HBitmap to operate on
+ * @start: The bit to start from.
+ *
+ * Find next not dirty bit, or -1 if there is none from @start onwards.
+ * The returned value is never smaller than @start.
+ */
+int64_t hbitmap_next_zero(const HBitmap *hb, uint64_t start);
+
 /**
  * hbitmap_is_serializable:
  * @hb: HBitmap which should be (de-)serialized.
@@ -151,6 +151,10 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+int64_t throttle_compute_delay(ThrottleState *ts, bool is_write, int64_t now);
+
+double throttle_compute_cost(ThrottleState *ts, bool is_write, uint64_t size);
+
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
@@ -405,6 +405,14 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle percentage of this vcpu alone, see cpu_throttle_set_vcpu */
+    int throttle_percentage;
+    /* Pages this vcpu dirtied, as far as the accelerator can tell */
+    uint32_t dirty_pages;
+    /* Unthrottled dirty rate in bytes/s, as last estimated by migration.
+     * Accessed with atomics, hence not wider than a pointer.
+     */
+    unsigned long dirty_rate;
 
     bool ignore_memory_transaction_failures;
 
@@ -840,6 +848,25 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time, or 0 to stop throttling @cpu.
+ *
+ * Like cpu_throttle_set, but for @cpu only.  A vcpu sleeps for the larger of
+ * its own throttle percentage and the one set by cpu_throttle_set.
+ * cpu_throttle_stop stops the throttling of each vcpu too.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vcpu to query.
+ *
+ * Returns: The percentage @cpu is throttled by, 0 if it is not throttled.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 #ifndef CONFIG_USER_ONLY
 
 typedef void (*CPUInterruptHandler)(CPUState *, int);
@@ -14,6 +14,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "migration/blocker.h"
@@ -43,6 +44,7 @@
 #include "migration/colo.h"
 #include "hw/boards.h"
 #include "monitor/monitor.h"
+#include "qom/cpu.h"
 
 #define MAX_THROTTLE  (32 << 20)      /* Migration transfer speed throttling */
 
@@ -79,6 +81,9 @@
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY 200
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
 #define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
+#define DEFAULT_MIGRATE_BITMAP_SYNC_THREADS 4
+#define DEFAULT_MIGRATE_CPU_THROTTLE_PER_VCPU false
+#define DEFAULT_MIGRATE_ZERO_PAGE_THREADS 2
 
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
@@ -171,6 +176,9 @@ void migration_incoming_state_destroy(void)
         mis->from_src_file = NULL;
     }
 
+    /* The preempt channel is left over when postcopy never started */
+    postcopy_preempt_thread_stop(mis);
+
     qemu_event_reset(&mis->main_thread_load_event);
 }
 
@@ -406,12 +414,27 @@ void migration_fd_process_incoming(QEMUFile *f)
 void migration_ioc_process_incoming(QIOChannel *ioc)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
+    bool start_migration;
 
     if (!mis->from_src_file) {
+        /* The first connection is always the main migration stream */
         QEMUFile *f = qemu_fopen_channel_input(ioc);
-        migration_fd_process_incoming(f);
+        migration_incoming_setup(f);
+        /* If we are not multifd, start now */
+        start_migration = !migrate_use_multifd();
+    } else if (migrate_postcopy_preempt()) {
+        /* The second connection is the postcopy preempt channel */
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        start_migration = false;
+    } else {
+        /* Multiple connections */
+        assert(migrate_use_multifd());
+        start_migration = multifd_recv_new_channel(ioc);
+    }
+
+    if (start_migration) {
+        migration_incoming_process();
     }
-    /* We still only have a single channel.  Nothing to do here yet */
 }
 
 /**
@@ -422,7 +445,13 @@ void migration_ioc_process_incoming(QIOChannel *ioc)
  */
 bool migration_has_all_channels(void)
 {
-    return true;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (migrate_postcopy_preempt() && !mis->postcopy_qemufile_dst) {
+        return false;
+    }
+
+    return mis->from_src_file && multifd_recv_all_channels_created();
 }
 
 /*
@@ -491,6 +520,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params = g_malloc0(sizeof(*params));
     params->has_compress_level = true;
     params->compress_level = s->parameters.compress_level;
+    params->has_compress_method = true;
+    params->compress_method = s->parameters.compress_method;
     params->has_compress_threads = true;
     params->compress_threads = s->parameters.compress_threads;
     params->has_decompress_threads = true;
@@ -517,6 +548,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_multifd_page_count = s->parameters.x_multifd_page_count;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
+    params->has_x_bitmap_sync_threads = true;
+    params->x_bitmap_sync_threads = s->parameters.x_bitmap_sync_threads;
+    params->has_x_cpu_throttle_per_vcpu = true;
+    params->x_cpu_throttle_per_vcpu = s->parameters.x_cpu_throttle_per_vcpu;
+    params->has_x_zero_page_threads = true;
+    params->x_zero_page_threads = s->parameters.x_zero_page_threads;
 
     return params;
 }
@@ -555,6 +592,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         qemu_target_page_size();
     info->ram->mbps = s->mbps;
     info->ram->dirty_sync_count = ram_counters.dirty_sync_count;
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
+    info->ram->zero_scan_pages = ram_counters.zero_scan_pages;
     info->ram->postcopy_requests = ram_counters.postcopy_requests;
     info->ram->page_size = qemu_target_page_size();
 
@@ -567,6 +606,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+        info->xbzrle_cache->cache_hit = xbzrle_counters.cache_hit;
+        info->xbzrle_cache->cache_eviction = xbzrle_counters.cache_eviction;
     }
 
     if (cpu_throttle_active()) {
@@ -574,10 +615,31 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
     }
 
+    if (migrate_auto_converge() && migrate_cpu_throttle_per_vcpu()) {
+        VcpuThrottleInfoList **tail = &info->vcpu_throttle;
+        CPUState *cpu;
+
+        info->has_vcpu_throttle = true;
+        CPU_FOREACH(cpu) {
+            VcpuThrottleInfoList *entry = g_new0(VcpuThrottleInfoList, 1);
+
+            entry->value = g_new0(VcpuThrottleInfo, 1);
+            entry->value->cpu_index = cpu->cpu_index;
+            entry->value->dirty_rate = atomic_read(&cpu->dirty_rate);
+            entry->value->throttle_percentage =
+                cpu_throttle_get_vcpu_percentage(cpu);
+            *tail = entry;
+            tail = &entry->next;
+        }
+    }
+
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         info->ram->remaining = ram_bytes_remaining();
         info->ram->dirty_pages_rate = ram_counters.dirty_pages_rate;
     }
+
+    info->iterations = ram_iteration_stats();
+    info->has_iterations = !!info->iterations;
 }
 
 static void populate_disk_info(MigrationInfo *info)
@@ -709,6 +771,31 @@ static bool migrate_caps_check(bool *cap_list,
             error_setg(errp, "Postcopy is not supported");
             return false;
         }
+
+        if (cap_list[MIGRATION_CAPABILITY_X_MULTIFD]) {
+            /* Pages sent through the multifd channels are not placed
+             * atomically, and they are only ordered against the main
+             * stream at the end of each round.
+             */
+            error_setg(errp, "Postcopy is not currently compatible "
+                       "with multifd");
+            return false;
+        }
+    } else if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        error_setg(errp, "Postcopy preemption requires postcopy-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+#ifndef CONFIG_LINUX
+        error_setg(errp, "Zero copy send is only supported on Linux");
+        return false;
+#endif
+        /* Only the multifd channels send guest pages apart from headers */
+        if (!cap_list[MIGRATION_CAPABILITY_X_MULTIFD]) {
+            error_setg(errp, "Zero copy send requires x-multifd");
+            return false;
+        }
     }
 
     return true;
@@ -747,6 +834,23 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_x_cpu_throttle_per_vcpu &&
+        params->x_cpu_throttle_per_vcpu && !tcg_enabled()) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_cpu_throttle_per_vcpu",
+                   "is only supported with TCG");
+        return false;
+    }
+
+#ifndef CONFIG_ZSTD
+    if (params->has_compress_method &&
+        params->compress_method == COMPRESS_METHOD_ZSTD) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_method",
+                   "is invalid, QEMU was built without zstd support");
+        return false;
+    }
+#endif
+
     if (params->has_compress_threads &&
         (params->compress_threads < 1 || params->compress_threads > 255)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
@@ -829,6 +933,24 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_x_bitmap_sync_threads &&
+        (params->x_bitmap_sync_threads < 0 ||
+         params->x_bitmap_sync_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_bitmap_sync_threads",
+                   "is invalid, it should be in the range of 0 to 64");
+        return false;
+    }
+
+    if (params->has_x_zero_page_threads &&
+        (params->x_zero_page_threads < 0 ||
+         params->x_zero_page_threads > 64)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_zero_page_threads",
+                   "is invalid, it should be in the range of 0 to 64");
+        return false;
+    }
+
     return true;
 }
 
@@ -843,6 +965,10 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
         dest->compress_level = params->compress_level;
     }
 
+    if (params->has_compress_method) {
+        dest->compress_method = params->compress_method;
+    }
+
     if (params->has_compress_threads) {
         dest->compress_threads = params->compress_threads;
     }
@@ -893,6 +1019,15 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
+    if (params->has_x_bitmap_sync_threads) {
+        dest->x_bitmap_sync_threads = params->x_bitmap_sync_threads;
+    }
+    if (params->has_x_cpu_throttle_per_vcpu) {
+        dest->x_cpu_throttle_per_vcpu = params->x_cpu_throttle_per_vcpu;
+    }
+    if (params->has_x_zero_page_threads) {
+        dest->x_zero_page_threads = params->x_zero_page_threads;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -905,6 +1040,10 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.compress_level = params->compress_level;
     }
 
+    if (params->has_compress_method) {
+        s->parameters.compress_method = params->compress_method;
+    }
+
     if (params->has_compress_threads) {
         s->parameters.compress_threads = params->compress_threads;
     }
@@ -965,6 +1104,15 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
     }
+    if (params->has_x_bitmap_sync_threads) {
+        s->parameters.x_bitmap_sync_threads = params->x_bitmap_sync_threads;
+    }
+    if (params->has_x_cpu_throttle_per_vcpu) {
+        s->parameters.x_cpu_throttle_per_vcpu = params->x_cpu_throttle_per_vcpu;
+    }
+    if (params->has_x_zero_page_threads) {
+        s->parameters.x_zero_page_threads = params->x_zero_page_threads;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
@@ -1091,6 +1239,10 @@ static void migrate_fd_cleanup(void *opaque)
         if (multifd_save_cleanup(&local_err) != 0) {
             error_report_err(local_err);
         }
+        if (s->postcopy_qemufile_src) {
+            qemu_fclose(s->postcopy_qemufile_src);
+            s->postcopy_qemufile_src = NULL;
+        }
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -1164,6 +1316,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING && s->postcopy_qemufile_src) {
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -1359,6 +1514,39 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "Multifd migration is only supported over "
+                       "tcp and unix sockets");
+            return;
+        }
+        if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+            error_setg(errp, "Multifd migration is not currently "
+                       "compatible with TLS");
+            return;
+        }
+    }
+
+    if (migrate_cpu_throttle_per_vcpu() && !tcg_enabled()) {
+        /* the parameter may have been set with -global before the
+         * accelerator was known */
+        error_setg(errp, "Per-vCPU throttling is only supported with TCG");
+        return;
+    }
+
+    if (migrate_postcopy_preempt()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "Postcopy preemption is only supported over "
+                       "tcp and unix sockets");
+            return;
+        }
+        if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+            error_setg(errp, "Postcopy preemption is not currently "
+                       "compatible with TLS");
+            return;
+        }
+    }
+
     if ((has_blk && blk) || (has_inc && inc)) {
         if (migrate_use_block() || migrate_use_block_incremental()) {
             error_setg(errp, "Command options are incompatible with "
@@ -1485,6 +1673,24 @@ bool migrate_postcopy_ram(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
 bool migrate_postcopy(void)
 {
     return migrate_postcopy_ram();
@@ -1526,6 +1732,15 @@ int migrate_compress_level(void)
     return s->parameters.compress_level;
 }
 
+CompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
 int migrate_compress_threads(void)
 {
     MigrationState *s;
@@ -1590,6 +1805,33 @@ int migrate_multifd_page_count(void)
     return s->parameters.x_multifd_page_count;
 }
 
+int migrate_bitmap_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_bitmap_sync_threads;
+}
+
+bool migrate_cpu_throttle_per_vcpu(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_cpu_throttle_per_vcpu;
+}
+
+int migrate_zero_page_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_zero_page_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -1851,6 +2093,12 @@ static int postcopy_start(MigrationState *ms, bool *old_vm_running)
     int64_t time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    if (migrate_postcopy_preempt()) {
+        /* Make sure the preempt channel is usable before faults come in */
+        qemu_sem_wait(&ms->postcopy_qemufile_src_sem);
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -2366,6 +2614,9 @@ void migrate_fd_connect(MigrationState *s)
         migrate_fd_cleanup(s);
         return;
     }
+    if (migrate_postcopy_preempt()) {
+        postcopy_preempt_setup(s);
+    }
     qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     s->migration_thread_running = true;
@@ -2426,6 +2677,15 @@ static Property migration_properties[] = {
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
+    DEFINE_PROP_INT64("x-bitmap-sync-threads", MigrationState,
+                      parameters.x_bitmap_sync_threads,
+                      DEFAULT_MIGRATE_BITMAP_SYNC_THREADS),
+    DEFINE_PROP_BOOL("x-cpu-throttle-per-vcpu", MigrationState,
+                     parameters.x_cpu_throttle_per_vcpu,
+                     DEFAULT_MIGRATE_CPU_THROTTLE_PER_VCPU),
+    DEFINE_PROP_INT64("x-zero-page-threads", MigrationState,
+                      parameters.x_zero_page_threads,
+                      DEFAULT_MIGRATE_ZERO_PAGE_THREADS),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -2461,6 +2721,7 @@ static void migration_instance_finalize(Object *obj)
     g_free(params->tls_hostname);
     g_free(params->tls_creds);
     qemu_sem_destroy(&ms->pause_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
 }
 
 static void migration_instance_init(Object *obj)
@@ -2471,13 +2732,16 @@ static void migration_instance_init(Object *obj)
     ms->state = MIGRATION_STATUS_NONE;
     ms->mbps = -1;
     qemu_sem_init(&ms->pause_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_mutex_init(&ms->error_mutex);
 
     params->tls_hostname = g_strdup("");
     params->tls_creds = g_strdup("");
+    params->compress_method = COMPRESS_METHOD_ZLIB;
 
     /* Set has_* up only for parameter checks */
     params->has_compress_level = true;
+    params->has_compress_method = true;
     params->has_compress_threads = true;
     params->has_decompress_threads = true;
     params->has_cpu_throttle_initial = true;
@@ -2489,6 +2753,9 @@ static void migration_instance_init(Object *obj)
     params->has_x_multifd_channels = true;
     params->has_x_multifd_page_count = true;
     params->has_xbzrle_cache_size = true;
+    params->has_x_bitmap_sync_threads = true;
+    params->has_x_cpu_throttle_per_vcpu = true;
+    params->has_x_zero_page_threads = true;
 }
 
 /*
@@ -50,6 +50,13 @@ struct MigrationIncomingState {
     void     *postcopy_tmp_page;
     void     *postcopy_tmp_zero_page;
 
+    /* Postcopy preempt channel, only carries the pages we asked for */
+    QEMUFile *postcopy_qemufile_dst;
+    bool      have_preempt_thread;
+    bool      postcopy_preempt_quit;
+    QemuThread preempt_thread;
+    void     *postcopy_preempt_tmp_page;
+
     QEMUBH *bh;
 
     int state;
@@ -89,6 +96,10 @@ struct MigrationState
     QemuThread thread;
     QEMUBH *cleanup_bh;
     QEMUFile *to_dst_file;
+    /* Postcopy preempt channel, for the pages the destination faults on */
+    QEMUFile *postcopy_qemufile_src;
+    /* Posted once the preempt channel is connected, or failed to */
+    QemuSemaphore postcopy_qemufile_src_sem;
 
     /* params from 'migrate-set-parameters' */
     MigrationParameters parameters;
@@ -180,6 +191,8 @@ bool migrate_postcopy(void);
 
 bool migrate_release_ram(void);
 bool migrate_postcopy_ram(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_use_zero_copy_send(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
@@ -187,6 +200,9 @@ bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 int migrate_multifd_page_count(void);
+int migrate_bitmap_sync_threads(void);
+bool migrate_cpu_throttle_per_vcpu(void);
+int migrate_zero_page_threads(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -198,6 +214,7 @@ bool migrate_use_return_path(void);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+CompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, based on a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +18,9 @@
 #include "qapi/error.h"
 #include "qemu-common.h"
 #include "qemu/host-utils.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
 #include "migration/page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -31,19 +34,35 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of pages that can share a set */
+#define CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
+typedef struct CacheSet CacheSet;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    /* referenced since the clock hand last passed, protected by set lock */
+    bool it_ref;
+};
+
+struct CacheSet {
+    QemuMutex lock;
+    /* next way examined when looking for a victim */
+    unsigned hand;
 };
 
 struct PageCache {
+    struct rcu_head rcu;
     CacheItem *page_cache;
+    CacheSet *sets;
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t num_sets;
+    unsigned ways;
 };
 
 PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
@@ -75,15 +94,21 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %zu in %zu sets\n",
+            cache->max_num_items, cache->num_sets);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->sets = g_try_malloc(cache->num_sets * sizeof(*cache->sets));
+    if (!cache->page_cache || !cache->sets) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "cache size",
                    "Failed to allocate page cache");
+        g_free(cache->page_cache);
+        g_free(cache->sets);
         g_free(cache);
         return NULL;
     }
@@ -92,6 +117,12 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_ref = false;
+    }
+
+    for (i = 0; i < cache->num_sets; i++) {
+        qemu_mutex_init(&cache->sets[i].lock);
+        cache->sets[i].hand = 0;
     }
 
     return cache;
@@ -108,78 +139,154 @@ void cache_fini(PageCache *cache)
         g_free(cache->page_cache[i].it_data);
     }
 
+    for (i = 0; i < cache->num_sets; i++) {
+        qemu_mutex_destroy(&cache->sets[i].lock);
+    }
+
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    g_free(cache->sets);
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+void cache_fini_rcu(PageCache *cache)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    call_rcu(cache, cache_fini, rcu);
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/* Must be called with the lock of set @set held */
+static CacheItem *cache_set_lookup(const PageCache *cache, size_t set,
+                                   uint64_t addr)
+{
+    CacheItem *ways = &cache->page_cache[set * cache->ways];
+    unsigned i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->ways; i++) {
+        if (ways[i].it_addr == addr) {
+            return &ways[i];
+        }
+    }
+    return NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+/*
+ * Pick the way that receives a new page: an unused one if there is
+ * one, otherwise the first one the clock hand finds that is older
+ * than CACHED_PAGE_LIFETIME and was not referenced since the hand last
+ * passed it.  Fresh ways are skipped and keep their reference bit.
+ * Returns NULL if every way of the set is fresh.
+ * Must be called with the lock of set @set held.
+ */
+static CacheItem *cache_set_victim(PageCache *cache, size_t set,
+                                   uint64_t current_age)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *ways = &cache->page_cache[set * cache->ways];
+    CacheSet *cs = &cache->sets[set];
+    CacheItem *it;
+    unsigned i;
+
+    for (i = 0; i < cache->ways; i++) {
+        if (!ways[i].it_data) {
+            return &ways[i];
+        }
+    }
+
+    /* the first turn clears the reference bits of the stale ways */
+    for (i = 0; i < 2 * cache->ways; i++) {
+        it = &ways[cs->hand];
+        cs->hand = (cs->hand + 1) & (cache->ways - 1);
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            continue;
+        }
+        if (!it->it_ref) {
+            return it;
+        }
+        it->it_ref = false;
+    }
+    return NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_get_data(PageCache *cache, uint64_t addr, uint8_t *buf,
+                    uint64_t current_age)
 {
+    size_t set = cache_get_set(cache, addr);
     CacheItem *it;
 
-    it = cache_get_by_addr(cache, addr);
+    qemu_mutex_lock(&cache->sets[set].lock);
+    it = cache_set_lookup(cache, set, addr);
+    if (it) {
+        memcpy(buf, it->it_data, cache->page_size);
+        it->it_age = current_age;
+        it->it_ref = true;
+    }
+    qemu_mutex_unlock(&cache->sets[set].lock);
+
+    return it != NULL;
+}
 
-    if (it->it_addr == addr) {
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
+{
+    size_t set = cache_get_set(cache, addr);
+    CacheItem *it;
+
+    qemu_mutex_lock(&cache->sets[set].lock);
+    it = cache_set_lookup(cache, set, addr);
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
-        return true;
+        it->it_ref = true;
     }
-    return false;
+    qemu_mutex_unlock(&cache->sets[set].lock);
+
+    return it != NULL;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
+    size_t set = cache_get_set(cache, addr);
     CacheItem *it;
+    int ret = 0;
 
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    qemu_mutex_lock(&cache->sets[set].lock);
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    it = cache_set_lookup(cache, set, addr);
+    if (!it) {
+        it = cache_set_victim(cache, set, current_age);
+        if (!it) {
+            /* all the cached pages of the set are fresh, keep them */
+            ret = -1;
+            goto out;
+        }
+        if (it->it_data) {
+            ret = 1;
+        }
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
         if (!it->it_data) {
             DPRINTF("Error allocating page\n");
-            return -1;
+            ret = -1;
+            goto out;
         }
-        cache->num_items++;
+        atomic_inc(&cache->num_items);
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
     it->it_addr = addr;
+    it->it_ref = true;
 
-    return 0;
+out:
+    qemu_mutex_unlock(&cache->sets[set].lock);
+    return ret;
 }
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, based on a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -15,7 +15,12 @@
 #ifndef PAGE_CACHE_H
 #define PAGE_CACHE_H
 
-/* Page cache for storing guest pages */
+/* Page cache for storing guest pages
+ *
+ * Lookups and inserts only lock the set the page hashes to, so the
+ * cache can be used from several threads.  Pages within a set are
+ * replaced in CLOCK order.
+ */
 typedef struct PageCache PageCache;
 
 /**
@@ -35,6 +40,12 @@ PageCache *cache_init(int64_t cache_size, size_t page_size, Error **errp);
  */
 void cache_fini(PageCache *cache);
 
+/**
+ * cache_fini_rcu: free all cache resources after an RCU grace period
+ * @cache pointer to the PageCache struct
+ */
+void cache_fini_rcu(PageCache *cache);
+
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
@@ -44,24 +55,29 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
- * get_cached_data: Get the data cached for an addr
+ * cache_get_data: Copy the data cached for an addr
  *
- * Returns pointer to the data cached or NULL if not cached
+ * Returns %true if the page is cached.  Like cache_is_cached(), it
+ * also updates the age of the page.  The copy is taken under the set
+ * lock, so a concurrent insert cannot change it halfway.
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
+ * @buf: buffer of the cache page size that receives the data
+ * @current_age: current bitmap generation
  */
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
+bool cache_get_data(PageCache *cache, uint64_t addr, uint8_t *buf,
+                    uint64_t current_age);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 when the page isn't inserted into cache
+ * Returns -1 when the page isn't inserted into cache, 1 when another
+ * page was evicted to make room for it and 0 otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -26,6 +26,11 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qapi/error.h"
+#include "io/channel.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -376,6 +381,12 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /*
+     * Pages sent on the preempt channel are not sent again on the main
+     * stream, so wait for them before the fault thread goes away.
+     */
+    postcopy_preempt_thread_stop(mis);
+
     if (mis->have_fault_thread) {
         uint64_t tmp64;
 
@@ -625,6 +636,10 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
     qemu_sem_destroy(&mis->fault_thread_sem);
     mis->have_fault_thread = true;
 
+    if (mis->postcopy_qemufile_dst && postcopy_preempt_thread_start(mis)) {
+        return -1;
+    }
+
     /* Mark so that we get notified of accesses to unwritten areas */
     if (qemu_ram_foreach_block(ram_block_enable_notify, mis)) {
         return -1;
@@ -682,6 +697,12 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
      */
     if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, from, pagesize, rb)) {
         int e = errno;
+
+        if (e == EEXIST && mis->postcopy_qemufile_dst) {
+            /* Already placed from the other channel */
+            trace_postcopy_place_page_exists(host);
+            return 0;
+        }
         error_report("%s: %s copy host: %p from: %p (size: %zd)",
                      __func__, strerror(e), host, from, pagesize);
 
@@ -705,6 +726,12 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
         if (qemu_ufd_copy_ioctl(mis->userfault_fd, host, NULL, getpagesize(),
                                 rb)) {
             int e = errno;
+
+            if (e == EEXIST && mis->postcopy_qemufile_dst) {
+                /* Already placed from the other channel */
+                trace_postcopy_place_page_exists(host);
+                return 0;
+            }
             error_report("%s: %s zero host: %p",
                          __func__, strerror(e), host);
 
@@ -712,19 +739,22 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
         }
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+        if (!atomic_read(&mis->postcopy_tmp_zero_page)) {
+            void *zero_page = mmap(NULL, mis->largest_page_size,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (zero_page == MAP_FAILED) {
                 int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
                 error_report("%s: %s mapping large zero page",
                              __func__, strerror(e));
                 return -e;
             }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+            memset(zero_page, '\0', mis->largest_page_size);
+            /* The preempt thread may be placing a zero page too */
+            if (atomic_cmpxchg(&mis->postcopy_tmp_zero_page, NULL,
+                               zero_page)) {
+                munmap(zero_page, mis->largest_page_size);
+            }
         }
         return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
                                    rb);
@@ -911,3 +941,143 @@ PostcopyState postcopy_state_set(PostcopyState new_state)
 {
     return atomic_xchg(&incoming_postcopy_state, new_state);
 }
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Postcopy preemption: the pages the destination faults on are sent on a
+ * channel of their own, so that they do not queue up behind the pages that
+ * the source streams in the background on the main channel.
+ */
+
+static void postcopy_preempt_new_channel_cb(QIOTask *task, void *opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        /* Urgent pages will go through the main channel instead */
+        error_report_err(local_err);
+    } else if (s->to_dst_file) {
+        /* The migration may have been cleaned up while connecting */
+        trace_postcopy_preempt_new_channel();
+        qio_channel_set_name(ioc, "migration-postcopy-preempt");
+        s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+        qemu_file_set_blocking(s->postcopy_qemufile_src, true);
+    }
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/**
+ * postcopy_preempt_setup: connect the postcopy preempt channel
+ *
+ * Connecting is asynchronous; postcopy_qemufile_src_sem is posted once it
+ * completes, successfully or not.
+ *
+ * @s: The current migration state.
+ */
+void postcopy_preempt_setup(MigrationState *s)
+{
+    /* Forget about any previous migration that never entered postcopy */
+    qemu_sem_destroy(&s->postcopy_qemufile_src_sem);
+    qemu_sem_init(&s->postcopy_qemufile_src_sem, 0);
+
+    socket_send_channel_create(postcopy_preempt_new_channel_cb, s);
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    ret = ram_load_postcopy_preempt(mis->postcopy_qemufile_dst,
+                                    mis->postcopy_preempt_tmp_page);
+
+    rcu_unregister_thread();
+    if (ret < 0 && !atomic_read(&mis->postcopy_preempt_quit)) {
+        error_report("%s: %s", __func__, strerror(-ret));
+        /* The pages that were asked for are lost, fail the main stream */
+        qemu_file_set_error(mis->from_src_file, ret);
+    }
+    trace_postcopy_preempt_thread_exit(ret);
+
+    return NULL;
+}
+
+/**
+ * postcopy_preempt_thread_start: start loading pages from the preempt channel
+ *
+ * Called once postcopy is listening and the preempt channel is connected,
+ * whichever comes last.
+ *
+ * Returns 0 on success
+ *
+ * @mis: The incoming migration state.
+ */
+int postcopy_preempt_thread_start(MigrationIncomingState *mis)
+{
+    mis->postcopy_preempt_tmp_page = qemu_try_memalign(qemu_real_host_page_size,
+                                                       mis->largest_page_size);
+    if (!mis->postcopy_preempt_tmp_page) {
+        error_report("%s: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    mis->postcopy_preempt_quit = false;
+    qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+    mis->have_preempt_thread = true;
+
+    return 0;
+}
+
+/**
+ * postcopy_preempt_thread_stop: stop loading pages from the preempt channel
+ *
+ * The source ends the preempt channel with an EOS when postcopy completes,
+ * so the thread is only interrupted if the main stream failed.
+ *
+ * @mis: The incoming migration state.
+ */
+void postcopy_preempt_thread_stop(MigrationIncomingState *mis)
+{
+    if (mis->have_preempt_thread) {
+        if (!mis->from_src_file || qemu_file_get_error(mis->from_src_file)) {
+            atomic_set(&mis->postcopy_preempt_quit, true);
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+
+        qemu_vfree(mis->postcopy_preempt_tmp_page);
+        mis->postcopy_preempt_tmp_page = NULL;
+    }
+
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
+}
+
+/**
+ * postcopy_preempt_new_channel: the source connected the preempt channel
+ *
+ * @mis: The incoming migration state.
+ * @f: The preempt channel.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f)
+{
+    trace_postcopy_preempt_new_channel();
+    mis->postcopy_qemufile_dst = f;
+    qemu_file_set_blocking(f, true);
+
+    /* Already listening: start loading pages now */
+    if (mis->have_fault_thread && postcopy_preempt_thread_start(mis)) {
+        qemu_file_set_error(mis->from_src_file, -ENOMEM);
+    }
+}
@@ -114,4 +114,10 @@ PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
 PostcopyState postcopy_state_set(PostcopyState new_state);
 
+/* Postcopy preempt channel */
+void postcopy_preempt_setup(MigrationState *s);
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f);
+int postcopy_preempt_thread_start(MigrationIncomingState *mis);
+void postcopy_preempt_thread_stop(MigrationIncomingState *mis);
+
 #endif
@@ -28,6 +28,9 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
@@ -43,12 +46,17 @@
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
+#include "qapi/clone-visitor.h"
+#include "qapi-visit.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
 #include "exec/target_page.h"
 #include "qemu/rcu_queue.h"
 #include "migration/colo.h"
 #include "migration/block.h"
+#include "sysemu/sysemu.h"
+#include "qemu/uuid.h"
+#include "socket.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -68,6 +76,7 @@
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
@@ -83,7 +92,9 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /* buffer for the cached copy of the page */
+    uint8_t *prev_buf;
+    /* Cache for XBZRLE.  Replaced and freed under lock, read under RCU. */
     PageCache *cache;
     QemuMutex lock;
     /* it will store a page full of zeros */
@@ -110,7 +121,9 @@ static void XBZRLE_cache_unlock(void)
  * This function is called from qmp_migrate_set_cache_size in main
  * thread, possibly while a migration is in progress.  A running
  * migration may be using the cache and might finish during this call,
- * hence changes to the cache are protected by XBZRLE.lock().
+ * hence changes to the cache are protected by XBZRLE.lock().  The
+ * migration thread reads XBZRLE.cache under rcu_read_lock(), so the old
+ * cache is only freed after a grace period.
  *
  * Returns 0 for success or -1 for error
  *
@@ -119,7 +132,7 @@ static void XBZRLE_cache_unlock(void)
  */
 int xbzrle_cache_resize(int64_t new_size, Error **errp)
 {
-    PageCache *new_cache;
+    PageCache *new_cache, *old_cache;
     int64_t ret = 0;
 
     /* Check for truncation */
@@ -143,8 +156,9 @@ int xbzrle_cache_resize(int64_t new_size, Error **errp)
             goto out;
         }
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+        old_cache = XBZRLE.cache;
+        atomic_rcu_set(&XBZRLE.cache, new_cache);
+        cache_fini_rcu(old_cache);
     }
 out:
     XBZRLE_cache_unlock();
@@ -192,6 +206,16 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/* Cumulative page and byte counters, sampled at each iteration start */
+typedef struct {
+    uint64_t transferred;
+    uint64_t duplicate;
+    uint64_t normal;
+    uint64_t xbzrle_pages;
+    uint64_t compress_pages;
+    uint64_t multifd_pages;
+} RAMIterationCounters;
+
 /* State of RAM for migration */
 struct RAMState {
     /* QEMUFile used for this migration */
@@ -223,6 +247,25 @@ struct RAMState {
     uint64_t iterations;
     /* number of dirty bits in the bitmap */
     uint64_t migration_dirty_pages;
+    /* the bitmap was synced since the multifd channels were last flushed */
+    bool multifd_sync_needed;
+    /* pages handed to the compression threads */
+    uint64_t compress_pages;
+    /* pages queued on the multifd channels */
+    uint64_t multifd_pages;
+    /* these variables are used for the per iteration statistics */
+    /* start of the current iteration */
+    int64_t iteration_start_time;
+    /* time taken by the bitmap sync that started it, in us */
+    int64_t iteration_sync_time;
+    /* dirty pages when it started */
+    uint64_t iteration_dirty_pages;
+    /* counters when it started */
+    RAMIterationCounters iteration_start;
+    /* the results of the zero page threads can be used */
+    bool zero_scan_active;
+    /* block the migration thread last looked up in the zero page results */
+    RAMBlock *zero_scan_block;
     /* protects modification of the bitmap */
     QemuMutex bitmap_mutex;
     /* The RAMBlock used in the last src_page_requests */
@@ -253,6 +296,37 @@ struct PageSearchStatus {
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
+/* Pages that compress to more than this are sent raw instead */
+#define COMPRESS_MAX_LEN (TARGET_PAGE_SIZE - TARGET_PAGE_SIZE / 8)
+/* Maximum number of pages sent raw before trying to compress again */
+#define COMPRESS_MAX_BACKOFF 64
+
+/* Compression state, kept by its thread for the whole migration */
+struct PageCompressor {
+    CompressMethod method;
+    int level;
+    z_stream stream;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+    /* the page is compressed here before being written to the file */
+    uint8_t *buf;
+    size_t buf_len;
+    /* pages left to send raw, and the length of the next such run */
+    unsigned skip;
+    unsigned backoff;
+};
+typedef struct PageCompressor PageCompressor;
+
+struct PageDecompressor {
+    CompressMethod method;
+    z_stream stream;
+#ifdef CONFIG_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+};
+typedef struct PageDecompressor PageDecompressor;
+
 struct CompressParam {
     bool done;
     bool quit;
@@ -261,6 +335,7 @@ struct CompressParam {
     QemuCond cond;
     RAMBlock *block;
     ram_addr_t offset;
+    PageCompressor compressor;
 };
 typedef struct CompressParam CompressParam;
 
@@ -272,11 +347,14 @@ struct DecompressParam {
     void *des;
     uint8_t *compbuf;
     int len;
+    PageDecompressor decompressor;
 };
 typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
+/* used by the migration thread for the first page of each block */
+static PageCompressor main_compressor;
 /* comp_done_cond is used to wake up the migration thread when
  * one of the compression threads has finished the compression.
  * comp_done_lock is used to co-work with comp_done_cond.
@@ -291,8 +369,138 @@ static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
-                                ram_addr_t offset);
+static int do_compress_ram_page(QEMUFile *f, PageCompressor *c,
+                                RAMBlock *block, ram_addr_t offset);
+
+static size_t compress_bound(CompressMethod method)
+{
+#ifdef CONFIG_ZSTD
+    if (method == COMPRESS_METHOD_ZSTD) {
+        return ZSTD_compressBound(TARGET_PAGE_SIZE);
+    }
+#endif
+    return compressBound(TARGET_PAGE_SIZE);
+}
+
+static int page_compressor_init(PageCompressor *c, CompressMethod method,
+                                int level)
+{
+    memset(c, 0, sizeof(*c));
+    c->method = method;
+    c->level = level;
+    c->buf_len = compress_bound(method);
+    c->buf = g_malloc(c->buf_len);
+
+#ifdef CONFIG_ZSTD
+    if (method == COMPRESS_METHOD_ZSTD) {
+        c->zstd = ZSTD_createCCtx();
+        if (!c->zstd) {
+            goto err;
+        }
+        return 0;
+    }
+#endif
+    if (deflateInit(&c->stream, level) != Z_OK) {
+        goto err;
+    }
+    return 0;
+
+err:
+    g_free(c->buf);
+    c->buf = NULL;
+    return -1;
+}
+
+static void page_compressor_cleanup(PageCompressor *c)
+{
+    if (!c->buf) {
+        return;
+    }
+#ifdef CONFIG_ZSTD
+    if (c->method == COMPRESS_METHOD_ZSTD) {
+        ZSTD_freeCCtx(c->zstd);
+        c->zstd = NULL;
+    } else
+#endif
+    {
+        deflateEnd(&c->stream);
+    }
+    g_free(c->buf);
+    c->buf = NULL;
+}
+
+/* Returns the length of the data compressed into c->buf, -1 on error */
+static ssize_t page_compress(PageCompressor *c, const uint8_t *p)
+{
+#ifdef CONFIG_ZSTD
+    if (c->method == COMPRESS_METHOD_ZSTD) {
+        size_t ret = ZSTD_compressCCtx(c->zstd, c->buf, c->buf_len,
+                                       p, TARGET_PAGE_SIZE, c->level);
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+    if (deflateReset(&c->stream) != Z_OK) {
+        return -1;
+    }
+    c->stream.next_in = (Bytef *)p;
+    c->stream.avail_in = TARGET_PAGE_SIZE;
+    c->stream.next_out = c->buf;
+    c->stream.avail_out = c->buf_len;
+    if (deflate(&c->stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return c->stream.total_out;
+}
+
+static int page_decompressor_init(PageDecompressor *d, CompressMethod method)
+{
+    memset(d, 0, sizeof(*d));
+    d->method = method;
+
+#ifdef CONFIG_ZSTD
+    if (method == COMPRESS_METHOD_ZSTD) {
+        d->zstd = ZSTD_createDCtx();
+        return d->zstd ? 0 : -1;
+    }
+#endif
+    return inflateInit(&d->stream) == Z_OK ? 0 : -1;
+}
+
+static void page_decompressor_cleanup(PageDecompressor *d)
+{
+#ifdef CONFIG_ZSTD
+    if (d->method == COMPRESS_METHOD_ZSTD) {
+        ZSTD_freeDCtx(d->zstd);
+        d->zstd = NULL;
+        return;
+    }
+#endif
+    inflateEnd(&d->stream);
+}
+
+/* Returns the length of the page decompressed into @des, -1 on error */
+static int page_decompress(PageDecompressor *d, uint8_t *des,
+                           const uint8_t *src, int len)
+{
+#ifdef CONFIG_ZSTD
+    if (d->method == COMPRESS_METHOD_ZSTD) {
+        size_t ret = ZSTD_decompressDCtx(d->zstd, des, TARGET_PAGE_SIZE,
+                                         src, len);
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+    if (inflateReset(&d->stream) != Z_OK) {
+        return -1;
+    }
+    d->stream.next_in = (Bytef *)src;
+    d->stream.avail_in = len;
+    d->stream.next_out = des;
+    d->stream.avail_out = TARGET_PAGE_SIZE;
+    if (inflate(&d->stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return d->stream.total_out;
+}
 
 static void *do_data_compress(void *opaque)
 {
@@ -308,7 +516,8 @@ static void *do_data_compress(void *opaque)
             param->block = NULL;
             qemu_mutex_unlock(&param->mutex);
 
-            do_compress_ram_page(param->file, block, offset);
+            do_compress_ram_page(param->file, &param->compressor,
+                                 block, offset);
 
             qemu_mutex_lock(&comp_done_lock);
             param->done = true;
@@ -325,35 +534,32 @@ static void *do_data_compress(void *opaque)
     return NULL;
 }
 
-static inline void terminate_compression_threads(void)
-{
-    int idx, thread_count;
-
-    thread_count = migrate_compress_threads();
-
-    for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        comp_param[idx].quit = true;
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
-    }
-}
-
 static void compress_threads_save_cleanup(void)
 {
     int i, thread_count;
 
-    if (!migrate_use_compression()) {
+    if (!migrate_use_compression() || !comp_param) {
         return;
     }
-    terminate_compression_threads();
     thread_count = migrate_compress_threads();
     for (i = 0; i < thread_count; i++) {
+        /* the file is only set once the thread has been started */
+        if (!comp_param[i].file) {
+            break;
+        }
+        qemu_mutex_lock(&comp_param[i].mutex);
+        comp_param[i].quit = true;
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_param[i].mutex);
+
         qemu_thread_join(compress_threads + i);
         qemu_fclose(comp_param[i].file);
+        comp_param[i].file = NULL;
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
+        page_compressor_cleanup(&comp_param[i].compressor);
     }
+    page_compressor_cleanup(&main_compressor);
     qemu_mutex_destroy(&comp_done_lock);
     qemu_cond_destroy(&comp_done_cond);
     g_free(compress_threads);
@@ -362,19 +568,28 @@ static void compress_threads_save_cleanup(void)
     comp_param = NULL;
 }
 
-static void compress_threads_save_setup(void)
+static int compress_threads_save_setup(void)
 {
     int i, thread_count;
+    CompressMethod method = migrate_compress_method();
+    int level = migrate_compress_level();
 
     if (!migrate_use_compression()) {
-        return;
+        return 0;
     }
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
     qemu_cond_init(&comp_done_cond);
     qemu_mutex_init(&comp_done_lock);
+    if (page_compressor_init(&main_compressor, method, level) < 0) {
+        goto err;
+    }
     for (i = 0; i < thread_count; i++) {
+        if (page_compressor_init(&comp_param[i].compressor,
+                                 method, level) < 0) {
+            goto err;
+        }
         /* comp_param[i].file is just used as a dummy buffer to save data,
          * set its ops to empty.
          */
@@ -387,38 +602,353 @@ static void compress_threads_save_setup(void)
                            do_data_compress, comp_param + i,
                            QEMU_THREAD_JOINABLE);
     }
+    return 0;
+
+err:
+    error_report("%s: failed to set up the %s compressor", __func__,
+                 CompressMethod_str(method));
+    compress_threads_save_cleanup();
+    return -1;
 }
 
 /* Multiple fd's */
 
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    unsigned char uuid[16]; /* QemuUUID */
+    uint8_t id;
+} __attribute__((packed)) MultiFDInit_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    /* maximum number of pages in a packet */
+    uint32_t size;
+    /* number of pages used in this packet */
+    uint32_t used;
+    uint64_t packet_num;
+    char ramblock[256];
+    uint64_t offset[];
+} __attribute__((packed)) MultiFDPacket_t;
+
+typedef struct {
+    /* number of used pages */
+    uint32_t used;
+    /* number of allocated pages */
+    uint32_t allocated;
+    /* offset of each page */
+    ram_addr_t *offset;
+    /* pointer to each page */
+    struct iovec *iov;
+    RAMBlock *block;
+} MultiFDPages_t;
+
 struct MultiFDSendParams {
+    /* these fields are not changed once the thread is created */
     uint8_t id;
     char *name;
     QemuThread thread;
+    QIOChannel *c;
+    /* sem where to wait for more work */
     QemuSemaphore sem;
+    /* this mutex protects the following parameters */
     QemuMutex mutex;
+    /* has the thread been created */
+    bool running;
     bool quit;
+    /* number of jobs queued for the thread */
+    int pending_job;
+    /* array of pages to send */
+    MultiFDPages_t *pages;
+    /* size of the packet, including the page offsets */
+    uint32_t packet_len;
+    MultiFDPacket_t *packet;
+    /* multifd flags for the next packet */
+    uint32_t flags;
+    /* global number of the next packet */
+    uint64_t packet_num;
+    /* flags for the writes of the pages, QIO_CHANNEL_WRITE_FLAG_* */
+    int write_flags;
+    /* bytes handed to this channel in the current iteration */
+    uint64_t iteration_transferred;
+    /* thread local variables */
+    /* packets sent through this channel */
+    uint64_t num_packets;
+    /* pages sent through this channel */
+    uint64_t num_pages;
 };
 typedef struct MultiFDSendParams MultiFDSendParams;
 
-struct {
+struct MultiFDRecvParams {
+    /* these fields are not changed once the thread is created */
+    uint8_t id;
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    /* syncs the thread with the main migration thread */
+    QemuSemaphore sem_sync;
+    /* this mutex protects the following parameters */
+    QemuMutex mutex;
+    /* has the thread been created */
+    bool running;
+    bool quit;
+    /* array of pages to receive */
+    MultiFDPages_t *pages;
+    /* size of the packet, including the page offsets */
+    uint32_t packet_len;
+    MultiFDPacket_t *packet;
+    /* multifd flags of the last packet */
+    uint32_t flags;
+    /* global number of the last packet */
+    uint64_t packet_num;
+    /* thread local variables */
+    /* packets received through this channel */
+    uint64_t num_packets;
+    /* pages received through this channel */
+    uint64_t num_pages;
+};
+typedef struct MultiFDRecvParams MultiFDRecvParams;
+
+static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDInit_t msg;
+    int ret;
+
+    msg.magic = cpu_to_be32(MULTIFD_MAGIC);
+    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.id = p->id;
+    memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
+
+    ret = qio_channel_write_all(p->c, (char *)&msg, sizeof(msg), errp);
+    if (ret != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
+{
+    MultiFDInit_t msg;
+    int ret;
+
+    ret = qio_channel_read_all(c, (char *)&msg, sizeof(msg), errp);
+    if (ret != 0) {
+        return -1;
+    }
+
+    be32_to_cpus(&msg.magic);
+    be32_to_cpus(&msg.version);
+
+    if (msg.magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", msg.magic, MULTIFD_MAGIC);
+        return -1;
+    }
+
+    if (msg.version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d "
+                   "expected %d", msg.version, MULTIFD_VERSION);
+        return -1;
+    }
+
+    if (memcmp(msg.uuid, &qemu_uuid, sizeof(qemu_uuid))) {
+        char *uuid = qemu_uuid_unparse_strdup(&qemu_uuid);
+        char *msg_uuid = qemu_uuid_unparse_strdup((const QemuUUID *)msg.uuid);
+
+        error_setg(errp, "multifd: received uuid '%s' and expected "
+                   "uuid '%s' for channel %hhd", msg_uuid, uuid, msg.id);
+        g_free(uuid);
+        g_free(msg_uuid);
+        return -1;
+    }
+
+    if (msg.id >= migrate_multifd_channels()) {
+        error_setg(errp, "multifd: received channel id %d but only "
+                   "%d channels are configured", msg.id,
+                   migrate_multifd_channels());
+        return -1;
+    }
+
+    return msg.id;
+}
+
+static MultiFDPages_t *multifd_pages_init(size_t size)
+{
+    MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
+
+    pages->allocated = size;
+    pages->iov = g_new0(struct iovec, size);
+    pages->offset = g_new0(ram_addr_t, size);
+
+    return pages;
+}
+
+static void multifd_pages_clear(MultiFDPages_t *pages)
+{
+    pages->used = 0;
+    pages->allocated = 0;
+    pages->block = NULL;
+    g_free(pages->iov);
+    pages->iov = NULL;
+    g_free(pages->offset);
+    pages->offset = NULL;
+    g_free(pages);
+}
+
+static void multifd_send_fill_packet(MultiFDSendParams *p)
+{
+    MultiFDPacket_t *packet = p->packet;
+    int i;
+
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(p->flags);
+    packet->size = cpu_to_be32(p->pages->allocated);
+    packet->used = cpu_to_be32(p->pages->used);
+    packet->packet_num = cpu_to_be64(p->packet_num);
+
+    if (p->pages->block) {
+        strncpy(packet->ramblock, p->pages->block->idstr,
+                sizeof(packet->ramblock));
+    }
+
+    for (i = 0; i < p->pages->used; i++) {
+        packet->offset[i] = cpu_to_be64(p->pages->offset[i]);
+    }
+}
+
+/*
+ * Called with rcu_read_lock() held, the RAMBlock found here is only
+ * used to compute the host addresses of the pages.
+ */
+static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    RAMBlock *block = NULL;
+    int i;
+
+    be32_to_cpus(&packet->magic);
+    if (packet->magic != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x "
+                   "expected %x", packet->magic, MULTIFD_MAGIC);
+        return -1;
+    }
+
+    be32_to_cpus(&packet->version);
+    if (packet->version != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %d "
+                   "expected %d", packet->version, MULTIFD_VERSION);
+        return -1;
+    }
+
+    p->flags = be32_to_cpu(packet->flags);
+
+    be32_to_cpus(&packet->size);
+    if (packet->size > p->pages->allocated) {
+        error_setg(errp, "multifd: received packet with %d pages "
+                   "but x-multifd-page-count is %d",
+                   packet->size, p->pages->allocated);
+        return -1;
+    }
+
+    p->pages->used = be32_to_cpu(packet->used);
+    if (p->pages->used > packet->size) {
+        error_setg(errp, "multifd: received packet uses %d pages "
+                   "of a maximum of %d", p->pages->used, packet->size);
+        return -1;
+    }
+
+    p->packet_num = be64_to_cpu(packet->packet_num);
+
+    if (p->pages->used) {
+        /* make sure that ramblock is 0 terminated */
+        packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+        block = qemu_ram_block_by_name(packet->ramblock);
+        if (!block) {
+            error_setg(errp, "multifd: unknown ram block %s",
+                       packet->ramblock);
+            return -1;
+        }
+    }
+    p->pages->block = block;
+
+    for (i = 0; i < p->pages->used; i++) {
+        ram_addr_t offset = be64_to_cpu(packet->offset[i]);
+
+        if (offset & ~TARGET_PAGE_MASK ||
+            offset > (block->used_length - TARGET_PAGE_SIZE)) {
+            error_setg(errp, "multifd: offset " RAM_ADDR_FMT " outside "
+                       "block %s of length " RAM_ADDR_FMT, offset,
+                       block->idstr, block->used_length);
+            return -1;
+        }
+        p->pages->offset[i] = offset;
+        p->pages->iov[i].iov_base = block->host + offset;
+        p->pages->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static struct {
     MultiFDSendParams *params;
-    /* number of created threads */
+    /* number of channels */
     int count;
+    /* array of pages to be sent by the next packet */
+    MultiFDPages_t *pages;
+    /* syncs main thread and channels */
+    QemuSemaphore sem_sync;
+    /* global number of generated multifd packets */
+    uint64_t packet_num;
+    /* posted each time a channel becomes idle */
+    QemuSemaphore channels_ready;
+    /* set once the channels are being torn down because of an error */
+    int exiting;
 } *multifd_send_state;
 
-static void terminate_multifd_send_threads(Error *errp)
+static void multifd_send_terminate_threads(Error *err)
 {
     int i;
 
+    if (err) {
+        MigrationState *s = migrate_get_current();
+        migrate_set_error(s, err);
+        if (s->state == MIGRATION_STATUS_SETUP ||
+            s->state == MIGRATION_STATUS_PRE_SWITCHOVER ||
+            s->state == MIGRATION_STATUS_DEVICE ||
+            s->state == MIGRATION_STATUS_ACTIVE) {
+            migrate_set_state(&s->state, s->state,
+                              MIGRATION_STATUS_FAILED);
+        }
+    }
+
+    /* We only need to tear the channels down once */
+    if (atomic_xchg(&multifd_send_state->exiting, 1)) {
+        return;
+    }
+
     for (i = 0; i < multifd_send_state->count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
         qemu_mutex_lock(&p->mutex);
         p->quit = true;
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
         qemu_sem_post(&p->sem);
         qemu_mutex_unlock(&p->mutex);
     }
+
+    /* Wake up the migration thread if it is waiting for a channel */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+    qemu_sem_post(&multifd_send_state->sem_sync);
 }
 
 int multifd_save_cleanup(Error **errp)
@@ -426,99 +956,414 @@ int multifd_save_cleanup(Error **errp)
     int i;
     int ret = 0;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_send_state) {
         return 0;
     }
-    terminate_multifd_send_threads(NULL);
+    multifd_send_terminate_threads(NULL);
     for (i = 0; i < multifd_send_state->count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
 
-        qemu_thread_join(&p->thread);
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->c) {
+            socket_send_channel_destroy(p->c);
+            p->c = NULL;
+        }
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
         g_free(p->name);
         p->name = NULL;
+        multifd_pages_clear(p->pages);
+        p->pages = NULL;
+        p->packet_len = 0;
+        g_free(p->packet);
+        p->packet = NULL;
     }
+    qemu_sem_destroy(&multifd_send_state->sem_sync);
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
+    multifd_pages_clear(multifd_send_state->pages);
+    multifd_send_state->pages = NULL;
     g_free(multifd_send_state);
     multifd_send_state = NULL;
     return ret;
 }
 
-static void *multifd_send_thread(void *opaque)
+/**
+ * multifd_send_pages: hand the queued pages over to a channel
+ *
+ * Channels are picked round-robin among the idle ones.  The queued
+ * page array is swapped with the (empty) array of the chosen channel,
+ * so the pages are never copied.
+ *
+ * Returns 1 on success or -1 if the channels are being torn down
+ *
+ * @rs: current RAM state
+ */
+static int multifd_send_pages(RAMState *rs)
 {
-    MultiFDSendParams *p = opaque;
+    int i;
+    static int next_channel;
+    MultiFDSendParams *p = NULL;
+    MultiFDPages_t *pages = multifd_send_state->pages;
+    uint64_t transferred;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_read(&multifd_send_state->exiting)) {
+        return -1;
+    }
+    for (i = next_channel % multifd_send_state->count;;
+         i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
 
-    while (true) {
         qemu_mutex_lock(&p->mutex);
         if (p->quit) {
+            error_report("%s: channel %d has already quit!", __func__, i);
             qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        if (!p->pending_job) {
+            p->pending_job++;
+            next_channel = (i + 1) % multifd_send_state->count;
             break;
         }
         qemu_mutex_unlock(&p->mutex);
-        qemu_sem_wait(&p->sem);
     }
+    p->pages->used = 0;
+    p->pages->block = NULL;
+    p->packet_num = multifd_send_state->packet_num++;
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
+    p->iteration_transferred += transferred;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
 
-    return NULL;
+    /*
+     * Account the channel traffic on the main stream, both for rate
+     * limiting and for the bandwidth estimation.
+     */
+    qemu_file_update_transfer(rs->f, transferred);
+    qemu_update_position(rs->f, transferred);
+    ram_counters.transferred += transferred;
+
+    return 1;
 }
 
-int multifd_save_setup(void)
+/**
+ * multifd_queue_page: queue a page to be sent through the channels
+ *
+ * Returns 1 on success or -1 on error
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int multifd_queue_page(RAMState *rs, RAMBlock *block,
+                              ram_addr_t offset)
 {
-    int thread_count;
-    uint8_t i;
+    MultiFDPages_t *pages = multifd_send_state->pages;
 
-    if (!migrate_use_multifd()) {
-        return 0;
+    if (!pages->block) {
+        pages->block = block;
     }
-    thread_count = migrate_multifd_channels();
-    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
-    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
-    multifd_send_state->count = 0;
-    for (i = 0; i < thread_count; i++) {
-        MultiFDSendParams *p = &multifd_send_state->params[i];
 
-        qemu_mutex_init(&p->mutex);
-        qemu_sem_init(&p->sem, 0);
-        p->quit = false;
-        p->id = i;
-        p->name = g_strdup_printf("multifdsend_%d", i);
-        qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
-                           QEMU_THREAD_JOINABLE);
+    if (pages->block == block) {
+        pages->offset[pages->used] = offset;
+        pages->iov[pages->used].iov_base = block->host + offset;
+        pages->iov[pages->used].iov_len = TARGET_PAGE_SIZE;
+        pages->used++;
+
+        if (pages->used < pages->allocated) {
+            return 1;
+        }
+        return multifd_send_pages(rs);
+    }
 
-        multifd_send_state->count++;
+    /* A packet only carries pages of one RAMBlock, flush and start over */
+    if (multifd_send_pages(rs) < 0) {
+        return -1;
     }
-    return 0;
+    return multifd_queue_page(rs, block, offset);
 }
 
-struct MultiFDRecvParams {
-    uint8_t id;
-    char *name;
-    QemuThread thread;
-    QemuSemaphore sem;
-    QemuMutex mutex;
-    bool quit;
-};
-typedef struct MultiFDRecvParams MultiFDRecvParams;
+/**
+ * multifd_send_sync_main: flush all channels
+ *
+ * Sends the pending pages and a packet with MULTIFD_FLAG_SYNC through
+ * every channel and waits until all of them have been written.  Once
+ * the destination has seen the sync packet on every channel it knows
+ * that all pages sent before are in place.
+ *
+ * Returns 0 on success or -1 on error
+ *
+ * @rs: current RAM state
+ */
+static int multifd_send_sync_main(RAMState *rs)
+{
+    int i;
+
+    if (multifd_send_state->pages->used) {
+        if (multifd_send_pages(rs) < 0) {
+            return -1;
+        }
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        trace_multifd_send_sync_main_signal(p->id);
+
+        qemu_mutex_lock(&p->mutex);
+        if (p->quit) {
+            error_report("%s: channel %d has already quit", __func__, i);
+            qemu_mutex_unlock(&p->mutex);
+            return -1;
+        }
+        p->packet_num = multifd_send_state->packet_num++;
+        p->flags |= MULTIFD_FLAG_SYNC;
+        p->pending_job++;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        trace_multifd_send_sync_main_wait(i);
+        qemu_sem_wait(&multifd_send_state->sem_sync);
+        if (atomic_read(&multifd_send_state->exiting)) {
+            return -1;
+        }
+    }
+    trace_multifd_send_sync_main(multifd_send_state->packet_num);
+
+    return 0;
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+    int ret;
+
+    trace_multifd_send_thread_start(p->id);
+
+    if (multifd_send_initial_packet(p, &local_err) < 0) {
+        goto out;
+    }
+    /* initial packet */
+    p->num_packets = 1;
+
+    while (true) {
+        qemu_sem_post(&multifd_send_state->channels_ready);
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+
+        if (p->pending_job) {
+            uint32_t used = p->pages->used;
+            uint64_t packet_num = p->packet_num;
+            uint32_t flags = p->flags;
+
+            multifd_send_fill_packet(p);
+            p->flags = 0;
+            p->num_packets++;
+            p->num_pages += used;
+            p->pages->used = 0;
+            qemu_mutex_unlock(&p->mutex);
+
+            trace_multifd_send(p->id, packet_num, used, flags);
+
+            ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                        p->packet_len, &local_err);
+            if (ret != 0) {
+                break;
+            }
+
+            if (used) {
+                ret = qio_channel_writev_all_flags(p->c, p->pages->iov,
+                                                   used, p->write_flags,
+                                                   &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
+
+            /*
+             * Zero copy pages are still read by the kernel after the
+             * write returns.  The round must not end before they are
+             * on the wire, or a page dirtied again could have its
+             * new contents overtaken on another channel by the old.
+             */
+            if ((flags & MULTIFD_FLAG_SYNC) && p->write_flags) {
+                ret = qio_channel_flush(p->c, &local_err);
+                if (ret < 0) {
+                    break;
+                }
+                trace_multifd_send_flush(p->id, ret);
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->pending_job--;
+            qemu_mutex_unlock(&p->mutex);
+
+            if (flags & MULTIFD_FLAG_SYNC) {
+                qemu_sem_post(&multifd_send_state->sem_sync);
+            }
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+            /* sometimes there are spurious wakeups */
+        }
+    }
+
+out:
+    if (local_err) {
+        bool quit;
+
+        /* Errors are expected once the channels are being shut down */
+        qemu_mutex_lock(&p->mutex);
+        quit = p->quit;
+        qemu_mutex_unlock(&p->mutex);
+        if (!quit) {
+            multifd_send_terminate_threads(local_err);
+        }
+        error_free(local_err);
+    }
+
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+
+    return NULL;
+}
+
+static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
+{
+    QIOChannel *sioc = QIO_CHANNEL(qio_task_get_source(task));
+    int id = GPOINTER_TO_INT(opaque);
+    MultiFDSendParams *p;
+    Error *local_err = NULL;
+
+    /*
+     * The channel is connected from the main loop, the migration may
+     * have been cancelled (and cleaned up) in the meantime.
+     */
+    if (!multifd_send_state || id >= multifd_send_state->count ||
+        multifd_send_state->params[id].c) {
+        object_unref(OBJECT(sioc));
+        return;
+    }
+    p = &multifd_send_state->params[id];
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        object_unref(OBJECT(sioc));
+        multifd_send_terminate_threads(local_err);
+        error_free(local_err);
+        return;
+    }
+
+    if (migrate_use_zero_copy_send()) {
+        if (!qio_channel_has_feature(sioc,
+                                     QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+            object_unref(OBJECT(sioc));
+            error_setg(&local_err, "multifd channel %d does not support "
+                       "zero copy send", id);
+            multifd_send_terminate_threads(local_err);
+            error_free(local_err);
+            return;
+        }
+        p->write_flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+    }
+
+    qio_channel_set_name(sioc, p->name);
+    qemu_mutex_lock(&p->mutex);
+    p->c = sioc;
+    if (p->quit) {
+        qemu_mutex_unlock(&p->mutex);
+        return;
+    }
+    p->running = true;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                       QEMU_THREAD_JOINABLE);
+}
+
+int multifd_save_setup(void)
+{
+    int thread_count;
+    uint32_t page_count = migrate_multifd_page_count();
+    uint8_t i;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    thread_count = migrate_multifd_channels();
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->count = thread_count;
+    multifd_send_state->pages = multifd_pages_init(page_count);
+    qemu_sem_init(&multifd_send_state->sem_sync, 0);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
 
-struct {
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->quit = false;
+        p->pending_job = 0;
+        p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet_len = sizeof(MultiFDPacket_t)
+                      + sizeof(uint64_t) * page_count;
+        p->packet = g_malloc0(p->packet_len);
+        p->name = g_strdup_printf("multifdsend_%d", i);
+        socket_send_channel_create(multifd_new_send_channel_async,
+                                   GINT_TO_POINTER(i));
+    }
+    return 0;
+}
+
+static struct {
     MultiFDRecvParams *params;
-    /* number of created threads */
+    /* number of channels */
     int count;
+    /* number of channels that are already connected */
+    int connected;
+    /* syncs main thread and channels */
+    QemuSemaphore sem_sync;
+    /* global number of generated multifd packets */
+    uint64_t packet_num;
+    /* set once the channels are being torn down */
+    int exiting;
 } *multifd_recv_state;
 
-static void terminate_multifd_recv_threads(Error *errp)
+static void multifd_recv_terminate_threads(Error *err)
 {
     int i;
 
+    if (err) {
+        error_report("%s", error_get_pretty(err));
+    }
+
+    if (atomic_xchg(&multifd_recv_state->exiting, 1)) {
+        return;
+    }
+
     for (i = 0; i < multifd_recv_state->count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
         qemu_mutex_lock(&p->mutex);
         p->quit = true;
-        qemu_sem_post(&p->sem);
+        if (p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+        /* In case the thread is waiting for the main thread */
+        qemu_sem_post(&p->sem_sync);
         qemu_mutex_unlock(&p->mutex);
     }
+
+    /* Wake up the main thread if it is waiting for a sync */
+    qemu_sem_post(&multifd_recv_state->sem_sync);
 }
 
 int multifd_load_cleanup(Error **errp)
@@ -526,19 +1371,31 @@ int multifd_load_cleanup(Error **errp)
     int i;
     int ret = 0;
 
-    if (!migrate_use_multifd()) {
+    if (!multifd_recv_state) {
         return 0;
     }
-    terminate_multifd_recv_threads(NULL);
+    multifd_recv_terminate_threads(NULL);
     for (i = 0; i < multifd_recv_state->count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
-        qemu_thread_join(&p->thread);
+        if (p->running) {
+            qemu_thread_join(&p->thread);
+        }
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+            p->c = NULL;
+        }
         qemu_mutex_destroy(&p->mutex);
-        qemu_sem_destroy(&p->sem);
+        qemu_sem_destroy(&p->sem_sync);
         g_free(p->name);
         p->name = NULL;
+        multifd_pages_clear(p->pages);
+        p->pages = NULL;
+        p->packet_len = 0;
+        g_free(p->packet);
+        p->packet = NULL;
     }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -547,26 +1404,118 @@ int multifd_load_cleanup(Error **errp)
     return ret;
 }
 
+/**
+ * multifd_recv_sync_main: wait for all channels to reach a sync point
+ *
+ * Returns 0 on success or -1 if the channels are being torn down
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        trace_multifd_recv_sync_main_wait(i);
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+        if (atomic_read(&multifd_recv_state->exiting)) {
+            return -1;
+        }
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (multifd_recv_state->packet_num < p->packet_num) {
+            multifd_recv_state->packet_num = p->packet_num;
+        }
+        qemu_mutex_unlock(&p->mutex);
+        trace_multifd_recv_sync_main_signal(p->id);
+        qemu_sem_post(&p->sem_sync);
+    }
+    trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
+
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    int ret;
+
+    trace_multifd_recv_thread_start(p->id);
+    rcu_register_thread();
 
     while (true) {
+        uint32_t used;
+        uint32_t flags;
+        int i;
+
+        ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
+                                       p->packet_len, &local_err);
+        if (ret == 0) {   /* EOF */
+            break;
+        }
+        if (ret == -1) {   /* Error */
+            break;
+        }
+
         qemu_mutex_lock(&p->mutex);
-        if (p->quit) {
+        rcu_read_lock();
+        ret = multifd_recv_unfill_packet(p, &local_err);
+        rcu_read_unlock();
+        if (ret) {
             qemu_mutex_unlock(&p->mutex);
             break;
         }
+
+        used = p->pages->used;
+        flags = p->flags;
+        trace_multifd_recv(p->id, p->packet_num, used, flags);
+        p->num_packets++;
+        p->num_pages += used;
+        qemu_mutex_unlock(&p->mutex);
+
+        if (used) {
+            ret = qio_channel_readv_all(p->c, p->pages->iov, used,
+                                        &local_err);
+            if (ret != 0) {
+                break;
+            }
+            for (i = 0; i < used; i++) {
+                ramblock_recv_bitmap_set(p->pages->block,
+                                         p->pages->iov[i].iov_base);
+            }
+        }
+
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+    if (local_err) {
+        bool quit;
+
+        /* Errors are expected once the channels are being shut down */
+        qemu_mutex_lock(&p->mutex);
+        quit = p->quit;
         qemu_mutex_unlock(&p->mutex);
-        qemu_sem_wait(&p->sem);
+        if (!quit) {
+            multifd_recv_terminate_threads(local_err);
+        }
+        error_free(local_err);
     }
 
+    rcu_unregister_thread();
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+
     return NULL;
 }
 
 int multifd_load_setup(void)
 {
     int thread_count;
+    uint32_t page_count = migrate_multifd_page_count();
     uint8_t i;
 
     if (!migrate_use_multifd()) {
@@ -575,22 +1524,81 @@ int multifd_load_setup(void)
     thread_count = migrate_multifd_channels();
     multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
-    multifd_recv_state->count = 0;
+    multifd_recv_state->count = thread_count;
+    atomic_set(&multifd_recv_state->connected, 0);
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+
     for (i = 0; i < thread_count; i++) {
         MultiFDRecvParams *p = &multifd_recv_state->params[i];
 
         qemu_mutex_init(&p->mutex);
-        qemu_sem_init(&p->sem, 0);
+        qemu_sem_init(&p->sem_sync, 0);
         p->quit = false;
         p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet_len = sizeof(MultiFDPacket_t)
+                      + sizeof(uint64_t) * page_count;
+        p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
-        qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
-                           QEMU_THREAD_JOINABLE);
-        multifd_recv_state->count++;
     }
     return 0;
 }
 
+bool multifd_recv_all_channels_created(void)
+{
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+    if (!multifd_recv_state) {
+        return false;
+    }
+
+    return atomic_read(&multifd_recv_state->connected) ==
+           multifd_recv_state->count;
+}
+
+/**
+ * multifd_recv_new_channel: start the thread of a new multifd channel
+ *
+ * Returns true when all the channels are connected
+ *
+ * @ioc: the channel that has just been accepted
+ */
+bool multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvParams *p;
+    Error *local_err = NULL;
+    int id;
+
+    id = multifd_recv_initial_packet(ioc, &local_err);
+    if (id < 0) {
+        multifd_recv_terminate_threads(local_err);
+        error_free(local_err);
+        return false;
+    }
+
+    p = &multifd_recv_state->params[id];
+    if (p->c != NULL) {
+        error_setg(&local_err, "multifd: received id '%d' already setup",
+                   id);
+        multifd_recv_terminate_threads(local_err);
+        error_free(local_err);
+        return false;
+    }
+    p->c = ioc;
+    object_ref(OBJECT(ioc));
+    qio_channel_set_name(ioc, p->name);
+    /* initial packet */
+    p->num_packets = 1;
+
+    p->running = true;
+    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+    atomic_inc(&multifd_recv_state->connected);
+    return atomic_read(&multifd_recv_state->connected) ==
+           multifd_recv_state->count;
+}
+
 /**
  * save_page_header: write page header to wire
  *
@@ -648,6 +1656,109 @@ static void mig_throttle_guest_down(void)
     }
 }
 
+typedef struct {
+    CPUState *cpu;
+    /* bytes per second the vcpu would dirty if it was not throttled */
+    uint64_t rate;
+} VCPUDirtyRate;
+
+static int vcpu_dirty_rate_cmp(const void *a, const void *b)
+{
+    const VCPUDirtyRate *ra = a, *rb = b;
+
+    return ra->rate < rb->rate ? 1 : ra->rate > rb->rate ? -1 : 0;
+}
+
+/**
+ * mig_throttle_guest_down_per_vcpu: throttle the vcpus that dirty memory
+ *
+ * The remaining dirty memory must be sent within the downtime limit once
+ * the next pass is over.  That pass takes about remaining / bandwidth, so
+ * the guest may dirty at most bandwidth^2 * downtime / remaining bytes per
+ * second.  The guest dirty rate is split among the vcpus according to the
+ * pages each of them dirtied, and the heaviest writers are throttled first
+ * until the target is met.
+ *
+ * Returns false if no vcpu reported dirty pages.  Only TCG reports them,
+ * migration refuses to start per-vcpu throttling with other accelerators.
+ *
+ * @rs: current RAM state
+ * @period_ms: length of the period the counters cover
+ * @bytes_xfer: bytes transferred during the period
+ */
+static bool mig_throttle_guest_down_per_vcpu(RAMState *rs, int64_t period_ms,
+                                             uint64_t bytes_xfer)
+{
+    MigrationState *s = migrate_get_current();
+    VCPUDirtyRate *rates;
+    CPUState *cpu;
+    uint64_t bandwidth, remaining, dirty_rate, target_rate, total = 0;
+    uint64_t vcpu_pages = 0, excess;
+    int i, n = 0, nr_cpus = 0;
+
+    CPU_FOREACH(cpu) {
+        nr_cpus++;
+    }
+    rates = g_new0(VCPUDirtyRate, nr_cpus);
+    CPU_FOREACH(cpu) {
+        rates[n].cpu = cpu;
+        rates[n].rate = atomic_xchg(&cpu->dirty_pages, 0);
+        vcpu_pages += rates[n].rate;
+        n++;
+    }
+    if (!vcpu_pages) {
+        for (i = 0; i < n; i++) {
+            atomic_set(&rates[i].cpu->dirty_rate, 0);
+        }
+        g_free(rates);
+        return false;
+    }
+
+    bandwidth = bytes_xfer * 1000 / period_ms;
+    remaining = MAX(rs->migration_dirty_pages * TARGET_PAGE_SIZE, 1);
+    dirty_rate = rs->num_dirty_pages_period * TARGET_PAGE_SIZE * 1000 /
+                 period_ms;
+    target_rate = (double)bandwidth * bandwidth * s->parameters.downtime_limit /
+                  1000 / remaining;
+
+    /* Share the guest dirty rate and undo the current throttling */
+    for (i = 0; i < n; i++) {
+        int pct = cpu_throttle_get_vcpu_percentage(rates[i].cpu);
+
+        rates[i].rate = (double)dirty_rate * rates[i].rate / vcpu_pages /
+                        (1 - pct / 100.0);
+        atomic_set(&rates[i].cpu->dirty_rate, MIN(rates[i].rate, ULONG_MAX));
+        total += rates[i].rate;
+    }
+    qsort(rates, n, sizeof(*rates), vcpu_dirty_rate_cmp);
+
+    excess = total > target_rate ? total - target_rate : 0;
+    for (i = 0; i < n; i++) {
+        int pct = 0;
+
+        if (excess && rates[i].rate) {
+            pct = DIV_ROUND_UP(excess * 100, rates[i].rate);
+            pct = MIN(pct, 100);
+            excess -= MIN(excess, rates[i].rate * pct / 100);
+        }
+        trace_migration_throttle_vcpu(rates[i].cpu->cpu_index, rates[i].rate,
+                                      pct);
+        cpu_throttle_set_vcpu(rates[i].cpu, pct);
+    }
+
+    g_free(rates);
+    return true;
+}
+
+static void mig_throttle_reset_vcpu_dirty_pages(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->dirty_pages, 0);
+    }
+}
+
 /**
  * xbzrle_cache_zero_page: insert a zero page in the XBZRLE cache
  *
@@ -668,8 +1779,11 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(atomic_rcu_read(&XBZRLE.cache), current_addr,
+                     XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) == 1) {
+        xbzrle_counters.cache_eviction++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -692,32 +1806,42 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
                             ram_addr_t current_addr, RAMBlock *block,
                             ram_addr_t offset, bool last_stage)
 {
+    PageCache *cache = atomic_rcu_read(&XBZRLE.cache);
     int encoded_len = 0, bytes_xbzrle;
-    uint8_t *prev_cached_page;
+    int ret;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr,
-                         ram_counters.dirty_sync_count)) {
+    /* The cache is only locked set by set, so work on private copies of
+     * both the cached and the current page.  What is sent and what ends
+     * up in the cache are then the same even if the guest or another
+     * insert changes either of them meanwhile.
+     */
+    if (!cache_get_data(cache, current_addr, XBZRLE.prev_buf,
+                        ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
+            ret = cache_insert(cache, current_addr, XBZRLE.current_buf,
+                               ram_counters.dirty_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
-                /* update *current_data when the page has been
-                   inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
+                if (ret == 1) {
+                    xbzrle_counters.cache_eviction++;
+                }
+                /* send the data that was inserted into cache */
+                *current_data = XBZRLE.current_buf;
             }
         }
         return -1;
     }
 
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    xbzrle_counters.cache_hit++;
 
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
 
     /* XBZRLE encoding (if there is no overflow) */
-    encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
+    encoded_len = xbzrle_encode_buffer(XBZRLE.prev_buf, XBZRLE.current_buf,
                                        TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
                                        TARGET_PAGE_SIZE);
     if (encoded_len == 0) {
@@ -728,15 +1852,21 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
         xbzrle_counters.overflow++;
         /* update data in the cache */
         if (!last_stage) {
-            memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
-            *current_data = prev_cached_page;
+            if (cache_insert(cache, current_addr, XBZRLE.current_buf,
+                             ram_counters.dirty_sync_count) == 1) {
+                xbzrle_counters.cache_eviction++;
+            }
+            *current_data = XBZRLE.current_buf;
         }
         return -1;
     }
 
     /* we need to update the data in the cache, in order to get the same data */
     if (!last_stage) {
-        memcpy(prev_cached_page, XBZRLE.current_buf, TARGET_PAGE_SIZE);
+        if (cache_insert(cache, current_addr, XBZRLE.current_buf,
+                         ram_counters.dirty_sync_count) == 1) {
+            xbzrle_counters.cache_eviction++;
+        }
     }
 
     /* Send XBZRLE based compressed page */
@@ -795,59 +1925,591 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
     return ret;
 }
 
-static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
-                                        ram_addr_t start, ram_addr_t length)
-{
-    rs->migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(rb, start, length,
-                                              &rs->num_dirty_pages_period);
+static void migration_bitmap_sync_range(RAMState *rs, RAMBlock *rb,
+                                        ram_addr_t start, ram_addr_t length)
+{
+    rs->migration_dirty_pages +=
+        cpu_physical_memory_sync_dirty_bitmap(rb, start, length,
+                                              &rs->num_dirty_pages_period);
+}
+
+/* Dirty bitmap sync threads */
+
+/* Pages of a RAMBlock synced in one go by a thread (1GiB of 4KiB pages) */
+#define BITMAP_SYNC_CHUNK_PAGES (1UL << 18)
+
+typedef struct {
+    QemuThread thread;
+    QemuSemaphore sem;
+    bool quit;
+    /* pages newly dirty in rb->bmap, and pages dirtied by the guest */
+    uint64_t num_dirty;
+    uint64_t num_dirty_period;
+} BitmapSyncParams;
+
+static struct {
+    BitmapSyncParams *params;
+    int count;
+    /* block being synced; chunks are picked in order by all threads */
+    RAMBlock *block;
+    unsigned long nr_chunks;
+    unsigned long next_chunk;
+    /* posted by each thread when it runs out of chunks */
+    QemuSemaphore sem_done;
+} *bitmap_sync_state;
+
+static void bitmap_sync_chunks(uint64_t *num_dirty, uint64_t *num_dirty_period)
+{
+    RAMBlock *rb = bitmap_sync_state->block;
+    unsigned long chunk;
+    ram_addr_t start, length;
+
+    while ((chunk = atomic_fetch_inc(&bitmap_sync_state->next_chunk)) <
+           bitmap_sync_state->nr_chunks) {
+        start = (ram_addr_t)chunk * BITMAP_SYNC_CHUNK_PAGES << TARGET_PAGE_BITS;
+        length = MIN(rb->used_length - start,
+                     BITMAP_SYNC_CHUNK_PAGES << TARGET_PAGE_BITS);
+        *num_dirty += cpu_physical_memory_sync_dirty_bitmap(rb, start, length,
+                                                            num_dirty_period);
+    }
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncParams *p = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        if (atomic_read(&p->quit)) {
+            break;
+        }
+        p->num_dirty = 0;
+        p->num_dirty_period = 0;
+        bitmap_sync_chunks(&p->num_dirty, &p->num_dirty_period);
+        qemu_sem_post(&bitmap_sync_state->sem_done);
+    }
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void bitmap_sync_threads_setup(void)
+{
+    int i, thread_count = migrate_bitmap_sync_threads();
+
+    if (!thread_count) {
+        return;
+    }
+    bitmap_sync_state = g_malloc0(sizeof(*bitmap_sync_state));
+    bitmap_sync_state->params = g_new0(BitmapSyncParams, thread_count);
+    bitmap_sync_state->count = thread_count;
+    qemu_sem_init(&bitmap_sync_state->sem_done, 0);
+    for (i = 0; i < thread_count; i++) {
+        BitmapSyncParams *p = &bitmap_sync_state->params[i];
+
+        qemu_sem_init(&p->sem, 0);
+        qemu_thread_create(&p->thread, "bitmapsync", bitmap_sync_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void bitmap_sync_threads_cleanup(void)
+{
+    int i;
+
+    if (!bitmap_sync_state) {
+        return;
+    }
+    for (i = 0; i < bitmap_sync_state->count; i++) {
+        BitmapSyncParams *p = &bitmap_sync_state->params[i];
+
+        atomic_set(&p->quit, true);
+        qemu_sem_post(&p->sem);
+        qemu_thread_join(&p->thread);
+        qemu_sem_destroy(&p->sem);
+    }
+    qemu_sem_destroy(&bitmap_sync_state->sem_done);
+    g_free(bitmap_sync_state->params);
+    g_free(bitmap_sync_state);
+    bitmap_sync_state = NULL;
+}
+
+/**
+ * migration_bitmap_sync_block: sync the dirty bitmap of a RAMBlock
+ *
+ * Blocks larger than one chunk are split into chunks that the sync
+ * threads and the calling thread pick in turn until none is left.
+ *
+ * Called with bitmap_mutex held, within an RCU critical section.
+ *
+ * @rs: current RAM state
+ * @rb: RAMBlock to sync
+ */
+static void migration_bitmap_sync_block(RAMState *rs, RAMBlock *rb)
+{
+    unsigned long pages = rb->used_length >> TARGET_PAGE_BITS;
+    uint64_t num_dirty = 0;
+    int i, n;
+
+    if (!bitmap_sync_state || pages <= BITMAP_SYNC_CHUNK_PAGES) {
+        migration_bitmap_sync_range(rs, rb, 0, rb->used_length);
+        return;
+    }
+
+    bitmap_sync_state->block = rb;
+    bitmap_sync_state->nr_chunks = DIV_ROUND_UP(pages,
+                                                BITMAP_SYNC_CHUNK_PAGES);
+    atomic_set(&bitmap_sync_state->next_chunk, 0);
+    n = MIN(bitmap_sync_state->count, bitmap_sync_state->nr_chunks - 1);
+    for (i = 0; i < n; i++) {
+        qemu_sem_post(&bitmap_sync_state->params[i].sem);
+    }
+
+    bitmap_sync_chunks(&num_dirty, &rs->num_dirty_pages_period);
+
+    for (i = 0; i < n; i++) {
+        qemu_sem_wait(&bitmap_sync_state->sem_done);
+    }
+    for (i = 0; i < n; i++) {
+        num_dirty += bitmap_sync_state->params[i].num_dirty;
+        rs->num_dirty_pages_period +=
+            bitmap_sync_state->params[i].num_dirty_period;
+    }
+    rs->migration_dirty_pages += num_dirty;
+}
+
+/* Zero page threads */
+
+/* Pages checked by a zero page thread in one go (2MiB of 4KiB pages) */
+#define ZERO_SCAN_CHUNK_PAGES 512
+
+static struct {
+    QemuThread *threads;
+    int count;
+    bool quit;
+} *zero_scan_state;
+
+static unsigned long zero_scan_nr_chunks(RAMBlock *rb)
+{
+    return DIV_ROUND_UP(rb->used_length >> TARGET_PAGE_BITS,
+                        ZERO_SCAN_CHUNK_PAGES);
+}
+
+/*
+ * Raise the next chunk the threads claim in @rb to @chunk, so that
+ * they do not scan pages the migration thread has already gone past.
+ */
+static void zero_scan_skip_to(RAMBlock *rb, unsigned long chunk)
+{
+    unsigned long next = atomic_read(&rb->zero_scan_next);
+    unsigned long old;
+
+    while (next < chunk) {
+        old = atomic_cmpxchg(&rb->zero_scan_next, next, chunk);
+        if (old == next) {
+            break;
+        }
+        next = old;
+    }
+}
+
+/* Called within an RCU critical section */
+static void zero_scan_chunk(RAMBlock *rb, unsigned long chunk)
+{
+    unsigned long page = chunk * ZERO_SCAN_CHUNK_PAGES;
+    unsigned long end = MIN(page + ZERO_SCAN_CHUNK_PAGES,
+                            rb->used_length >> TARGET_PAGE_BITS);
+
+    /* chunks are word aligned in zero_bmap, so set_bit() is enough */
+    for (; page < end; page++) {
+        if (is_zero_range(rb->host + (page << TARGET_PAGE_BITS),
+                          TARGET_PAGE_SIZE)) {
+            set_bit(page, rb->zero_bmap);
+        }
+    }
+    /* pairs with smp_rmb() in ram_save_zero_pages() */
+    smp_wmb();
+    set_bit_atomic(chunk, rb->zero_scanned);
+}
+
+/*
+ * Scan the next chunk of the first block that has some left.  The RCU
+ * critical section only covers one chunk, so that RAMBlocks can still
+ * be freed while the threads walk RAM; the block is looked up again
+ * from the head of the list every time.
+ *
+ * Returns false when no chunk is left.
+ */
+static bool zero_scan_next_chunk(void)
+{
+    RAMBlock *block;
+    unsigned long chunk;
+    bool found = false;
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        if (!block->zero_bmap ||
+            atomic_read(&block->zero_scan_next) >=
+            zero_scan_nr_chunks(block)) {
+            continue;
+        }
+        found = true;
+        chunk = atomic_fetch_inc(&block->zero_scan_next);
+        if (chunk < zero_scan_nr_chunks(block)) {
+            zero_scan_chunk(block, chunk);
+        }
+        break;
+    }
+    rcu_read_unlock();
+
+    return found;
+}
+
+static void *zero_scan_thread(void *opaque)
+{
+    rcu_register_thread();
+
+    while (!atomic_read(&zero_scan_state->quit) && zero_scan_next_chunk()) {
+        /* nothing */
+    }
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/**
+ * zero_scan_threads_setup: start looking for zero pages
+ *
+ * The threads walk RAM once, in the order the migration thread sends
+ * it, and record the zero pages in each block's zero_bmap.  Only the
+ * first pass over RAM uses them: the check is made after the dirty log
+ * is started, so a page written after it was found zero is dirty again
+ * and sent in a later pass.
+ *
+ * @rs: current RAM state
+ */
+static void zero_scan_threads_setup(RAMState *rs)
+{
+    int i, thread_count = migrate_zero_page_threads();
+
+    if (!thread_count) {
+        return;
+    }
+    zero_scan_state = g_malloc0(sizeof(*zero_scan_state));
+    zero_scan_state->threads = g_new0(QemuThread, thread_count);
+    zero_scan_state->count = thread_count;
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_create(&zero_scan_state->threads[i], "zeropage",
+                           zero_scan_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+    rs->zero_scan_active = true;
+}
+
+/**
+ * zero_scan_stop: stop using the zero page threads
+ *
+ * Called when the first pass over RAM is over, or when a bitmap sync
+ * may have set again the dirty bit of pages that were found zero
+ * before the guest wrote to them.
+ *
+ * @rs: current RAM state
+ */
+static void zero_scan_stop(RAMState *rs)
+{
+    if (zero_scan_state) {
+        atomic_set(&zero_scan_state->quit, true);
+    }
+    if (rs->zero_scan_active) {
+        trace_zero_scan_stop(ram_counters.zero_scan_pages);
+    }
+    rs->zero_scan_active = false;
+    rs->zero_scan_block = NULL;
+}
+
+static void zero_scan_threads_cleanup(void)
+{
+    int i;
+
+    if (!zero_scan_state) {
+        return;
+    }
+    atomic_set(&zero_scan_state->quit, true);
+    for (i = 0; i < zero_scan_state->count; i++) {
+        qemu_thread_join(&zero_scan_state->threads[i]);
+    }
+    g_free(zero_scan_state->threads);
+    g_free(zero_scan_state);
+    zero_scan_state = NULL;
+}
+
+/**
+ * ram_pagesize_summary: calculate all the pagesizes of a VM
+ *
+ * Returns a summary bitmap of the page sizes of all RAMBlocks
+ *
+ * For VMs with just normal pages this is equivalent to the host page
+ * size. If it's got some huge pages then it's the OR of all the
+ * different page sizes.
+ */
+uint64_t ram_pagesize_summary(void)
+{
+    RAMBlock *block;
+    uint64_t summary = 0;
+
+    RAMBLOCK_FOREACH(block) {
+        summary |= block->page_size;
+    }
+
+    return summary;
+}
+
+/* Per iteration statistics */
+
+/* Number of iterations kept for query-migrate */
+#define RAM_ITERATION_HISTORY 32
+
+/*
+ * Statistics of the last iterations.  They outlive RAMState so that
+ * query-migrate still reports them once migration has completed.
+ * Protected by the iothread lock.
+ */
+static struct {
+    MigrationIterationStats *entries[RAM_ITERATION_HISTORY];
+    /* number of iterations recorded since migration started */
+    uint64_t count;
+} ram_iterations;
+
+static void ram_iteration_counters_get(RAMState *rs, RAMIterationCounters *c)
+{
+    c->transferred = ram_counters.transferred;
+    c->duplicate = ram_counters.duplicate;
+    c->normal = ram_counters.normal;
+    c->xbzrle_pages = xbzrle_counters.pages;
+    c->compress_pages = rs->compress_pages;
+    c->multifd_pages = rs->multifd_pages;
+}
+
+static void ram_iterations_reset(void)
+{
+    int i;
+
+    for (i = 0; i < RAM_ITERATION_HISTORY; i++) {
+        qapi_free_MigrationIterationStats(ram_iterations.entries[i]);
+        ram_iterations.entries[i] = NULL;
+    }
+    ram_iterations.count = 0;
+}
+
+static void ram_iteration_start(RAMState *rs, int64_t sync_time)
+{
+    int i;
+
+    rs->iteration_start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    rs->iteration_sync_time = sync_time;
+    rs->iteration_dirty_pages = rs->migration_dirty_pages;
+    ram_iteration_counters_get(rs, &rs->iteration_start);
+    if (multifd_send_state) {
+        for (i = 0; i < multifd_send_state->count; i++) {
+            multifd_send_state->params[i].iteration_transferred = 0;
+        }
+    }
+}
+
+/**
+ * ram_iteration_end: record the statistics of the iteration that ended
+ *
+ * An iteration runs from one bitmap sync to the next.  Its statistics
+ * are kept for query-migrate and sent in a MIGRATION_ITERATION event.
+ *
+ * Called with the iothread lock held, from the bitmap sync that ends
+ * the iteration.
+ *
+ * @rs: current RAM state
+ */
+static void ram_iteration_end(RAMState *rs)
+{
+    MigrationIterationStats *stats;
+    RAMIterationCounters now, *start = &rs->iteration_start;
+    int64_t duration;
+    unsigned int idx;
+    int i;
+
+    duration = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+               rs->iteration_start_time;
+    ram_iteration_counters_get(rs, &now);
+
+    stats = g_new0(MigrationIterationStats, 1);
+    stats->iteration = ram_counters.dirty_sync_count - 1;
+    stats->sync_time = rs->iteration_sync_time;
+    stats->duration = duration;
+    stats->dirty_pages = rs->iteration_dirty_pages;
+    stats->zero_pages = now.duplicate - start->duplicate;
+    stats->xbzrle_pages = now.xbzrle_pages - start->xbzrle_pages;
+    stats->compress_pages = now.compress_pages - start->compress_pages;
+    stats->multifd_pages = now.multifd_pages - start->multifd_pages;
+    /* compressed and multifd pages are accounted as normal pages too */
+    stats->normal_pages = now.normal - start->normal -
+                          stats->compress_pages - stats->multifd_pages;
+    stats->transferred = now.transferred - start->transferred;
+
+    if (multifd_send_state) {
+        intList **tail = &stats->multifd_transferred;
+
+        stats->has_multifd_transferred = true;
+        for (i = 0; i < multifd_send_state->count; i++) {
+            intList *entry = g_new0(intList, 1);
+
+            entry->value = multifd_send_state->params[i].iteration_transferred;
+            *tail = entry;
+            tail = &entry->next;
+        }
+    }
+
+    if (duration > 0 && stats->transferred) {
+        /* bytes per ms to megabits per second */
+        stats->mbps = stats->transferred * 8.0 / duration / 1000.0;
+        stats->expected_downtime = (double)rs->migration_dirty_pages *
+                                   TARGET_PAGE_SIZE * duration /
+                                   stats->transferred;
+    }
+
+    trace_ram_iteration_end(stats->iteration, stats->duration,
+                            stats->transferred, stats->expected_downtime);
+    if (migrate_use_events()) {
+        qapi_event_send_migration_iteration(stats, NULL);
+    }
+
+    idx = ram_iterations.count++ % RAM_ITERATION_HISTORY;
+    qapi_free_MigrationIterationStats(ram_iterations.entries[idx]);
+    ram_iterations.entries[idx] = stats;
 }
 
 /**
- * ram_pagesize_summary: calculate all the pagesizes of a VM
+ * ram_iteration_stats: get the statistics of the last iterations
  *
- * Returns a summary bitmap of the page sizes of all RAMBlocks
+ * Returns a list of up to RAM_ITERATION_HISTORY entries, oldest first,
+ * or NULL if no iteration has ended yet.
  *
- * For VMs with just normal pages this is equivalent to the host page
- * size. If it's got some huge pages then it's the OR of all the
- * different page sizes.
+ * Called with the iothread lock held.
  */
-uint64_t ram_pagesize_summary(void)
+MigrationIterationStatsList *ram_iteration_stats(void)
 {
-    RAMBlock *block;
-    uint64_t summary = 0;
+    MigrationIterationStatsList *head = NULL, **tail = &head;
+    uint64_t i = 0;
 
-    RAMBLOCK_FOREACH(block) {
-        summary |= block->page_size;
+    if (ram_iterations.count > RAM_ITERATION_HISTORY) {
+        i = ram_iterations.count - RAM_ITERATION_HISTORY;
+    }
+    for (; i < ram_iterations.count; i++) {
+        MigrationIterationStatsList *entry = g_new0(MigrationIterationStatsList,
+                                                    1);
+
+        entry->value = QAPI_CLONE(MigrationIterationStats,
+                        ram_iterations.entries[i % RAM_ITERATION_HISTORY]);
+        *tail = entry;
+        tail = &entry->next;
     }
 
-    return summary;
+    return head;
 }
 
-static void migration_bitmap_sync(RAMState *rs)
-{
-    RAMBlock *block;
-    int64_t end_time;
-    uint64_t bytes_xfer_now;
+static void migration_bitmap_sync_end(RAMState *rs, int64_t start_time);
 
+static int64_t migration_bitmap_sync_start(RAMState *rs)
+{
     ram_counters.dirty_sync_count++;
+    zero_scan_stop(rs);
 
     if (!rs->time_last_bitmap_sync) {
         rs->time_last_bitmap_sync = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     }
 
     trace_migration_bitmap_sync_start();
+    return qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+}
+
+/* Called with the iothread lock held */
+static void migration_bitmap_sync(RAMState *rs)
+{
+    RAMBlock *block;
+    int64_t start_time;
+
+    start_time = migration_bitmap_sync_start(rs);
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     rcu_read_lock();
     RAMBLOCK_FOREACH(block) {
-        migration_bitmap_sync_range(rs, block, 0, block->used_length);
+        migration_bitmap_sync_block(rs, block);
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    migration_bitmap_sync_end(rs, start_time);
+}
+
+/**
+ * migration_bitmap_sync_incremental: sync the dirty bitmap block by block
+ *
+ * Only the dirty log sync of each block needs the iothread lock, so it
+ * is taken and dropped once per block instead of being held for the
+ * whole pass.  Pages dirtied in a block after its turn are simply left
+ * for the next pass.
+ *
+ * Called without the iothread lock held.
+ *
+ * @rs: current RAM state
+ */
+static void migration_bitmap_sync_incremental(RAMState *rs)
+{
+    RAMBlock *block;
+    int64_t start_time;
+
+    start_time = migration_bitmap_sync_start(rs);
+
+    rcu_read_lock();
+    RAMBLOCK_FOREACH(block) {
+        qemu_mutex_lock_iothread();
+        memory_region_sync_dirty_bitmap(block->mr);
+        qemu_mutex_unlock_iothread();
+
+        qemu_mutex_lock(&rs->bitmap_mutex);
+        migration_bitmap_sync_block(rs, block);
+        qemu_mutex_unlock(&rs->bitmap_mutex);
+    }
+    rcu_read_unlock();
+
+    /* throttling and events still expect the iothread lock */
+    qemu_mutex_lock_iothread();
+    migration_bitmap_sync_end(rs, start_time);
+    qemu_mutex_unlock_iothread();
+}
+
+static void migration_bitmap_sync_end(RAMState *rs, int64_t start_time)
+{
+    int64_t end_time;
+    uint64_t bytes_xfer_now;
+
+    ram_counters.dirty_sync_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   start_time;
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period,
+                                    ram_counters.dirty_sync_time);
+
+    /* The first sync, at setup, starts the first iteration */
+    if (rs->iteration_start_time) {
+        ram_iteration_end(rs);
+    }
+    ram_iteration_start(rs, ram_counters.dirty_sync_time);
+
+    /*
+     * Pages dirtied again can be resent on a different multifd channel,
+     * so the channels must be flushed before sending the next round.
+     */
+    rs->multifd_sync_needed = true;
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -866,9 +2528,15 @@ static void migration_bitmap_sync(RAMState *rs)
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
                were in this routine. If that happens twice, start or increase
-               throttling */
-
-            if ((rs->num_dirty_pages_period * TARGET_PAGE_SIZE >
+               throttling.  With per-vcpu throttling, it is redone from the
+               dirty rate of each vcpu every time instead. */
+
+            if (migrate_cpu_throttle_per_vcpu() &&
+                mig_throttle_guest_down_per_vcpu(rs,
+                                     end_time - rs->time_last_bitmap_sync,
+                                     bytes_xfer_now - rs->bytes_xfer_prev)) {
+                trace_migration_throttle();
+            } else if ((rs->num_dirty_pages_period * TARGET_PAGE_SIZE >
                    (bytes_xfer_now - rs->bytes_xfer_prev) / 2) &&
                 (++rs->dirty_rate_high_cnt >= 2)) {
                     trace_migration_throttle();
@@ -970,8 +2638,6 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
         pages = 1;
     }
 
-    XBZRLE_cache_lock();
-
     current_addr = block->offset + offset;
 
     if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
@@ -995,8 +2661,8 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
             pages = save_xbzrle_page(rs, &p, current_addr, block,
                                      offset, last_stage);
             if (!last_stage) {
-                /* Can't send this cached data async, since the cache page
-                 * might get updated before it gets to the wire
+                /* Can't send this data async, since XBZRLE.current_buf
+                 * is reused for the next page before it gets to the wire
                  */
                 send_async = false;
             }
@@ -1019,28 +2685,139 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
         ram_counters.normal++;
     }
 
-    XBZRLE_cache_unlock();
+    return pages;
+}
+
+/**
+ * ram_save_multifd_page: queue the given page for the multifd channels
+ *
+ * Zero pages are still sent through the main stream.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_multifd_page(RAMState *rs, PageSearchStatus *pss,
+                                 bool last_stage)
+{
+    int pages;
+    uint8_t *p;
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
+
+    p = block->host + offset;
+    trace_ram_save_page(block->idstr, (uint64_t)offset, p);
+
+    pages = save_zero_page(rs, block, offset, p);
+    if (pages == -1) {
+        if (multifd_queue_page(rs, block, offset) < 0) {
+            qemu_file_set_error(rs->f, -EIO);
+            return -EIO;
+        }
+        ram_counters.normal++;
+        rs->multifd_pages++;
+        pages = 1;
+    }
 
     return pages;
 }
 
-static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
+/**
+ * ram_save_multifd_sync: flush the multifd channels
+ *
+ * Waits until every page queued for the multifd channels has been
+ * written, and tells the destination to wait until it has received
+ * all of them before it goes on with the main stream.
+ *
+ * Returns zero on success or negative on error
+ *
+ * @rs: current RAM state
+ */
+static int ram_save_multifd_sync(RAMState *rs)
+{
+    if (!multifd_send_state) {
+        return 0;
+    }
+    rs->multifd_sync_needed = false;
+    if (multifd_send_sync_main(rs) < 0) {
+        qemu_file_set_error(rs->f, -EIO);
+        return -EIO;
+    }
+    qemu_put_be64(rs->f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    ram_counters.transferred += 8;
+
+    return 0;
+}
+
+/**
+ * save_compressed_page: compress a page and write it to a file
+ *
+ * A page that does not shrink by at least an eighth is written raw.
+ * The compressor then also writes a run of the following pages raw,
+ * doubling in length each time it happens again, so that memory that
+ * does not compress does not keep burning CPU.
+ *
+ * Returns the number of bytes written, or negative on error
+ *
+ * @rs: current RAM state
+ * @c: compressor owned by the calling thread
+ * @f: QEMUFile where to write the page
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int save_compressed_page(RAMState *rs, PageCompressor *c,
+                                QEMUFile *f, RAMBlock *block,
                                 ram_addr_t offset)
 {
-    RAMState *rs = ram_state;
-    int bytes_sent, blen;
     uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
+    ssize_t blen = 0;
+    int bytes_sent;
+
+    if (c->skip) {
+        c->skip--;
+    } else {
+        blen = page_compress(c, p);
+        if (blen < 0) {
+            return -1;
+        }
+        if (blen > COMPRESS_MAX_LEN) {
+            c->backoff = MIN(MAX(c->backoff * 2, 1), COMPRESS_MAX_BACKOFF);
+            c->skip = c->backoff;
+            blen = 0;
+        } else {
+            c->backoff = 0;
+        }
+    }
+
+    if (!blen) {
+        trace_save_compressed_page_raw(block->idstr, offset, c->skip);
+        bytes_sent = save_page_header(rs, f, block,
+                                      offset | RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        return bytes_sent + TARGET_PAGE_SIZE;
+    }
+
+    bytes_sent = save_page_header(rs, f, block,
+                                  offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+    qemu_put_be32(f, blen);
+    qemu_put_buffer(f, c->buf, blen);
+    return bytes_sent + sizeof(int32_t) + blen;
+}
+
+static int do_compress_ram_page(QEMUFile *f, PageCompressor *c,
+                                RAMBlock *block, ram_addr_t offset)
+{
+    RAMState *rs = ram_state;
+    int bytes_sent;
 
-    bytes_sent = save_page_header(rs, f, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    if (blen < 0) {
+    bytes_sent = save_compressed_page(rs, c, f, block, offset);
+    if (bytes_sent < 0) {
+        qemu_file_set_error(migrate_get_current()->to_dst_file, bytes_sent);
         bytes_sent = 0;
-        qemu_file_set_error(migrate_get_current()->to_dst_file, blen);
         error_report("compressed data failed!");
     } else {
-        bytes_sent += blen;
         ram_release_pages(block->idstr, offset & TARGET_PAGE_MASK, 1);
     }
 
@@ -1100,6 +2877,7 @@ static int compress_page_with_multi_thread(RAMState *rs, RAMBlock *block,
                 pages = 1;
                 ram_counters.normal++;
                 ram_counters.transferred += bytes_xmit;
+                rs->compress_pages++;
                 break;
             }
         }
@@ -1130,7 +2908,7 @@ static int ram_save_compressed_page(RAMState *rs, PageSearchStatus *pss,
     int pages = -1;
     uint64_t bytes_xmit = 0;
     uint8_t *p;
-    int ret, blen;
+    int ret, len;
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->page << TARGET_PAGE_BITS;
 
@@ -1162,16 +2940,15 @@ static int ram_save_compressed_page(RAMState *rs, PageSearchStatus *pss,
             pages = save_zero_page(rs, block, offset, p);
             if (pages == -1) {
                 /* Make sure the first page is sent out before other pages */
-                bytes_xmit = save_page_header(rs, rs->f, block, offset |
-                                              RAM_SAVE_FLAG_COMPRESS_PAGE);
-                blen = qemu_put_compression_data(rs->f, p, TARGET_PAGE_SIZE,
-                                                 migrate_compress_level());
-                if (blen > 0) {
-                    ram_counters.transferred += bytes_xmit + blen;
+                len = save_compressed_page(rs, &main_compressor, rs->f,
+                                           block, offset);
+                if (len > 0) {
+                    ram_counters.transferred += len;
                     ram_counters.normal++;
+                    rs->compress_pages++;
                     pages = 1;
                 } else {
-                    qemu_file_set_error(rs->f, blen);
+                    qemu_file_set_error(rs->f, len);
                     error_report("compressed data failed!");
                 }
             }
@@ -1223,6 +3000,7 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
             /* Flag that we've looped */
             pss->complete_round = true;
             rs->ram_bulk_stage = false;
+            zero_scan_stop(rs);
             if (migrate_use_xbzrle()) {
                 /* If xbzrle is on, stop using the data compression at this
                  * point. In theory, xbzrle can do better than compression.
@@ -1452,6 +3230,8 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         if (migrate_use_compression() &&
             (rs->ram_bulk_stage || !migrate_use_xbzrle())) {
             res = ram_save_compressed_page(rs, pss, last_stage);
+        } else if (multifd_send_state) {
+            res = ram_save_multifd_page(rs, pss, last_stage);
         } else {
             res = ram_save_page(rs, pss, last_stage);
         }
@@ -1508,6 +3288,120 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     return pages;
 }
 
+/**
+ * ram_save_zero_pages: send a run of pages found zero by the zero page threads
+ *
+ * The run starts at pss->page and stops at the first page that was
+ * not found zero or at the end of its chunk.  Nothing is sent if the
+ * threads have not checked the chunk yet, and the caller then sends
+ * the page as usual.
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static int ram_save_zero_pages(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->block;
+    unsigned long chunk = pss->page / ZERO_SCAN_CHUNK_PAGES;
+    unsigned long start = pss->page;
+    unsigned long end;
+    int pages = 0;
+
+    if (!block->zero_bmap) {
+        return 0;
+    }
+    if (block != rs->zero_scan_block) {
+        /* the threads have no use for the rest of the previous block */
+        if (rs->zero_scan_block) {
+            zero_scan_skip_to(rs->zero_scan_block,
+                              zero_scan_nr_chunks(rs->zero_scan_block));
+        }
+        rs->zero_scan_block = block;
+    }
+    if (!test_bit(chunk, block->zero_scanned)) {
+        zero_scan_skip_to(block, chunk + 1);
+        return 0;
+    }
+    /* pairs with smp_wmb() in zero_scan_chunk() */
+    smp_rmb();
+
+    end = MIN((chunk + 1) * ZERO_SCAN_CHUNK_PAGES,
+              block->used_length >> TARGET_PAGE_BITS);
+    for (; pss->page < end && test_bit(pss->page, block->zero_bmap);
+         pss->page++) {
+        if (!migration_bitmap_clear_dirty(rs, block, pss->page)) {
+            continue;
+        }
+        if (block != rs->last_sent_block) {
+            /* compressed pages of the last block rely on the 'cont' flag */
+            flush_compressed_data(rs);
+        }
+        ram_counters.transferred +=
+            save_page_header(rs, rs->f, block,
+                             (pss->page << TARGET_PAGE_BITS) |
+                             RAM_SAVE_FLAG_ZERO);
+        qemu_put_byte(rs->f, 0);
+        ram_counters.transferred += 1;
+        ram_counters.duplicate++;
+        ram_counters.zero_scan_pages++;
+        if (block->unsentmap) {
+            clear_bit(pss->page, block->unsentmap);
+        }
+        pages++;
+    }
+
+    if (!pages) {
+        pss->page = start;
+        return 0;
+    }
+    trace_ram_save_zero_pages(block->idstr, start, pages);
+    /* The offset we leave with is the last one we looked at */
+    pss->page--;
+    return pages;
+}
+
+/**
+ * ram_save_host_page_urgent: save a host page on the postcopy preempt channel
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * The page was asked for by the destination; sending it on the preempt
+ * channel keeps it from waiting behind the background pages already
+ * queued on the main stream.  The block id is always sent in full since
+ * the destination tracks the last block of each channel separately.
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int ram_save_host_page_urgent(RAMState *rs, PageSearchStatus *pss,
+                                     bool last_stage)
+{
+    QEMUFile *f = rs->f;
+    RAMBlock *last_sent_block = rs->last_sent_block;
+    int pages, ret;
+
+    rs->f = migrate_get_current()->postcopy_qemufile_src;
+    rs->last_sent_block = NULL;
+
+    trace_ram_save_host_page_urgent(pss->block->idstr, pss->page);
+    pages = ram_save_host_page(rs, pss, last_stage);
+    qemu_fflush(rs->f);
+    ret = qemu_file_get_error(rs->f);
+
+    rs->f = f;
+    rs->last_sent_block = last_sent_block;
+
+    if (ret < 0) {
+        /* The destination is waiting for this page, give up */
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -1526,7 +3420,9 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
+    bool preempt = migration_in_postcopy() &&
+                   migrate_get_current()->postcopy_qemufile_src;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
@@ -1544,14 +3440,26 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     do {
         again = true;
         found = get_queued_page(rs, &pss);
+        urgent = found;
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(rs, &pss, &again);
         }
 
-        if (found) {
-            pages = ram_save_host_page(rs, &pss, last_stage);
+        if (found && urgent && preempt) {
+            pages = ram_save_host_page_urgent(rs, &pss, last_stage);
+        } else if (found) {
+            /*
+             * Zero runs may end in the middle of a host page, which
+             * postcopy cannot place.
+             */
+            if (!urgent && rs->zero_scan_active && !migration_in_postcopy()) {
+                pages = ram_save_zero_pages(rs, &pss);
+            }
+            if (!pages) {
+                pages = ram_save_host_page(rs, &pss, last_stage);
+            }
         }
     } while (!pages && again);
 
@@ -1600,6 +3508,7 @@ static void xbzrle_load_cleanup(void)
 
 static void ram_state_cleanup(RAMState **rsp)
 {
+    bitmap_sync_threads_cleanup();
     migration_page_queue_free(*rsp);
     qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
     qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -1611,13 +3520,17 @@ static void xbzrle_cleanup(void)
 {
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
-        cache_fini(XBZRLE.cache);
+        PageCache *cache = XBZRLE.cache;
+
+        atomic_rcu_set(&XBZRLE.cache, NULL);
+        cache_fini_rcu(cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
+        g_free(XBZRLE.prev_buf);
         g_free(XBZRLE.zero_target_page);
-        XBZRLE.cache = NULL;
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
+        XBZRLE.prev_buf = NULL;
         XBZRLE.zero_target_page = NULL;
     }
     XBZRLE_cache_unlock();
@@ -1633,11 +3546,17 @@ static void ram_save_cleanup(void *opaque)
      */
     memory_global_dirty_log_stop();
 
+    zero_scan_threads_cleanup();
+
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         g_free(block->bmap);
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->zero_bmap);
+        block->zero_bmap = NULL;
+        g_free(block->zero_scanned);
+        block->zero_scanned = NULL;
     }
 
     xbzrle_cleanup();
@@ -1652,6 +3571,8 @@ static void ram_state_reset(RAMState *rs)
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
+    /* the new bulk stage may resend pages written since they were checked */
+    zero_scan_stop(rs);
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
@@ -2092,10 +4013,19 @@ static int xbzrle_init(void)
         goto free_encoded_buf;
     }
 
+    XBZRLE.prev_buf = g_try_malloc(TARGET_PAGE_SIZE);
+    if (!XBZRLE.prev_buf) {
+        error_report("%s: Error allocating prev_buf", __func__);
+        goto free_current_buf;
+    }
+
     /* We are all good */
     XBZRLE_cache_unlock();
     return 0;
 
+free_current_buf:
+    g_free(XBZRLE.current_buf);
+    XBZRLE.current_buf = NULL;
 free_encoded_buf:
     g_free(XBZRLE.encoded_buf);
     XBZRLE.encoded_buf = NULL;
@@ -2130,6 +4060,7 @@ static int ram_state_init(RAMState **rsp)
     (*rsp)->migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
 
     ram_state_reset(*rsp);
+    bitmap_sync_threads_setup();
 
     return 0;
 }
@@ -2149,6 +4080,12 @@ static void ram_list_init_bitmaps(void)
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
             }
+            if (migrate_zero_page_threads()) {
+                block->zero_bmap = bitmap_new(pages);
+                block->zero_scanned =
+                    bitmap_new(DIV_ROUND_UP(pages, ZERO_SCAN_CHUNK_PAGES));
+                block->zero_scan_next = 0;
+            }
         }
     }
 }
@@ -2161,7 +4098,9 @@ static void ram_init_bitmaps(RAMState *rs)
     rcu_read_lock();
 
     ram_list_init_bitmaps();
+    ram_iterations_reset();
     memory_global_dirty_log_start();
+    mig_throttle_reset_vcpu_dirty_pages();
     migration_bitmap_sync(rs);
 
     rcu_read_unlock();
@@ -2181,6 +4120,7 @@ static int ram_init_all(RAMState **rsp)
     }
 
     ram_init_bitmaps(*rsp);
+    zero_scan_threads_setup(*rsp);
 
     return 0;
 }
@@ -2227,7 +4167,9 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
 
     rcu_read_unlock();
-    compress_threads_save_setup();
+    if (compress_threads_save_setup() < 0) {
+        return -1;
+    }
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
@@ -2264,6 +4206,14 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    if (rs->multifd_sync_needed) {
+        ret = ram_save_multifd_sync(rs);
+        if (ret < 0) {
+            rcu_read_unlock();
+            return ret;
+        }
+    }
+
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
@@ -2325,6 +4275,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     RAMState **temp = opaque;
     RAMState *rs = *temp;
+    int ret;
 
     rcu_read_lock();
 
@@ -2334,6 +4285,12 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
+    ret = ram_save_multifd_sync(rs);
+    if (ret < 0) {
+        rcu_read_unlock();
+        return ret;
+    }
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
@@ -2348,13 +4305,22 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(rs);
+    ret = ram_save_multifd_sync(rs);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
 
+    if (migration_in_postcopy() &&
+        migrate_get_current()->postcopy_qemufile_src) {
+        /* Let the destination preempt thread finish */
+        QEMUFile *preempt = migrate_get_current()->postcopy_qemufile_src;
+
+        qemu_put_be64(preempt, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(preempt);
+    }
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
-    return 0;
+    return ret;
 }
 
 static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
@@ -2369,11 +4335,7 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
 
     if (!migration_in_postcopy() &&
         remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
-        rcu_read_lock();
-        migration_bitmap_sync(rs);
-        rcu_read_unlock();
-        qemu_mutex_unlock_iothread();
+        migration_bitmap_sync_incremental(rs);
         remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
     }
 
@@ -2428,19 +4390,21 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @last_block: last block read from @f, updated
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              RAMBlock **last_block)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!*last_block) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return *last_block;
     }
 
     len = qemu_get_byte(f);
@@ -2453,9 +4417,13 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    *last_block = block;
     return block;
 }
 
+/* Last block read from the main migration stream */
+static RAMBlock *ram_load_last_block;
+
 static inline void *host_from_ram_block_offset(RAMBlock *block,
                                                ram_addr_t offset)
 {
@@ -2486,7 +4454,6 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
     uint8_t *des;
     int len;
 
@@ -2498,14 +4465,12 @@ static void *do_data_decompress(void *opaque)
             param->des = 0;
             qemu_mutex_unlock(&param->mutex);
 
-            pagesize = TARGET_PAGE_SIZE;
-            /* uncompress() will return failed in some case, especially
-             * when the page is dirted when doing the compression, it's
+            /* decompression will fail in some case, especially
+             * when the page is dirtied when doing the compression, it's
              * not a problem because the dirty page will be retransferred
-             * and uncompress() won't break the data in other pages.
+             * and a failure won't break the data in other pages.
              */
-            uncompress((Bytef *)des, &pagesize,
-                       (const Bytef *)param->compbuf, len);
+            page_decompress(&param->decompressor, des, param->compbuf, len);
 
             qemu_mutex_lock(&decomp_done_lock);
             param->done = true;
@@ -2540,12 +4505,15 @@ static void wait_for_decompress_done(void)
     qemu_mutex_unlock(&decomp_done_lock);
 }
 
-static void compress_threads_load_setup(void)
+static void compress_threads_load_cleanup(void);
+
+static int compress_threads_load_setup(void)
 {
     int i, thread_count;
+    CompressMethod method = migrate_compress_method();
 
     if (!migrate_use_compression()) {
-        return;
+        return 0;
     }
     thread_count = migrate_decompress_threads();
     decompress_threads = g_new0(QemuThread, thread_count);
@@ -2553,37 +4521,57 @@ static void compress_threads_load_setup(void)
     qemu_mutex_init(&decomp_done_lock);
     qemu_cond_init(&decomp_done_cond);
     for (i = 0; i < thread_count; i++) {
+        if (page_decompressor_init(&decomp_param[i].decompressor,
+                                   method) < 0) {
+            page_decompressor_cleanup(&decomp_param[i].decompressor);
+            error_report("%s: failed to set up the %s decompressor",
+                         __func__, CompressMethod_str(method));
+            compress_threads_load_cleanup();
+            return -1;
+        }
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        /* compbuf is also the sign that the thread has been started */
+        decomp_param[i].compbuf = g_malloc0(compress_bound(method));
         decomp_param[i].done = true;
         decomp_param[i].quit = false;
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
     }
+    return 0;
 }
 
 static void compress_threads_load_cleanup(void)
 {
     int i, thread_count;
 
-    if (!migrate_use_compression()) {
+    if (!migrate_use_compression() || !decomp_param) {
         return;
     }
     thread_count = migrate_decompress_threads();
     for (i = 0; i < thread_count; i++) {
+        if (!decomp_param[i].compbuf) {
+            break;
+        }
         qemu_mutex_lock(&decomp_param[i].mutex);
         decomp_param[i].quit = true;
         qemu_cond_signal(&decomp_param[i].cond);
         qemu_mutex_unlock(&decomp_param[i].mutex);
     }
     for (i = 0; i < thread_count; i++) {
+        if (!decomp_param[i].compbuf) {
+            break;
+        }
         qemu_thread_join(decompress_threads + i);
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
+        page_decompressor_cleanup(&decomp_param[i].decompressor);
         g_free(decomp_param[i].compbuf);
+        decomp_param[i].compbuf = NULL;
     }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
     g_free(decompress_threads);
     g_free(decomp_param);
     decompress_threads = NULL;
@@ -2630,9 +4618,8 @@ static void decompress_data_with_multi_threads(QEMUFile *f,
 static int ram_load_setup(QEMUFile *f, void *opaque)
 {
     xbzrle_load_setup();
-    compress_threads_load_setup();
     ramblock_recv_map_init();
-    return 0;
+    return compress_threads_load_setup();
 }
 
 static int ram_load_cleanup(void *opaque)
@@ -2671,19 +4658,20 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load() and by the postcopy preempt thread.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @postcopy_host_page: temporary page that is later 'placed'
+ * @last_block: last block read from @f
  */
-static int ram_load_postcopy(QEMUFile *f)
+static int ram_load_postcopy(QEMUFile *f, void *postcopy_host_page,
+                             RAMBlock **last_block)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matching_page_sizes = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -2702,7 +4690,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, last_block);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -2798,6 +4786,26 @@ static int ram_load_postcopy(QEMUFile *f)
     return ret;
 }
 
+/**
+ * ram_load_postcopy_preempt: load the pages sent on the preempt channel
+ *
+ * Returns 0 once the source ends the channel, or -errno in case of error
+ *
+ * @f: the postcopy preempt channel
+ * @tmp_page: temporary page of the largest page size, for this thread alone
+ */
+int ram_load_postcopy_preempt(QEMUFile *f, void *tmp_page)
+{
+    RAMBlock *last_block = NULL;
+    int ret;
+
+    rcu_read_lock();
+    ret = ram_load_postcopy(f, tmp_page, &last_block);
+    rcu_read_unlock();
+
+    return ret;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0, invalid_flags = 0;
@@ -2820,6 +4828,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     if (!migrate_use_compression()) {
         invalid_flags |= RAM_SAVE_FLAG_COMPRESS_PAGE;
     }
+    if (!multifd_recv_state) {
+        invalid_flags |= RAM_SAVE_FLAG_MULTIFD_SYNC;
+    }
     /* This RCU critical section can be very long running.
      * When RCU reclaims in the code start to become numerous,
      * it will be necessary to reduce the granularity of this
@@ -2828,7 +4839,11 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        MigrationIncomingState *mis = migration_incoming_get_current();
+
+        /* Temporary page that is later 'placed' */
+        ret = ram_load_postcopy(f, postcopy_get_tmp_page(mis),
+                                &ram_load_last_block);
     }
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -2844,6 +4859,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             if (flags & invalid_flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
                 error_report("Received an unexpected compressed page");
             }
+            if (flags & invalid_flags & RAM_SAVE_FLAG_MULTIFD_SYNC) {
+                error_report("Received an unexpected multifd sync");
+            }
 
             ret = -EINVAL;
             break;
@@ -2851,7 +4869,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    &ram_load_last_block);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -2923,7 +4942,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 ||
+                len > compress_bound(migrate_compress_method())) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -2939,6 +4959,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            /* wait for the pages sent through the multifd channels */
+            if (multifd_recv_sync_main() < 0) {
+                error_report("Failed to sync the multifd channels");
+                ret = -EIO;
+            }
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
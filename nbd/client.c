@@ -549,6 +549,127 @@ static int nbd_request_simple_option(QIOChannel *ioc, int opt, Error **errp)
     return 1;
 }
 
+/* nbd_negotiate_simple_meta_context:
+ * Set one meta context with NBD_OPT_SET_META_CONTEXT. Simple means that
+ * the query is the full name of the context, so the server must reply
+ * with either zero (not supported) or exactly that one context; anything
+ * else is a protocol error.
+ * return 1 for successful negotiation, with *@context_id set,
+ *        0 if operation is unsupported,
+ *        -1 with errp set for any other error
+ */
+static int nbd_negotiate_simple_meta_context(QIOChannel *ioc,
+                                             const char *export,
+                                             const char *context,
+                                             uint32_t *context_id,
+                                             Error **errp)
+{
+    int ret;
+    nbd_opt_reply reply;
+    uint32_t received_id = 0;
+    bool received = false;
+    uint32_t export_len = strlen(export);
+    uint32_t context_len = strlen(context);
+    uint32_t data_len = sizeof(export_len) + export_len +
+                        sizeof(uint32_t) + /* number of queries */
+                        sizeof(context_len) + context_len;
+    char *data = g_malloc(data_len);
+    char *p = data;
+    char *name;
+
+    trace_nbd_opt_meta_request(context, export);
+    stl_be_p(p, export_len);
+    memcpy(p += sizeof(export_len), export, export_len);
+    stl_be_p(p += export_len, 1);
+    stl_be_p(p += sizeof(uint32_t), context_len);
+    memcpy(p += sizeof(context_len), context, context_len);
+
+    ret = nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, data_len, data,
+                                  errp);
+    g_free(data);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (true) {
+        if (nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT, &reply,
+                                     errp) < 0) {
+            return -1;
+        }
+        ret = nbd_handle_reply_err(ioc, &reply, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+
+        if (reply.type == NBD_REP_ACK) {
+            break;
+        }
+        if (reply.type != NBD_REP_META_CONTEXT) {
+            error_setg(errp, "Unexpected reply type %" PRIx32 " (%s) for "
+                       "option %s, expected %s or %s", reply.type,
+                       nbd_rep_lookup(reply.type),
+                       nbd_opt_lookup(NBD_OPT_SET_META_CONTEXT),
+                       nbd_rep_lookup(NBD_REP_META_CONTEXT),
+                       nbd_rep_lookup(NBD_REP_ACK));
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        if (received) {
+            error_setg(errp, "Server replied with more than one context");
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        if (reply.length != sizeof(received_id) + context_len) {
+            error_setg(errp, "Failed to negotiate meta context '%s', server "
+                       "answered with different context", context);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+
+        if (nbd_read(ioc, &received_id, sizeof(received_id), errp) < 0) {
+            error_prepend(errp, "failed to read context id: ");
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        be32_to_cpus(&received_id);
+
+        name = g_malloc(context_len + 1);
+        if (nbd_read(ioc, name, context_len, errp) < 0) {
+            error_prepend(errp, "failed to read context name: ");
+            g_free(name);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        name[context_len] = '\0';
+        if (strcmp(context, name)) {
+            error_setg(errp, "Failed to negotiate meta context '%s', server "
+                       "answered with different context '%s'", context,
+                       name);
+            g_free(name);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        g_free(name);
+
+        trace_nbd_opt_meta_reply(context, received_id);
+        received = true;
+    }
+
+    if (reply.length != 0) {
+        error_setg(errp, "Option %s response length is %" PRIu32
+                   " (it should be zero)",
+                   nbd_opt_lookup(NBD_OPT_SET_META_CONTEXT), reply.length);
+        nbd_send_opt_abort(ioc);
+        return -1;
+    }
+
+    if (received) {
+        *context_id = received_id;
+        return 1;
+    }
+    return 0;
+}
+
 static QIOChannel *nbd_receive_starttls(QIOChannel *ioc,
                                         QCryptoTLSCreds *tlscreds,
                                         const char *hostname, Error **errp)
@@ -603,10 +724,12 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
     int rc;
     bool zeroes = true;
     bool structured_reply = info->structured_reply;
+    bool base_allocation = info->base_allocation;
 
     trace_nbd_receive_negotiate(tlscreds, hostname ? hostname : "<null>");
 
     info->structured_reply = false;
+    info->base_allocation = false;
     rc = -EINVAL;
 
     if (outioc) {
@@ -697,6 +820,17 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
                 info->structured_reply = result == 1;
             }
 
+            if (info->structured_reply && base_allocation) {
+                result = nbd_negotiate_simple_meta_context(
+                        ioc, name,
+                        info->x_dirty_bitmap ?: NBD_META_BASE_ALLOCATION,
+                        &info->context_id, errp);
+                if (result < 0) {
+                    goto fail;
+                }
+                info->base_allocation = result == 1;
+            }
+
             /* Try NBD_OPT_GO first - if it works, we are done (it
              * also gives us a good message if the server requires
              * TLS).  If it is not available, fall back to
@@ -22,6 +22,19 @@
 #include "trace.h"
 #include "nbd-internal.h"
 
+#define NBD_META_ID_BASE_ALLOCATION 0
+#define NBD_META_ID_DIRTY_BITMAP 1
+
+/* NBD_MAX_BLOCK_STATUS_EXTENTS: 1 mb of extents data. An empirical
+ * constant. If an increase is needed, note that the NBD protocol
+ * recommends no larger than 32 mb, so that the client won't consider
+ * the reply as a denial of service attack. */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * 1024 * 1024 / sizeof(NBDExtent))
+
+/* Maximum length of the payload of NBD_OPT_{LIST,SET}_META_CONTEXT that we
+ * are willing to buffer */
+#define NBD_MAX_META_OPTION_SIZE (64 * 1024)
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -78,10 +91,26 @@ struct NBDExport {
 
     BlockBackend *eject_notifier_blk;
     Notifier eject_notifier;
+
+    /* Dirty bitmap exported as export_bitmap_context, searched for in the
+     * backing chain of the export by name on each request */
+    char *export_bitmap_name;
+    char *export_bitmap_context;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
 
+/* NBDExportMetaContexts represents a list of contexts to be exported,
+ * as selected by NBD_OPT_SET_META_CONTEXT. Also used for
+ * NBD_OPT_LIST_META_CONTEXT. */
+typedef struct NBDExportMetaContexts {
+    NBDExport *exp;
+    bool valid; /* means that negotiation of the option finished without
+                   errors */
+    bool base_allocation; /* export base:allocation context (block status) */
+    bool bitmap; /* export qemu:dirty-bitmap:<export bitmap name> */
+} NBDExportMetaContexts;
+
 struct NBDClient {
     int refcount;
     void (*close_fn)(NBDClient *client, bool negotiated);
@@ -102,6 +131,7 @@ struct NBDClient {
     bool closing;
 
     bool structured_reply;
+    NBDExportMetaContexts export_meta;
 };
 
 /* That's all folks */
@@ -305,6 +335,10 @@ static int nbd_negotiate_handle_export_name(NBDClient *client, uint32_t length,
         error_setg(errp, "export not found");
         return -EINVAL;
     }
+    if (client->export_meta.exp != client->exp) {
+        /* Meta contexts were selected for another export */
+        memset(&client->export_meta, 0, sizeof(client->export_meta));
+    }
 
     trace_nbd_negotiate_new_style_size_flags(client->exp->size,
                                              client->exp->nbdflags | myflags);
@@ -504,6 +538,10 @@ static int nbd_negotiate_handle_info(NBDClient *client, uint32_t length,
 
     if (opt == NBD_OPT_GO) {
         client->exp = exp;
+        if (client->export_meta.exp != exp) {
+            /* Meta contexts were selected for another export */
+            memset(&client->export_meta, 0, sizeof(client->export_meta));
+        }
         QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
         nbd_export_get(client->exp);
         rc = 1;
@@ -518,6 +556,210 @@ static int nbd_negotiate_handle_info(NBDClient *client, uint32_t length,
                                       errp, "%s", msg);
 }
 
+/* Send a single NBD_REP_META_CONTEXT, announcing @context under the id
+ * @context_id.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_send_meta_context(NBDClient *client, uint32_t opt,
+                                           const char *context,
+                                           uint32_t context_id,
+                                           Error **errp)
+{
+    size_t len = strlen(context);
+    uint32_t id;
+    int ret;
+
+    trace_nbd_negotiate_send_meta_context(nbd_opt_lookup(opt), context,
+                                          context_id);
+    ret = nbd_negotiate_send_rep_len(client->ioc, NBD_REP_META_CONTEXT, opt,
+                                     sizeof(id) + len, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    id = cpu_to_be32(context_id);
+    if (nbd_write(client->ioc, &id, sizeof(id), errp) < 0) {
+        error_prepend(errp, "write failed (context id): ");
+        return -EIO;
+    }
+    if (nbd_write(client->ioc, context, len, errp) < 0) {
+        error_prepend(errp, "write failed (context name): ");
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Select the contexts of @meta->exp named by @query. For
+ * NBD_OPT_LIST_META_CONTEXT, a bare namespace prefix selects every context
+ * in that namespace; NBD_OPT_SET_META_CONTEXT needs the full name. */
+static void nbd_meta_select(NBDExportMetaContexts *meta, uint32_t opt,
+                            const char *query)
+{
+    bool list = opt == NBD_OPT_LIST_META_CONTEXT;
+    const char *bitmap_context = meta->exp->export_bitmap_context;
+
+    if (!strcmp(query, NBD_META_BASE_ALLOCATION) ||
+        (list && !strcmp(query, NBD_META_NS_BASE))) {
+        meta->base_allocation = true;
+    } else if (bitmap_context &&
+               (!strcmp(query, bitmap_context) ||
+                (list && (!strcmp(query, NBD_META_NS_QEMU) ||
+                          !strcmp(query, NBD_META_QEMU_DIRTY_BITMAP))))) {
+        meta->bitmap = true;
+    }
+}
+
+/* Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.
+ * For SET, the selected contexts are remembered in client->export_meta.
+ * Return -errno on I/O error, 0 if option was completely handled. */
+static int nbd_negotiate_meta_queries(NBDClient *client, uint32_t length,
+                                      uint32_t opt, Error **errp)
+{
+    NBDExportMetaContexts local_meta = { 0 };
+    NBDExportMetaContexts *meta;
+    char name[NBD_MAX_NAME_SIZE + 1];
+    uint32_t namelen, nb_queries, querylen, i;
+    char *buf, *p, *query;
+    const char *msg;
+    int ret;
+
+    /* Client sends:
+        4 bytes: L, name length (can be 0)
+        L bytes: export name
+        4 bytes: N, number of queries (can be 0)
+        N times:
+            4 bytes: LQ, query length
+            LQ bytes: query
+     */
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        /* A new SET replaces the old selection, even if it fails */
+        meta = &client->export_meta;
+        memset(meta, 0, sizeof(*meta));
+        if (!client->structured_reply) {
+            if (nbd_drop(client->ioc, length, errp) < 0) {
+                return -EIO;
+            }
+            return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                              opt, errp,
+                                              "request option '%s' when "
+                                              "structured reply is not "
+                                              "negotiated",
+                                              nbd_opt_lookup(opt));
+        }
+    } else {
+        meta = &local_meta;
+    }
+
+    if (length > NBD_MAX_META_OPTION_SIZE) {
+        if (nbd_drop(client->ioc, length, errp) < 0) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          opt, errp, "option too long");
+    }
+
+    buf = g_malloc(length);
+    if (nbd_read(client->ioc, buf, length, errp) < 0) {
+        error_prepend(errp, "read failed: ");
+        g_free(buf);
+        return -EIO;
+    }
+    p = buf;
+
+    if (length < sizeof(namelen)) {
+        msg = "overall request too short";
+        goto invalid;
+    }
+    namelen = ldl_be_p(p);
+    p += sizeof(namelen);
+    length -= sizeof(namelen);
+    if (namelen > NBD_MAX_NAME_SIZE) {
+        msg = "name too long for qemu";
+        goto invalid;
+    }
+    if (namelen > length || length - namelen < sizeof(nb_queries)) {
+        msg = "name length is incorrect";
+        goto invalid;
+    }
+    memcpy(name, p, namelen);
+    name[namelen] = '\0';
+    p += namelen;
+    length -= namelen;
+    nb_queries = ldl_be_p(p);
+    p += sizeof(nb_queries);
+    length -= sizeof(nb_queries);
+    trace_nbd_negotiate_meta_context(nbd_opt_lookup(opt), name, nb_queries);
+
+    meta->exp = nbd_export_find(name);
+    if (!meta->exp) {
+        memset(meta, 0, sizeof(*meta));
+        ret = nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_UNKNOWN, opt,
+                                         errp, "export '%s' not present",
+                                         name);
+        goto out;
+    }
+
+    if (nb_queries == 0 && opt == NBD_OPT_LIST_META_CONTEXT) {
+        /* Listing with no queries means all contexts of the export */
+        meta->base_allocation = true;
+        meta->bitmap = meta->exp->export_bitmap_context != NULL;
+    }
+    for (i = 0; i < nb_queries; i++) {
+        if (length < sizeof(querylen)) {
+            msg = "overall request too short";
+            goto invalid;
+        }
+        querylen = ldl_be_p(p);
+        p += sizeof(querylen);
+        length -= sizeof(querylen);
+        if (querylen > length) {
+            msg = "query length is incorrect";
+            goto invalid;
+        }
+        query = g_strndup(p, querylen);
+        p += querylen;
+        length -= querylen;
+        trace_nbd_negotiate_meta_query(query);
+        nbd_meta_select(meta, opt, query);
+        g_free(query);
+    }
+    if (length) {
+        msg = "trailing data after queries";
+        goto invalid;
+    }
+
+    if (meta->base_allocation) {
+        ret = nbd_negotiate_send_meta_context(client, opt,
+                                              NBD_META_BASE_ALLOCATION,
+                                              NBD_META_ID_BASE_ALLOCATION,
+                                              errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    if (meta->bitmap) {
+        ret = nbd_negotiate_send_meta_context(client, opt,
+                                              meta->exp->export_bitmap_context,
+                                              NBD_META_ID_DIRTY_BITMAP,
+                                              errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt, errp);
+    if (ret == 0) {
+        meta->valid = true;
+    }
+    goto out;
+
+ invalid:
+    memset(meta, 0, sizeof(*meta));
+    ret = nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID, opt,
+                                     errp, "%s", msg);
+ out:
+    g_free(buf);
+    return ret;
+}
 
 /* Handle NBD_OPT_STARTTLS. Return NULL to drop connection, or else the
  * new channel for all further (now-encrypted) communication. */
@@ -788,6 +1030,12 @@ static int nbd_negotiate_options(NBDClient *client, uint16_t myflags,
                 }
                 break;
 
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_meta_queries(client, length, option,
+                                                 errp);
+                break;
+
             default:
                 if (nbd_drop(client->ioc, length, errp) < 0) {
                     return -EIO;
@@ -1153,6 +1401,42 @@ void nbd_export_set_description(NBDExport *exp, const char *description)
     exp->description = g_strdup(description);
 }
 
+/* Look up the exported dirty bitmap by name in the backing chain of the
+ * export. The bitmap may go away while the export is running, so this is
+ * done on each request rather than holding a pointer. */
+static BdrvDirtyBitmap *nbd_export_find_bitmap(NBDExport *exp)
+{
+    BlockDriverState *bs = blk_bs(exp->blk);
+    BdrvDirtyBitmap *bm = NULL;
+
+    while (bs && !(bm = bdrv_find_dirty_bitmap(bs, exp->export_bitmap_name))) {
+        bs = backing_bs(bs);
+    }
+
+    return bm;
+}
+
+void nbd_export_bitmap(NBDExport *exp, const char *bitmap,
+                       const char *bitmap_export_name, Error **errp)
+{
+    if (exp->export_bitmap_name) {
+        error_setg(errp, "Export bitmap is already set");
+        return;
+    }
+
+    exp->export_bitmap_name = g_strdup(bitmap);
+    if (!nbd_export_find_bitmap(exp)) {
+        error_setg(errp, "Bitmap '%s' is not found", bitmap);
+        g_free(exp->export_bitmap_name);
+        exp->export_bitmap_name = NULL;
+        return;
+    }
+
+    exp->export_bitmap_context =
+        g_strdup_printf(NBD_META_QEMU_DIRTY_BITMAP "%s",
+                        bitmap_export_name ?: bitmap);
+}
+
 void nbd_export_close(NBDExport *exp)
 {
     NBDClient *client, *next;
@@ -1198,6 +1482,8 @@ void nbd_export_put(NBDExport *exp)
             exp->blk = NULL;
         }
 
+        g_free(exp->export_bitmap_name);
+        g_free(exp->export_bitmap_context);
         g_free(exp);
     }
 }
@@ -1317,6 +1603,150 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
     return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
 }
 
+/* Extents of one metadata context, collected before they are sent. Adjacent
+ * extents with the same flags are merged. */
+typedef struct NBDExtentList {
+    NBDExtent *extents;
+    unsigned int count;
+    unsigned int nb_alloc;
+    unsigned int max;
+} NBDExtentList;
+
+static void nbd_extent_list_init(NBDExtentList *list, bool req_one)
+{
+    list->extents = NULL;
+    list->count = 0;
+    list->nb_alloc = 0;
+    list->max = req_one ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+}
+
+/* Append an extent to @list. Return false if @list is full and the extent
+ * could not be added. */
+static bool nbd_extent_list_add(NBDExtentList *list, uint32_t length,
+                                uint32_t flags)
+{
+    if (list->count && list->extents[list->count - 1].flags == flags) {
+        list->extents[list->count - 1].length += length;
+        return true;
+    }
+
+    if (list->count == list->max) {
+        return false;
+    }
+
+    if (list->count == list->nb_alloc) {
+        list->nb_alloc = MIN(MAX(list->nb_alloc * 2, 16), list->max);
+        list->extents = g_renew(NBDExtent, list->extents, list->nb_alloc);
+    }
+    list->extents[list->count].length = length;
+    list->extents[list->count].flags = flags;
+    list->count++;
+
+    return true;
+}
+
+/* Fill @list with base:allocation extents for @bytes at @offset.
+ * Return -errno on error, 0 on success. */
+static int blockstatus_to_extents(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes, NBDExtentList *list)
+{
+    while (bytes) {
+        uint32_t flags;
+        int64_t num;
+        int ret = bdrv_block_status_above(bs, NULL, offset, bytes, &num,
+                                          NULL, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+
+        flags = (ret & BDRV_BLOCK_DATA ? 0 : NBD_STATE_HOLE) |
+                (ret & BDRV_BLOCK_ZERO ? NBD_STATE_ZERO : 0);
+        if (!nbd_extent_list_add(list, num, flags)) {
+            break;
+        }
+
+        offset += num;
+        bytes -= num;
+    }
+
+    return 0;
+}
+
+/* Fill @list with dirty bitmap extents for @length bytes at @offset.
+ * Anything past the end of @bitmap is reported as clean. */
+static void bitmap_to_extents(BdrvDirtyBitmap *bitmap, uint64_t offset,
+                              uint64_t length, NBDExtentList *list)
+{
+    uint64_t begin = offset, end;
+    uint64_t overall_end = offset + length;
+    uint64_t size;
+    BdrvDirtyBitmapIter *it;
+    int64_t next;
+    bool dirty;
+
+    bdrv_dirty_bitmap_lock(bitmap);
+
+    size = bdrv_dirty_bitmap_size(bitmap);
+    it = bdrv_dirty_iter_new(bitmap);
+    dirty = begin < size && bdrv_get_dirty_locked(NULL, bitmap, begin);
+
+    while (begin < overall_end) {
+        if (begin >= size) {
+            dirty = false;
+            end = overall_end;
+        } else if (dirty) {
+            next = bdrv_dirty_bitmap_next_zero(bitmap, begin);
+            end = next < 0 ? size : next;
+        } else {
+            bdrv_set_dirty_iter(it, begin);
+            next = bdrv_dirty_iter_next(it);
+            end = next < 0 ? overall_end : next;
+        }
+        end = MIN(end, overall_end);
+
+        if (!nbd_extent_list_add(list, end - begin,
+                                 dirty ? NBD_STATE_DIRTY : 0)) {
+            break;
+        }
+        begin = end;
+        dirty = !dirty;
+    }
+
+    bdrv_dirty_iter_free(it);
+    bdrv_dirty_bitmap_unlock(bitmap);
+}
+
+/* Send the extents of @list as one NBD_REPLY_TYPE_BLOCK_STATUS chunk for
+ * context @context_id. @list is converted to big endian in place. */
+static int coroutine_fn nbd_co_send_extents(NBDClient *client, uint64_t handle,
+                                            NBDExtentList *list,
+                                            uint32_t context_id, bool last,
+                                            Error **errp)
+{
+    NBDStructuredMeta chunk;
+    uint64_t total = 0;
+    unsigned int i;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+        {.iov_base = list->extents,
+         .iov_len = list->count * sizeof(list->extents[0])}
+    };
+
+    for (i = 0; i < list->count; i++) {
+        total += list->extents[i].length;
+        cpu_to_be32s(&list->extents[i].length);
+        cpu_to_be32s(&list->extents[i].flags);
+    }
+
+    trace_nbd_co_send_extents(handle, list->count, context_id, total, last);
+    set_be_chunk(&chunk.h, last ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_BLOCK_STATUS, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + iov[1].iov_len);
+    stl_be_p(&chunk.context_id, context_id);
+
+    return nbd_co_send_iov(client, iov, 2, errp);
+}
+
 /* nbd_co_receive_request
  * Collect a client request. Return 0 if request looks valid, -EIO to drop
  * connection right away, and any other negative value to report an error to
@@ -1394,6 +1824,8 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
         valid_flags |= NBD_CMD_FLAG_DF;
     } else if (request->type == NBD_CMD_WRITE_ZEROES) {
         valid_flags |= NBD_CMD_FLAG_NO_HOLE;
+    } else if (request->type == NBD_CMD_BLOCK_STATUS) {
+        valid_flags |= NBD_CMD_FLAG_REQ_ONE;
     }
     if (request->flags & ~valid_flags) {
         error_setg(errp, "unsupported flags for command %s (got 0x%x)",
@@ -1416,6 +1848,10 @@ static coroutine_fn void nbd_trip(void *opaque)
     int reply_data_len = 0;
     Error *local_err = NULL;
     char *msg = NULL;
+    NBDExportMetaContexts *meta = &client->export_meta;
+    NBDExtentList base_extents = { 0 };
+    NBDExtentList bitmap_extents = { 0 };
+    BdrvDirtyBitmap *bitmap;
 
     trace_nbd_trip();
     if (client->closing) {
@@ -1521,6 +1957,46 @@ static coroutine_fn void nbd_trip(void *opaque)
             error_setg_errno(&local_err, -ret, "discard failed");
         }
 
+        break;
+    case NBD_CMD_BLOCK_STATUS:
+        if (!meta->valid || !(meta->base_allocation || meta->bitmap)) {
+            error_setg(&local_err, "CMD_BLOCK_STATUS not negotiated");
+            ret = -EINVAL;
+            break;
+        }
+        if (!request.len) {
+            error_setg(&local_err, "need non-zero length");
+            ret = -EINVAL;
+            break;
+        }
+
+        if (meta->base_allocation) {
+            nbd_extent_list_init(&base_extents,
+                                 request.flags & NBD_CMD_FLAG_REQ_ONE);
+            ret = blockstatus_to_extents(blk_bs(exp->blk),
+                                         request.from + exp->dev_offset,
+                                         request.len, &base_extents);
+            if (ret < 0) {
+                error_setg_errno(&local_err, -ret,
+                                 "can't get block status");
+                break;
+            }
+        }
+
+        if (meta->bitmap) {
+            bitmap = nbd_export_find_bitmap(exp);
+            if (!bitmap) {
+                error_setg(&local_err, "Bitmap '%s' is gone",
+                           exp->export_bitmap_name);
+                ret = -EIO;
+                break;
+            }
+            nbd_extent_list_init(&bitmap_extents,
+                                 request.flags & NBD_CMD_FLAG_REQ_ONE);
+            bitmap_to_extents(bitmap, request.from + exp->dev_offset,
+                              request.len, &bitmap_extents);
+        }
+
         break;
     default:
         error_setg(&local_err, "invalid request type (%" PRIu32 ") received",
@@ -1539,14 +2015,28 @@ reply:
     }
 
     if (client->structured_reply &&
-        (ret < 0 || request.type == NBD_CMD_READ)) {
+        (ret < 0 || request.type == NBD_CMD_READ ||
+         request.type == NBD_CMD_BLOCK_STATUS)) {
         if (ret < 0) {
             ret = nbd_co_send_structured_error(req->client, request.handle,
                                                -ret, msg, &local_err);
-        } else {
+        } else if (request.type == NBD_CMD_READ) {
             ret = nbd_co_send_structured_read(req->client, request.handle,
                                               request.from, req->data,
                                               reply_data_len, &local_err);
+        } else {
+            if (meta->base_allocation) {
+                ret = nbd_co_send_extents(req->client, request.handle,
+                                          &base_extents,
+                                          NBD_META_ID_BASE_ALLOCATION,
+                                          !meta->bitmap, &local_err);
+            }
+            if (ret >= 0 && meta->bitmap) {
+                ret = nbd_co_send_extents(req->client, request.handle,
+                                          &bitmap_extents,
+                                          NBD_META_ID_DIRTY_BITMAP,
+                                          true, &local_err);
+            }
         }
     } else {
         ret = nbd_co_send_simple_reply(req->client, request.handle,
@@ -1554,6 +2044,8 @@ reply:
                                        req->data, reply_data_len, &local_err);
     }
     g_free(msg);
+    g_free(base_extents.extents);
+    g_free(bitmap_extents.extents);
     if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
         goto disconnect;
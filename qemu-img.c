@@ -178,6 +178,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '-C' offloads the copy of allocated data to the storage (e.g. via\n"
+           "       copy_file_range or SCSI EXTENDED COPY) where both images support it\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -190,6 +192,7 @@ static void QEMU_NORETURN help(void)
            "  '-f' first image format\n"
            "  '-F' second image format\n"
            "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "  '-m' number of parallel coroutines (default: 8)\n"
            "\n"
            "Parameters to dd subcommand:\n"
            "  'bs=BYTES' read and write up to BYTES bytes at a time "
@@ -1170,6 +1173,13 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 
     assert(bytes > 0);
 
+    /* Usually the whole buffer matches; memcmp() on the full length is much
+     * faster than going sector by sector */
+    if (!memcmp(buf1, buf2, bytes)) {
+        *pnum = bytes;
+        return 0;
+    }
+
     res = !!memcmp(buf1, buf2, i);
     while (i < bytes) {
         int64_t len = MIN(bytes - i, BDRV_SECTOR_SIZE);
@@ -1186,44 +1196,265 @@ static int compare_buffers(const uint8_t *buf1, const uint8_t *buf2,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+#define MAX_COROUTINES 16
+
 /*
  * Check if passed sectors are empty (not allocated or contain only 0 bytes)
  *
  * Intended for use by 'qemu-img compare': Returns 0 in case sectors are
  * filled with 0, 1 if sectors contain non-zero data (this is a comparison
- * failure), and 4 on error (the exit status for read errors), after emitting
- * an error message.
+ * failure, and the offset of the first non-zero byte is stored in
+ * *mismatch), and 4 on error (the exit status for read errors), after
+ * setting @errp.
  *
  * @param blk:  BlockBackend for the image
  * @param offset: Starting offset to check
  * @param bytes: Number of bytes to check
  * @param filename: Name of disk file we are checking (logging purpose)
  * @param buffer: Allocated buffer for storing read data
- * @param quiet: Flag for quiet mode
+ * @param mismatch: Offset of the first non-zero byte, if any
+ * @param errp: Set to the read error, if any
  */
-static int check_empty_sectors(BlockBackend *blk, int64_t offset,
-                               int64_t bytes, const char *filename,
-                               uint8_t *buffer, bool quiet)
+static int coroutine_fn check_empty_sectors(BlockBackend *blk, int64_t offset,
+                                            int64_t bytes, const char *filename,
+                                            uint8_t *buffer, int64_t *mismatch,
+                                            Error **errp)
 {
     int ret = 0;
     int64_t idx;
 
     ret = blk_pread(blk, offset, buffer, bytes);
     if (ret < 0) {
-        error_report("Error while reading offset %" PRId64 " of %s: %s",
-                     offset, filename, strerror(-ret));
+        error_setg_errno(errp, -ret, "Error while reading offset %" PRId64
+                         " of %s", offset, filename);
         return 4;
     }
     idx = find_nonzero(buffer, bytes);
     if (idx >= 0) {
-        qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                offset + idx);
+        *mismatch = offset + idx;
         return 1;
     }
 
     return 0;
 }
 
+enum ImgCompareAction {
+    COMPARE_NONE,
+    COMPARE_DATA,
+    COMPARE_CHECK_EMPTY1,
+    COMPARE_CHECK_EMPTY2,
+};
+
+typedef struct ImgCompareState {
+    BlockBackend *blk1, *blk2;
+    const char *filename1, *filename2;
+    int64_t total_size1, total_size2;
+    int64_t total_size;     /* size of the area that both images cover */
+    int64_t progress_base;
+    bool strict;
+
+    /* Next offset to be looked at; only advanced under the lock, so that
+     * block status is queried in order while reads run in parallel */
+    int64_t offset;
+    CoMutex lock;
+    int running_coroutines;
+
+    /* Exit code (> 1) and message of the error at the lowest offset, or 0 */
+    int ret;
+    Error *err;
+    int64_t error_offset;
+    /* Lowest offset where the images were found to differ, or INT64_MAX */
+    int64_t mismatch_offset;
+    bool status_mismatch;
+} ImgCompareState;
+
+static void compare_set_mismatch(ImgCompareState *s, int64_t offset,
+                                 bool status_mismatch)
+{
+    if (offset < s->mismatch_offset) {
+        s->mismatch_offset = offset;
+        s->status_mismatch = status_mismatch;
+    }
+}
+
+/*
+ * Errors are only reported if they come before the first difference, like
+ * in a sequential compare, so they are kept until all chunks are done.
+ */
+static void compare_set_error(ImgCompareState *s, int64_t offset, int ret,
+                              Error *err)
+{
+    if (offset < s->error_offset) {
+        error_free(s->err);
+        s->err = err;
+        s->ret = ret;
+        s->error_offset = offset;
+    } else {
+        error_free(err);
+    }
+}
+
+/*
+ * Looks at the block status at s->offset and decides how the next chunk
+ * must be compared. Must be called with s->lock held. Returns false if there
+ * is nothing left to do.
+ */
+static bool coroutine_fn compare_next_chunk(ImgCompareState *s,
+                                            int64_t *offset, int64_t *chunk,
+                                            enum ImgCompareAction *action)
+{
+    int64_t pnum1, pnum2;
+    int status1, status2;
+    bool allocated1, allocated2;
+    Error *err = NULL;
+
+    if (s->offset >= s->progress_base || s->offset >= s->error_offset ||
+        s->offset >= s->mismatch_offset)
+    {
+        return false;
+    }
+
+    *offset = s->offset;
+    *action = COMPARE_NONE;
+
+    if (*offset >= s->total_size) {
+        /* Only the larger image is left; it must read as zeroes */
+        bool over1 = s->total_size1 > s->total_size2;
+        BlockBackend *blk_over = over1 ? s->blk1 : s->blk2;
+
+        status1 = bdrv_block_status_above(blk_bs(blk_over), NULL, *offset,
+                                          s->progress_base - *offset, chunk,
+                                          NULL, NULL);
+        if (status1 < 0) {
+            error_setg(&err, "Sector allocation test failed for %s",
+                       over1 ? s->filename1 : s->filename2);
+            compare_set_error(s, *offset, 3, err);
+            return false;
+        }
+        if (status1 & BDRV_BLOCK_ALLOCATED && !(status1 & BDRV_BLOCK_ZERO)) {
+            *chunk = MIN(*chunk, IO_BUF_SIZE);
+            *action = over1 ? COMPARE_CHECK_EMPTY1 : COMPARE_CHECK_EMPTY2;
+        }
+        s->offset += *chunk;
+        return true;
+    }
+
+    status1 = bdrv_block_status_above(blk_bs(s->blk1), NULL, *offset,
+                                      s->total_size1 - *offset, &pnum1, NULL,
+                                      NULL);
+    if (status1 < 0) {
+        error_setg(&err, "Sector allocation test failed for %s", s->filename1);
+        compare_set_error(s, *offset, 3, err);
+        return false;
+    }
+    allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+
+    status2 = bdrv_block_status_above(blk_bs(s->blk2), NULL, *offset,
+                                      s->total_size2 - *offset, &pnum2, NULL,
+                                      NULL);
+    if (status2 < 0) {
+        error_setg(&err, "Sector allocation test failed for %s", s->filename2);
+        compare_set_error(s, *offset, 3, err);
+        return false;
+    }
+    allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+
+    assert(pnum1 && pnum2);
+    *chunk = MIN(pnum1, pnum2);
+
+    if (s->strict && status1 != status2) {
+        compare_set_mismatch(s, *offset, true);
+        return false;
+    }
+
+    if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
+        /* nothing to do */
+    } else if (allocated1 == allocated2) {
+        if (allocated1) {
+            *chunk = MIN(*chunk, IO_BUF_SIZE);
+            *action = COMPARE_DATA;
+        }
+    } else {
+        *chunk = MIN(*chunk, IO_BUF_SIZE);
+        *action = allocated1 ? COMPARE_CHECK_EMPTY1 : COMPARE_CHECK_EMPTY2;
+    }
+
+    s->offset += *chunk;
+    return true;
+}
+
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    uint8_t *buf1, *buf2;
+
+    s->running_coroutines++;
+    buf1 = blk_blockalign(s->blk1, IO_BUF_SIZE);
+    buf2 = blk_blockalign(s->blk2, IO_BUF_SIZE);
+
+    for (;;) {
+        enum ImgCompareAction action;
+        int64_t offset, chunk, pnum;
+        int64_t mismatch = 0;
+        Error *err = NULL;
+        int ret = 0;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (!compare_next_chunk(s, &offset, &chunk, &action)) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        qemu_co_mutex_unlock(&s->lock);
+
+        switch (action) {
+        case COMPARE_NONE:
+            break;
+        case COMPARE_DATA:
+            ret = blk_pread(s->blk1, offset, buf1, chunk);
+            if (ret < 0) {
+                error_setg_errno(&err, -ret, "Error while reading offset %"
+                                 PRId64 " of %s", offset, s->filename1);
+                ret = 4;
+                break;
+            }
+            ret = blk_pread(s->blk2, offset, buf2, chunk);
+            if (ret < 0) {
+                error_setg_errno(&err, -ret, "Error while reading offset %"
+                                 PRId64 " of %s", offset, s->filename2);
+                ret = 4;
+                break;
+            }
+            ret = compare_buffers(buf1, buf2, chunk, &pnum);
+            if (ret || pnum != chunk) {
+                mismatch = offset + (ret ? 0 : pnum);
+                ret = 1;
+            }
+            break;
+        case COMPARE_CHECK_EMPTY1:
+            ret = check_empty_sectors(s->blk1, offset, chunk, s->filename1,
+                                      buf1, &mismatch, &err);
+            break;
+        case COMPARE_CHECK_EMPTY2:
+            ret = check_empty_sectors(s->blk2, offset, chunk, s->filename2,
+                                      buf1, &mismatch, &err);
+            break;
+        }
+
+        if (ret == 1) {
+            compare_set_mismatch(s, mismatch, false);
+        } else if (ret) {
+            compare_set_error(s, offset, ret, err);
+            break;
+        }
+
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1235,22 +1466,17 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
     bool writethrough;
-    int64_t total_size;
-    int64_t offset = 0;
-    int64_t chunk;
-    int c;
+    int c, i;
+    long num_coroutines = 8;
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
+    ImgCompareState s;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1261,7 +1487,7 @@ static int img_compare(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:T:pqsm:U",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1294,6 +1520,15 @@ static int img_compare(int argc, char **argv)
         case 's':
             strict = true;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = 2;
+                goto out4;
+            }
+            break;
         case 'U':
             force_share = true;
             break;
@@ -1355,11 +1590,6 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
-
-    buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1374,7 +1604,6 @@ static int img_compare(int argc, char **argv)
         ret = 4;
         goto out;
     }
-    total_size = MIN(total_size1, total_size2);
     progress_base = MAX(total_size1, total_size2);
 
     qemu_progress_print(0, 100);
@@ -1385,131 +1614,62 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+    s = (ImgCompareState) {
+        .blk1               = blk1,
+        .blk2               = blk2,
+        .filename1          = filename1,
+        .filename2          = filename2,
+        .total_size1        = total_size1,
+        .total_size2        = total_size2,
+        .total_size         = MIN(total_size1, total_size2),
+        .progress_base      = progress_base,
+        .strict             = strict,
+        .error_offset       = INT64_MAX,
+        .mismatch_offset    = INT64_MAX,
+    };
+    qemu_co_mutex_init(&s.lock);
 
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
+    /* Block status is queried in order under s.lock, while the data of up
+     * to num_coroutines chunks is read and compared in parallel. All chunks
+     * before a difference are always checked, so the first difference is
+     * reported no matter which coroutine finds it first. */
+    for (i = 0; i < num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(compare_co_do_compare, &s));
+    }
+    while (s.running_coroutines) {
+        main_loop_wait(false);
+    }
 
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
+    if (s.error_offset < s.mismatch_offset) {
+        error_report_err(s.err);
+        ret = s.ret;
+        goto out;
+    }
+    error_free(s.err);
 
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, buf1, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, buf2, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
+    if (s.mismatch_offset != INT64_MAX) {
+        if (s.status_mismatch) {
+            qprintf(quiet, "Strict mode: Offset %" PRId64
+                    " block status mismatch!\n", s.mismatch_offset);
         } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
+            if (s.mismatch_offset >= s.total_size) {
+                qprintf(quiet, "Warning: Image size mismatch!\n");
             }
+            qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
+                    s.mismatch_offset);
         }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+        ret = 1;
+        goto out;
     }
 
     if (total_size1 != total_size2) {
-        BlockBackend *blk_over;
-        const char *filename_over;
-
         qprintf(quiet, "Warning: Image size mismatch!\n");
-        if (total_size1 > total_size2) {
-            blk_over = blk1;
-            filename_over = filename1;
-        } else {
-            blk_over = blk2;
-            filename_over = filename2;
-        }
-
-        while (offset < progress_base) {
-            ret = bdrv_block_status_above(blk_bs(blk_over), NULL, offset,
-                                          progress_base - offset, &chunk,
-                                          NULL, NULL);
-            if (ret < 0) {
-                ret = 3;
-                error_report("Sector allocation test failed for %s",
-                             filename_over);
-                goto out;
-
-            }
-            if (ret & BDRV_BLOCK_ALLOCATED && !(ret & BDRV_BLOCK_ZERO)) {
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = check_empty_sectors(blk_over, offset, chunk,
-                                          filename_over, buf1, quiet);
-                if (ret) {
-                    goto out;
-                }
-            }
-            offset += chunk;
-            qemu_progress_print(((float) chunk / progress_base) * 100, 100);
-        }
     }
 
     qprintf(quiet, "Images are identical.\n");
     ret = 0;
 
 out:
-    qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1525,8 +1685,6 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
-
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1543,6 +1701,7 @@ typedef struct ImgConvertState {
     bool compressed;
     bool target_has_backing;
     bool wr_in_order;
+    bool copy_range;
     int min_sparse;
     size_t cluster_sectors;
     size_t buf_sectors;
@@ -1736,6 +1895,38 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
     return 0;
 }
 
+static int coroutine_fn convert_co_copy_range(ImgConvertState *s,
+                                              int64_t sector_num,
+                                              int nb_sectors)
+{
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        BlockBackend *blk;
+        int src_cur;
+        int64_t bs_sectors, src_cur_offset, offset;
+
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        blk = s->src[src_cur];
+        bs_sectors = s->src_sectors[src_cur];
+        offset = (sector_num - src_cur_offset) << BDRV_SECTOR_BITS;
+
+        n = MIN(nb_sectors, bs_sectors - (sector_num - src_cur_offset));
+
+        ret = blk_co_copy_range(blk, offset,
+                                s->target, sector_num << BDRV_SECTOR_BITS,
+                                n << BDRV_SECTOR_BITS, BDRV_REQ_NO_FALLBACK);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    return 0;
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1758,6 +1949,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
+        bool copy_range;
 
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
@@ -1787,7 +1979,9 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
                                         s->allocated_sectors, 0);
         }
 
-        if (status == BLK_DATA) {
+retry:
+        copy_range = s->copy_range && status == BLK_DATA;
+        if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
                 error_report("error while reading sector %" PRId64
@@ -1809,7 +2003,18 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         }
 
         if (s->ret == -EINPROGRESS) {
-            ret = convert_co_write(s, sector_num, n, buf, status);
+            if (copy_range) {
+                ret = convert_co_copy_range(s, sector_num, n);
+                if (ret == -ENOTSUP) {
+                    /* Offloading is not possible for this pair of nodes, go
+                     * back to reading into the bounce buffer for the rest of
+                     * the conversion */
+                    s->copy_range = false;
+                    goto retry;
+                }
+            } else {
+                ret = convert_co_write(s, sector_num, n, buf, status);
+            }
             if (ret < 0) {
                 error_report("error while writing sector %" PRId64
                              ": %s", sector_num, strerror(-ret));
@@ -1946,7 +2151,7 @@ static int img_convert(int argc, char **argv)
             {"target-image-opts", no_argument, 0, OPTION_TARGET_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:O:B:co:s:l:S:pt:T:qnm:WU",
+        c = getopt_long(argc, argv, ":hf:O:B:Cco:s:l:S:pt:T:qnm:WU",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1970,6 +2175,9 @@ static int img_convert(int argc, char **argv)
         case 'B':
             out_baseimg = optarg;
             break;
+        case 'C':
+            s.copy_range = true;
+            break;
         case 'c':
             s.compressed = true;
             break;
@@ -2072,8 +2280,8 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
-    if (!s.wr_in_order && s.compressed) {
-        error_report("Out of order write and compress are mutually exclusive");
+    if (s.copy_range && s.compressed) {
+        error_report("Cannot enable copy offloading when -c is used");
         goto fail_getopt;
     }
 
@@ -2727,6 +2935,43 @@ static inline bool entry_mergeable(const MapEntry *curr, const MapEntry *next)
     return true;
 }
 
+/* img_map() walks the block status of up to MAP_COROUTINES windows of
+ * MAP_WINDOW_SIZE bytes in parallel, and merges the results in order */
+#define MAP_WINDOW_SIZE (1 << 30)
+#define MAP_COROUTINES 8
+
+typedef struct ImgMapWindow {
+    BlockDriverState *bs;
+    int64_t start;
+    int64_t end;
+    GArray *entries;
+    int ret;
+    int *running;
+} ImgMapWindow;
+
+static void coroutine_fn map_co_walk_window(void *opaque)
+{
+    ImgMapWindow *w = opaque;
+    int64_t offset = w->start;
+
+    while (offset < w->end) {
+        int64_t n = QEMU_ALIGN_DOWN(w->end - offset, BDRV_SECTOR_SIZE);
+        MapEntry e;
+
+        if (n == 0) {
+            break;
+        }
+        w->ret = get_block_status(w->bs, offset, n, &e);
+        if (w->ret < 0) {
+            break;
+        }
+        g_array_append_val(w->entries, e);
+        offset += e.length;
+    }
+
+    (*w->running)--;
+}
+
 static int img_map(int argc, char **argv)
 {
     int c;
@@ -2734,8 +2979,12 @@ static int img_map(int argc, char **argv)
     BlockBackend *blk;
     BlockDriverState *bs;
     const char *filename, *fmt, *output;
-    int64_t length;
+    int64_t length, offset;
     MapEntry curr = { .length = 0 }, next;
+    ImgMapWindow windows[MAP_COROUTINES];
+    int nb_windows, running;
+    unsigned int j;
+    int i;
     int ret = 0;
     bool image_opts = false;
     bool force_share = false;
@@ -2821,28 +3070,58 @@ static int img_map(int argc, char **argv)
     }
 
     length = blk_getlength(blk);
-    while (curr.start + curr.length < length) {
-        int64_t offset = curr.start + curr.length;
-        int64_t n;
+    offset = 0;
+    while (offset < length) {
+        running = 0;
+        for (i = 0; i < MAP_COROUTINES && offset < length; i++) {
+            windows[i] = (ImgMapWindow) {
+                .bs         = bs,
+                .start      = offset,
+                .end        = MIN(offset + MAP_WINDOW_SIZE, length),
+                .entries    = g_array_new(false, false, sizeof(MapEntry)),
+                .running    = &running,
+            };
+            offset = windows[i].end;
+            running++;
+        }
+        nb_windows = i;
+
+        for (i = 0; i < nb_windows; i++) {
+            qemu_coroutine_enter(qemu_coroutine_create(map_co_walk_window,
+                                                       &windows[i]));
+        }
+        while (running) {
+            main_loop_wait(false);
+        }
+
+        for (i = 0; i < nb_windows && ret == 0; i++) {
+            for (j = 0; j < windows[i].entries->len; j++) {
+                next = g_array_index(windows[i].entries, MapEntry, j);
+
+                if (entry_mergeable(&curr, &next)) {
+                    curr.length += next.length;
+                    continue;
+                }
 
-        /* Probe up to 1 GiB at a time.  */
-        n = QEMU_ALIGN_DOWN(MIN(1 << 30, length - offset), BDRV_SECTOR_SIZE);
-        ret = get_block_status(bs, offset, n, &next);
+                if (curr.length > 0) {
+                    dump_map_entry(output_format, &curr, &next);
+                }
+                curr = next;
+            }
 
-        if (ret < 0) {
-            error_report("Could not read file metadata: %s", strerror(-ret));
-            goto out;
+            if (windows[i].ret < 0) {
+                ret = windows[i].ret;
+                error_report("Could not read file metadata: %s",
+                             strerror(-ret));
+            }
         }
 
-        if (entry_mergeable(&curr, &next)) {
-            curr.length += next.length;
-            continue;
+        for (i = 0; i < nb_windows; i++) {
+            g_array_free(windows[i].entries, true);
         }
-
-        if (curr.length > 0) {
-            dump_map_entry(output_format, &curr, &next);
+        if (ret < 0) {
+            goto out;
         }
-        curr = next;
     }
 
     dump_map_entry(output_format, &curr, NULL);
@@ -3873,7 +4152,8 @@ static int img_bench(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hc:d:f:no:qs:S:t:wU", long_options, NULL);
+        c = getopt_long(argc, argv, ":hc:d:f:i:no:qs:S:t:wU", long_options,
+                        NULL);
         if (c == -1) {
             break;
         }
@@ -3913,6 +4193,12 @@ static int img_bench(int argc, char **argv)
         case 'f':
             fmt = optarg;
             break;
+        case 'i':
+            if (bdrv_parse_aio(optarg, &flags) < 0) {
+                error_report("Invalid aio option: %s", optarg);
+                return 1;
+            }
+            break;
         case 'n':
             flags |= BDRV_O_NATIVE_AIO;
             break;
@@ -0,0 +1,173 @@
+/*
+ * NBD client multi-connection throughput benchmark
+ *
+ * Starts a local qemu-nbd (taken from $QEMU_NBD, or ./qemu-nbd) that serves
+ * a null-co image over a Unix socket, and measures read throughput of the
+ * nbd block driver with a varying number of connections.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/main-loop.h"
+#include "qemu/coroutine.h"
+#include "sysemu/block-backend.h"
+#include "block/block.h"
+
+#define IMAGE_SIZE      (1ULL << 30)
+#define REQUEST_SIZE    (1 << 20)
+#define QUEUE_DEPTH     16
+
+static const int nb_connections[] = { 1, 2, 4, 8 };
+
+static char *socket_path;
+
+typedef struct BenchState {
+    BlockBackend *blk;
+    uint64_t offset;
+    uint64_t bytes;
+    int running;
+    bool failed;
+} BenchState;
+
+static void coroutine_fn bench_read_co(void *opaque)
+{
+    BenchState *b = opaque;
+    void *buf = blk_blockalign(b->blk, REQUEST_SIZE);
+    struct iovec iov = { .iov_base = buf, .iov_len = REQUEST_SIZE };
+    QEMUIOVector qiov;
+
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    while (!b->failed && g_test_timer_elapsed() < 2.0) {
+        uint64_t offset = b->offset;
+
+        b->offset = (b->offset + REQUEST_SIZE) % IMAGE_SIZE;
+        if (blk_co_preadv(b->blk, offset, REQUEST_SIZE, &qiov, 0) < 0) {
+            b->failed = true;
+            break;
+        }
+        b->bytes += REQUEST_SIZE;
+    }
+
+    qemu_vfree(buf);
+    b->running--;
+}
+
+static void test_nbd_read_speed(const void *opaque)
+{
+    int connections = (int)(uintptr_t)opaque;
+    QDict *options = qdict_new();
+    BenchState b = { 0 };
+    double total, secs;
+    char *value;
+    int i;
+
+    qdict_put_str(options, "driver", "nbd");
+    qdict_put_str(options, "server.type", "unix");
+    qdict_put_str(options, "server.path", socket_path);
+    value = g_strdup_printf("%d", connections);
+    qdict_put_str(options, "connections", value);
+    g_free(value);
+
+    b.blk = blk_new_open(NULL, NULL, options, 0, &error_abort);
+
+    g_test_timer_start();
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        b.running++;
+        qemu_coroutine_enter(qemu_coroutine_create(bench_read_co, &b));
+    }
+    while (b.running) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    secs = g_test_timer_elapsed();
+    g_assert(!b.failed);
+
+    total = (double)b.bytes / (1024 * 1024 * 1024); /* to GB */
+    g_print("nbd: %d connection(s), queue depth %d: ", connections,
+            QUEUE_DEPTH);
+    g_print("read %.2f GB in %.2f secs: %.2f GB/sec\n",
+            total, secs, total / secs);
+
+    blk_unref(b.blk);
+}
+
+static GPid start_qemu_nbd(const char *qemu_nbd)
+{
+    char *image = g_strdup_printf("driver=null-co,size=%llu",
+                                  (unsigned long long)IMAGE_SIZE);
+    char *shared = g_strdup_printf("%d",
+        nb_connections[ARRAY_SIZE(nb_connections) - 1]);
+    char *argv[] = {
+        (char *)qemu_nbd, (char *)"--read-only", (char *)"--persistent",
+        (char *)"--shared", shared, (char *)"--socket", socket_path,
+        (char *)"--image-opts", image, NULL
+    };
+    GError *err = NULL;
+    GPid pid;
+    int i;
+
+    if (!g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                       NULL, NULL, &pid, &err)) {
+        g_printerr("Failed to start %s: %s\n", qemu_nbd, err->message);
+        exit(EXIT_FAILURE);
+    }
+    g_free(image);
+    g_free(shared);
+
+    /* Wait for the server to create its socket */
+    for (i = 0; i < 100 && !g_file_test(socket_path, G_FILE_TEST_EXISTS);
+         i++) {
+        g_usleep(100 * 1000);
+    }
+    g_assert(g_file_test(socket_path, G_FILE_TEST_EXISTS));
+
+    return pid;
+}
+
+int main(int argc, char **argv)
+{
+    const char *qemu_nbd = getenv("QEMU_NBD") ?: "./qemu-nbd";
+    char *tmpdir;
+    char name[64];
+    GPid pid;
+    size_t i;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (!g_file_test(qemu_nbd, G_FILE_TEST_IS_EXECUTABLE)) {
+        g_print("nbd: %s not found, skipping\n", qemu_nbd);
+        return 0;
+    }
+
+    qemu_init_main_loop(&error_abort);
+    bdrv_init();
+
+    tmpdir = g_dir_make_tmp("benchmark-nbd-XXXXXX", NULL);
+    g_assert(tmpdir);
+    socket_path = g_strdup_printf("%s/nbd.sock", tmpdir);
+    pid = start_qemu_nbd(qemu_nbd);
+
+    for (i = 0; i < ARRAY_SIZE(nb_connections); i++) {
+        snprintf(name, sizeof(name), "/nbd/read-speed/conns-%d",
+                 nb_connections[i]);
+        g_test_add_data_func(name, (void *)(uintptr_t)nb_connections[i],
+                             test_nbd_read_speed);
+    }
+
+    ret = g_test_run();
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    g_spawn_close_pid(pid);
+    unlink(socket_path);
+    rmdir(tmpdir);
+    g_free(socket_path);
+    g_free(tmpdir);
+
+    return ret;
+}
@@ -0,0 +1,109 @@
+/*
+ * Xor Based Zero Run Length Encoding speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/cutils.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NR_PAGES 256
+
+/* Percentage of bytes changed between the old and the new pages */
+static const int dirty_ratios[] = { 1, 5, 25, 50 };
+
+static void test_xbzrle_speed(const void *opaque)
+{
+    int ratio = (int)(uintptr_t)opaque;
+    uint8_t *old = g_malloc(PAGE_SIZE * NR_PAGES);
+    uint8_t *new = g_malloc(PAGE_SIZE * NR_PAGES);
+    uint8_t *encoded = g_malloc(PAGE_SIZE * NR_PAGES);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int enc_len[NR_PAGES];
+    double total, secs;
+    int i, j;
+
+    for (i = 0; i < PAGE_SIZE * NR_PAGES; i++) {
+        old[i] = new[i] = g_test_rand_int();
+    }
+    /* Change short runs, which is what write-heavy guests look like */
+    for (i = 0; i < NR_PAGES; i++) {
+        uint8_t *n = new + i * PAGE_SIZE;
+        int changed = PAGE_SIZE * ratio / 100;
+
+        while (changed > 0) {
+            int pos = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, 16);
+
+            for (j = 0; j < len && pos + j < PAGE_SIZE; j++) {
+                n[pos + j] = ~n[pos + j];
+            }
+            changed -= len;
+        }
+    }
+
+    total = 0.0;
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            enc_len[i] = xbzrle_encode_buffer(old + i * PAGE_SIZE,
+                                              new + i * PAGE_SIZE,
+                                              PAGE_SIZE,
+                                              encoded + i * PAGE_SIZE,
+                                              PAGE_SIZE);
+        }
+        total += PAGE_SIZE * NR_PAGES;
+    } while (g_test_timer_elapsed() < 2.0);
+    secs = g_test_timer_last();
+
+    total /= 1024 * 1024 * 1024; /* to GB */
+    g_print("xbzrle: dirty %d%%: ", ratio);
+    g_print("encode %.2f GB in %.2f secs: %.2f GB/sec\n",
+            total, secs, total / secs);
+
+    total = 0.0;
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            /* pages that did not fit are sent in full, skip them */
+            if (enc_len[i] > 0) {
+                memcpy(decoded, old + i * PAGE_SIZE, PAGE_SIZE);
+                g_assert(xbzrle_decode_buffer(encoded + i * PAGE_SIZE,
+                                              enc_len[i], decoded,
+                                              PAGE_SIZE) >= 0);
+            }
+        }
+        total += PAGE_SIZE * NR_PAGES;
+    } while (g_test_timer_elapsed() < 2.0);
+    secs = g_test_timer_last();
+
+    total /= 1024 * 1024 * 1024; /* to GB */
+    g_print("xbzrle: dirty %d%%: ", ratio);
+    g_print("decode %.2f GB in %.2f secs: %.2f GB/sec\n",
+            total, secs, total / secs);
+
+    g_free(old);
+    g_free(new);
+    g_free(encoded);
+    g_free(decoded);
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    char name[64];
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(dirty_ratios); i++) {
+        snprintf(name, sizeof(name), "/xbzrle/speed-%d", dirty_ratios[i]);
+        g_test_add_data_func(name, (void *)(uintptr_t)dirty_ratios[i],
+                             test_xbzrle_speed);
+    }
+
+    return g_test_run();
+}
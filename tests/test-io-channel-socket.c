@@ -445,6 +445,7 @@ static void test_io_channel_unix_fd_pass(void)
                             G_N_ELEMENTS(iosend),
                             fdsend,
                             G_N_ELEMENTS(fdsend),
+                            0,
                             &error_abort);
 
     qio_channel_readv_full(dst,
@@ -524,6 +525,50 @@ static void test_io_channel_unix_listen_cleanup(void)
 #endif /* _WIN32 */
 
 
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst;
+    char bufsend[4096], bufrecv[4096];
+    struct iovec iov = { .iov_base = bufsend, .iov_len = sizeof(bufsend) };
+
+    listen_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    listen_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    connect_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &src, &dst);
+
+    /* Older kernels have no MSG_ZEROCOPY, nothing to test then */
+    if (qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        memset(bufsend, 0x5a, sizeof(bufsend));
+        qio_channel_writev_all_flags(src, &iov, 1,
+                                     QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                                     &error_abort);
+        g_assert_cmpint(qio_channel_flush(src, &error_abort), >=, 0);
+
+        qio_channel_read_all(dst, bufrecv, sizeof(bufrecv), &error_abort);
+        g_assert(memcmp(bufsend, bufrecv, sizeof(bufsend)) == 0);
+
+        /* Nothing is left in flight */
+        g_assert_cmpint(qio_channel_flush(src, &error_abort), ==, 0);
+    }
+
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
+
+
 static void test_io_channel_ipv4_fd(void)
 {
     QIOChannel *ioc;
@@ -577,6 +622,8 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
@@ -667,6 +667,35 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_compute_cost(void)
+{
+    throttle_config_init(&cfg);
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* no limits */
+    g_assert(double_cmp(throttle_compute_cost(&ts, false, 512), 0));
+
+    /* bps limits charge bytes */
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1024;
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    g_assert(double_cmp(throttle_compute_cost(&ts, false, 512), 0.5));
+    g_assert(double_cmp(throttle_compute_cost(&ts, true, 2048), 2));
+
+    /* the most restrictive limit wins, and only the ones of the same type
+     * of operation apply */
+    cfg.buckets[THROTTLE_OPS_READ].avg = 1;
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    g_assert(double_cmp(throttle_compute_cost(&ts, false, 512), 1));
+    g_assert(double_cmp(throttle_compute_cost(&ts, true, 512), 0.5));
+    g_assert(double_cmp(throttle_compute_cost(&ts, false, 4096), 4));
+
+    /* iops limits honour iops-size */
+    cfg.op_size = 512;
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    g_assert(double_cmp(throttle_compute_cost(&ts, false, 8192), 16));
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -760,6 +789,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/compute_cost",       test_compute_cost);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
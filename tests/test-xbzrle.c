@@ -174,6 +174,64 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc0(PAGE_SIZE * 64);
+    uint8_t *new = g_malloc0(PAGE_SIZE * 64);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *reference = g_malloc(PAGE_SIZE * 64);
+    int ref_len[64];
+    int i, j, rc;
+
+    /* Pages with runs of every length, including ones crossing the
+     * vector boundaries, and some that overflow the destination.
+     */
+    for (i = 0; i < 64; i++) {
+        uint8_t *o = old + i * PAGE_SIZE;
+        uint8_t *n = new + i * PAGE_SIZE;
+        int runs = g_test_rand_int_range(0, 1 << (i % 12));
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            o[j] = n[j] = g_test_rand_int();
+        }
+        for (j = 0; j < runs; j++) {
+            int pos = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, 80);
+
+            while (len-- && pos < PAGE_SIZE) {
+                n[pos++] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+    }
+
+    /* The most preferred implementation runs first; every slower one
+     * must produce the same stream.
+     */
+    for (i = 0; i < 64; i++) {
+        ref_len[i] = xbzrle_encode_buffer(old + i * PAGE_SIZE,
+                                          new + i * PAGE_SIZE, PAGE_SIZE,
+                                          reference + i * PAGE_SIZE,
+                                          PAGE_SIZE);
+    }
+    while (test_xbzrle_encode_next_accel()) {
+        for (i = 0; i < 64; i++) {
+            rc = xbzrle_encode_buffer(old + i * PAGE_SIZE,
+                                      new + i * PAGE_SIZE, PAGE_SIZE,
+                                      compressed, PAGE_SIZE);
+            g_assert_cmpint(rc, ==, ref_len[i]);
+            if (rc > 0) {
+                g_assert(memcmp(compressed, reference + i * PAGE_SIZE,
+                                rc) == 0);
+            }
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(compressed);
+    g_free(reference);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +244,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* Must come last, it leaves the generic encoder selected */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
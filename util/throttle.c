@@ -445,28 +445,82 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
-/* do the accounting for this operation
+/* Compute how long the next operation has to wait, without arming a timer.
+ * This is used for limits that are shared by several ThrottleStates, whose
+ * requests wait on timers of their own.
  *
  * @is_write: the type of operation (read/write)
- * @size:     the size of the operation
+ * @now:      the current clock timestamp
+ * @ret:      the time to wait in ns, or 0 if the operation can go through
  */
-void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+int64_t throttle_compute_delay(ThrottleState *ts, bool is_write, int64_t now)
 {
-    const BucketType bucket_types_size[2][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    const BucketType bucket_types_units[2][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
-    double units = 1.0;
-    unsigned i;
+    int64_t next_timestamp;
 
+    throttle_compute_timer(ts, is_write, now, &next_timestamp);
+    return next_timestamp - now;
+}
+
+/* The buckets that an operation is accounted in, by size and by count */
+static const BucketType bucket_types_size[2][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+static const BucketType bucket_types_units[2][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
+/* The number of operations that a request of @size bytes counts as */
+static double throttle_units(ThrottleState *ts, uint64_t size)
+{
     /* if cfg.op_size is defined and smaller than size we compute unit count */
     if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
+        return (double) size / ts->cfg.op_size;
     }
+    return 1.0;
+}
+
+/* Compute how much of the capacity of a ThrottleState an operation uses:
+ * the time it takes any of the buckets it is accounted in to leak it at
+ * their average rate, whichever is longest.
+ *
+ * @is_write: the type of operation (read/write)
+ * @size:     the size of the operation
+ * @ret:      the cost in seconds, or 0 if no limits apply to the operation
+ */
+double throttle_compute_cost(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    double units = throttle_units(ts, size);
+    double cost = 0;
+    unsigned i;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+        if (bkt->avg) {
+            cost = MAX(cost, (double) size / bkt->avg);
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+        if (bkt->avg) {
+            cost = MAX(cost, units / bkt->avg);
+        }
+    }
+
+    return cost;
+}
+
+/* do the accounting for this operation
+ *
+ * @is_write: the type of operation (read/write)
+ * @size:     the size of the operation
+ */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    double units = throttle_units(ts, size);
+    unsigned i;
 
     for (i = 0; i < 2; i++) {
         LeakyBucket *bkt;